@@ -1,4 +1,5 @@
 #!/usr/bin/env python
+import os
 from setuptools import setup, Extension
 import sys
 
@@ -8,6 +9,16 @@ if 'upload' in sys.argv:
     with open('README.rst') as f:
         long_description = f.read()
 
+define_macros = []
+if os.environ.get('SORTEDMAP_STATS'):
+    # compile in the operation counters exposed through ``sortedmap.stats``
+    define_macros.append(('SORTEDMAP_STATS', None))
+
+libraries = []
+if sys.platform.startswith('linux'):
+    # ``shm_open`` for ``sharedmap`` lives in librt before glibc 2.34
+    libraries.append('rt')
+
 
 classifiers = [
     'Development Status :: 3 - Alpha',
@@ -38,7 +49,14 @@ setup(
             'sortedmap._sortedmap',
             ['sortedmap/_sortedmap.cpp'],
             include_dirs=['sortedmap/include'],
-            depends=['sortedmap/include/sortedmap.h'],
+            depends=[
+                'sortedmap/include/sharedmap.h',
+                'sortedmap/include/sortedmap.h',
+                'sortedmap/include/sortedmultimap.h',
+                'sortedmap/include/sortedset.h',
+            ],
+            define_macros=define_macros,
+            libraries=libraries,
             extra_compile_args=[
                 '-Wall',
                 '-Wextra',
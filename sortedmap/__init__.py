@@ -1,6 +1,7 @@
 from collections import MutableMapping
 
-from ._sortedmap import sortedmap
+from ._sortedmap import sortedmap, sortedmultimap, sortedset
+from .journal import recover
 
 
 MutableMapping.register(sortedmap)
@@ -11,5 +12,16 @@ __version__ = '0.2.0'
 
 
 __all__ = [
+    'recover',
     'sortedmap',
+    'sortedmultimap',
+    'sortedset',
 ]
+
+try:
+    from ._sortedmap import sharedmap
+except ImportError:
+    # POSIX shared memory is not available on this platform
+    pass
+else:
+    __all__.append('sharedmap')
@@ -1,15 +1,45 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <vector>
 #include <exception>
 #include <map>
-
+#include <string>
+#include <unordered_set>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif  // __GLIBC__
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "sharedmap.h"
 #include "sortedmap.h"
+#include "sortedmultimap.h"
+#include "sortedset.h"
 
 const char *sortedmap::keyiter::name = "sortedmap.keyiter";
 const char *sortedmap::valiter::name = "sortedmap.valiter";
 const char *sortedmap::itemiter::name = "sortedmap.itemiter";
+const char *sortedmap::chunkiter::name = "sortedmap.chunkiter";
+const char *sortedmap::finger::name = "sortedmap.finger";
 const char *sortedmap::keyview::name = "sortedmap.keyview";
 const char *sortedmap::valview::name = "sortedmap.valview";
 const char *sortedmap::itemview::name = "sortedmap.itemview";
+const char *sortedmultimap::keyiter::name = "sortedmap.multimap_keyiter";
+const char *sortedmultimap::valiter::name = "sortedmap.multimap_valiter";
+const char *sortedmultimap::itemiter::name = "sortedmap.multimap_itemiter";
+const char *sortedmultimap::keyview::name = "sortedmap.multimap_keyview";
+const char *sortedmultimap::valview::name = "sortedmap.multimap_valview";
+const char *sortedmultimap::itemview::name = "sortedmap.multimap_itemview";
+const char *sortedset::iter::name = "sortedmap.sortedset_iter";
 
 PyObject*
 py_identity(PyObject *ob) {
@@ -17,10 +47,120 @@ py_identity(PyObject *ob) {
     return ob;
 }
 
+// ``operator.itemgetter`` and ``operator.attrgetter``, keyfuncs of these
+// types are applied without calling back into Python.
+static PyTypeObject *itemgetter_type = NULL;
+static PyTypeObject *attrgetter_type = NULL;
+
+bool
+sortedmap::Comparator::import_extractors() {
+    PyObject *operator_;
+    PyObject *itemgetter;
+    PyObject *attrgetter;
+
+    if (!(operator_ = PyImport_ImportModule("operator"))) {
+        return false;
+    }
+    itemgetter = PyObject_GetAttrString(operator_, "itemgetter");
+    attrgetter = PyObject_GetAttrString(operator_, "attrgetter");
+    Py_DECREF(operator_);
+    if (!itemgetter || !attrgetter ||
+        !PyType_Check(itemgetter) || !PyType_Check(attrgetter)) {
+        Py_XDECREF(itemgetter);
+        Py_XDECREF(attrgetter);
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError,
+                            "operator.itemgetter and operator.attrgetter"
+                            " must be types");
+        }
+        return false;
+    }
+    // the module keeps the types alive for the life of the interpreter
+    itemgetter_type = (PyTypeObject*) itemgetter;
+    attrgetter_type = (PyTypeObject*) attrgetter;
+    return true;
+}
+
+void
+sortedmap::Comparator::classify() {
+    PyObject *reduced;
+    PyObject *args;
+    PyObject *arg;
+
+    keyarg = NULL;
+    if (!keyfunc) {
+        kind = extractor::identity;
+        return;
+    }
+
+    kind = extractor::call;
+    if (Py_TYPE(keyfunc) != itemgetter_type &&
+        Py_TYPE(keyfunc) != attrgetter_type) {
+        return;
+    }
+
+    // The getters do not expose what they get so read it back from
+    // ``__reduce__`` which returns ``(type, (item_or_attr, ...))``. This is
+    // only done for single items or attributes, anything else is called.
+    reduced = PyObject_CallMethod(keyfunc, (char*) "__reduce__", NULL);
+    if (!reduced) {
+        PyErr_Clear();
+        return;
+    }
+    if (!PyTuple_Check(reduced) || PyTuple_GET_SIZE(reduced) < 2 ||
+        !PyTuple_Check(args = PyTuple_GET_ITEM(reduced, 1)) ||
+        PyTuple_GET_SIZE(args) != 1) {
+        Py_DECREF(reduced);
+        return;
+    }
+    arg = PyTuple_GET_ITEM(args, 0);
+
+    if (Py_TYPE(keyfunc) == itemgetter_type) {
+        Py_INCREF(arg);
+        keyarg = arg;
+        kind = extractor::item;
+    }
+#if !COMPILING_IN_PY2
+    else if (PyUnicode_Check(arg)) {
+        PyObject *sep = PyUnicode_FromString(".");
+        PyObject *names = (sep) ? PyUnicode_Split(arg, sep, -1) : NULL;
+
+        Py_XDECREF(sep);
+        if (names) {
+            keyarg = PySequence_Tuple(names);
+            Py_DECREF(names);
+        }
+        if (keyarg) {
+            kind = extractor::attr;
+        }
+        else {
+            PyErr_Clear();
+        }
+    }
+#endif  // !COMPILING_IN_PY2
+    Py_DECREF(reduced);
+}
+
 PyObject *
 sortedmap::Comparator::call(PyObject *ob) {
+#if HAVE_VECTORCALL_CALL
+    // leave a slot in front of the argument so that bound methods may
+    // prepend ``self`` in place instead of copying the arguments
+    PyObject *args[] = {NULL, ob};
+
+    return PyObject_Vectorcall(keyfunc,
+                               args + 1,
+                               1 | PY_VECTORCALL_ARGUMENTS_OFFSET,
+                               NULL);
+#else
     PyObject *ret;
 
+    if (unlikely(!argtuple)) {
+        if (!(argtuple = PyTuple_New(1))) {
+            throw PythonError();
+        }
+    }
+
     PyTuple_SET_ITEM(argtuple, 0, ob);
     ret = PyObject_Call(keyfunc, argtuple, NULL);
     if (Py_REFCNT(argtuple) != 1) {
@@ -34,59 +174,330 @@ sortedmap::Comparator::call(PyObject *ob) {
         PyTuple_SET_ITEM(argtuple, 0, NULL);
     }
     return ret;
+#endif  // HAVE_VECTORCALL_CALL
+}
+
+PyObject*
+sortedmap::Comparator::extract(PyObject *ob) {
+    PyObject *ret;
+
+    STAT_INC(stats, keyfunc_calls);
+    switch (kind) {
+    case extractor::item:
+        return PyObject_GetItem(ob, keyarg);
+    case extractor::attr:
+        Py_INCREF(ob);
+        for (Py_ssize_t ix = 0; ix < PyTuple_GET_SIZE(keyarg); ++ix) {
+            ret = PyObject_GetAttr(ob, PyTuple_GET_ITEM(keyarg, ix));
+            Py_DECREF(ob);
+            if (!(ob = ret)) {
+                return NULL;
+            }
+        }
+        return ob;
+    default:
+        return call(ob);
+    }
 }
 
 sortedmap::Comparator::Comparator() {
-    this->keyfunc = NULL;
+    keyfunc = NULL;
+    reverse = false;
+    kind = extractor::identity;
+    keyarg = NULL;
+#if !HAVE_VECTORCALL_CALL
     argtuple = NULL;
+#endif  // !HAVE_VECTORCALL_CALL
+    stats = NULL;
 }
 
-sortedmap::Comparator::Comparator(PyObject *keyfunc) {
+sortedmap::Comparator::Comparator(PyObject *keyfunc,
+                                  bool reverse,
+                                  sortedmap::counters *stats) {
     this->keyfunc = keyfunc;
     Py_XINCREF(keyfunc);
+    this->reverse = reverse;
+    classify();
+#if !HAVE_VECTORCALL_CALL
     argtuple = NULL;
+#endif  // !HAVE_VECTORCALL_CALL
+    this->stats = stats;
+}
+
+sortedmap::Comparator::Comparator(const Comparator &other) {
+    keyfunc = other.keyfunc;
+    Py_XINCREF(keyfunc);
+    reverse = other.reverse;
+    kind = other.kind;
+    keyarg = other.keyarg;
+    Py_XINCREF(keyarg);
+#if !HAVE_VECTORCALL_CALL
+    argtuple = NULL;
+#endif  // !HAVE_VECTORCALL_CALL
+    stats = other.stats;
 }
 
 sortedmap::Comparator::~Comparator() {
     Py_XDECREF(keyfunc);
+    Py_XDECREF(keyarg);
+#if !HAVE_VECTORCALL_CALL
     Py_XDECREF(argtuple);
+#endif  // !HAVE_VECTORCALL_CALL
 }
 
 sortedmap::Comparator&
 sortedmap::Comparator::operator=(const Comparator &other) {
+    Py_XINCREF(other.keyfunc);
+    Py_XDECREF(keyfunc);
     keyfunc = other.keyfunc;
-    Py_XINCREF(keyfunc);
-    argtuple = NULL;
+    Py_XINCREF(other.keyarg);
+    Py_XDECREF(keyarg);
+    keyarg = other.keyarg;
+    kind = other.kind;
+    reverse = other.reverse;
     return *this;
 }
 
 bool
-sortedmap::Comparator::operator()(const OwnedRef<PyObject> &a,
-                                  const OwnedRef<PyObject> &b){
-    if (!keyfunc) {
-        return a < b;
+sortedmap::Comparator::operator==(const Comparator &other) const {
+    return keyfunc == other.keyfunc && reverse == other.reverse;
+}
+
+// Compare ``a`` and ``b`` without going through rich comparison when they
+// share one of the builtin scalar types. This returns false when there is no
+// fast path, otherwise ``*order`` is set to -1, 0 or 1, or to 2 when the
+// values are unordered floats, ``NaN`` is neither equal nor less.
+static bool
+fast_compare(PyObject *a, PyObject *b, int *order) {
+    if (Py_TYPE(a) != Py_TYPE(b)) {
+        return false;
     }
 
-    if (unlikely(!argtuple)) {
-        if (!(argtuple = PyTuple_New(1))) {
+#if COMPILING_IN_PY2
+    if (PyInt_CheckExact(a)) {
+        long lhs = PyInt_AS_LONG(a);
+        long rhs = PyInt_AS_LONG(b);
+
+        *order = (lhs > rhs) - (lhs < rhs);
+        return true;
+    }
+#else
+    if (PyLong_CheckExact(a)) {
+        int a_overflow;
+        int b_overflow;
+        long lhs = PyLong_AsLongAndOverflow(a, &a_overflow);
+        long rhs = PyLong_AsLongAndOverflow(b, &b_overflow);
+
+        if (a_overflow || b_overflow) {
+            return false;
+        }
+        *order = (lhs > rhs) - (lhs < rhs);
+        return true;
+    }
+    if (PyUnicode_CheckExact(a)) {
+        int result = PyUnicode_Compare(a, b);
+
+        if (unlikely(result == -1 && PyErr_Occurred())) {
             throw PythonError();
         }
+        *order = result;
+        return true;
     }
+#endif  // COMPILING_IN_PY2
+    if (PyFloat_CheckExact(a)) {
+        double lhs = PyFloat_AS_DOUBLE(a);
+        double rhs = PyFloat_AS_DOUBLE(b);
 
-    OwnedRef<PyObject> a_ob;
-    OwnedRef<PyObject> b_ob;
-    int status;
+        *order = (lhs < rhs) ? -1 : (lhs > rhs) ? 1 : (lhs == rhs) ? 0 : 2;
+        return true;
+    }
+    return false;
+}
 
-    if (unlikely(!(a_ob = call(a)) || !(b_ob = call(b)))) {
-        throw PythonError();
+// ``a < b`` with the builtin scalar types compared directly. Pairs of exact
+// tuples are compared like ``tuple.__lt__``: the first position that is not
+// equal decides and a tuple sorts before any tuple that it prefixes. Unlike
+// ``tuple.__lt__`` this does not go through a rich comparison for equality
+// and then another for ordering when the elements have a fast path.
+static bool
+key_less(PyObject *a, PyObject *b) {
+    int order;
+
+    if (PyTuple_CheckExact(a) && PyTuple_CheckExact(b)) {
+        Py_ssize_t alen = PyTuple_GET_SIZE(a);
+        Py_ssize_t blen = PyTuple_GET_SIZE(b);
+        Py_ssize_t len = std::min(alen, blen);
+
+        for (Py_ssize_t ix = 0; ix < len; ++ix) {
+            PyObject *lhs = PyTuple_GET_ITEM(a, ix);
+            PyObject *rhs = PyTuple_GET_ITEM(b, ix);
+
+            // tuples treat identical elements as equal
+            if (lhs == rhs) {
+                continue;
+            }
+            if (fast_compare(lhs, rhs, &order)) {
+                if (order) {
+                    return order < 0;
+                }
+                continue;
+            }
+
+            int status = PyObject_RichCompareBool(lhs, rhs, Py_EQ);
+            if (unlikely(status < 0)) {
+                throw PythonError();
+            }
+            if (status) {
+                continue;
+            }
+            if (unlikely((status = PyObject_RichCompareBool(lhs,
+                                                            rhs,
+                                                            Py_LT)) < 0)) {
+                throw PythonError();
+            }
+            return status;
+        }
+        return alen < blen;
     }
-    status = PyObject_RichCompareBool(a_ob, b_ob, Py_LT);
+
+    if (fast_compare(a, b, &order)) {
+        return order < 0;
+    }
+
+    int status = PyObject_RichCompareBool(a, b, Py_LT);
     if (unlikely(status < 0)) {
         throw PythonError();
     }
     return status;
 }
 
+bool
+sortedmap::Comparator::operator()(const OwnedRef<PyObject> &a,
+                                  const OwnedRef<PyObject> &b){
+    // descending order is ascending order with the arguments swapped
+    const OwnedRef<PyObject> &lhs = (reverse) ? b : a;
+    const OwnedRef<PyObject> &rhs = (reverse) ? a : b;
+
+    STAT_INC(stats, comparisons);
+    if (kind == extractor::identity) {
+        return key_less(lhs, rhs);
+    }
+
+    PyObject *lhs_key;
+    PyObject *rhs_key;
+    bool status;
+
+    if (unlikely(!(lhs_key = extract(lhs)))) {
+        throw PythonError();
+    }
+    if (unlikely(!(rhs_key = extract(rhs)))) {
+        Py_DECREF(lhs_key);
+        throw PythonError();
+    }
+    try {
+        status = key_less(lhs_key, rhs_key);
+    }
+    catch (PythonError &e) {
+        Py_DECREF(lhs_key);
+        Py_DECREF(rhs_key);
+        throw;
+    }
+    Py_DECREF(lhs_key);
+    Py_DECREF(rhs_key);
+    return status;
+}
+
+static bool
+keyword_equals(PyObject *name, const char *keyword) {
+#if COMPILING_IN_PY2
+    return PyString_Check(name) && !strcmp(PyString_AS_STRING(name), keyword);
+#else
+    return PyUnicode_Check(name) &&
+        !PyUnicode_CompareWithASCIIString(name, keyword);
+#endif  // COMPILING_IN_PY2
+}
+
+bool
+sortedmap::parse_fastcall(const char *fname,
+                          const char *const *keywords,
+                          Py_ssize_t required,
+                          PyObject *const *args,
+                          Py_ssize_t nargs,
+                          PyObject *kwnames,
+                          PyObject **out) {
+    Py_ssize_t nkeywords = 0;
+    Py_ssize_t nkwargs = (kwnames) ? PyTuple_GET_SIZE(kwnames) : 0;
+
+    while (keywords[nkeywords]) {
+        ++nkeywords;
+    }
+
+    if (unlikely(nargs + nkwargs > nkeywords)) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes at most %zd argument%s (%zd given)",
+                     fname,
+                     nkeywords,
+                     (nkeywords == 1) ? "" : "s",
+                     nargs + nkwargs);
+        return false;
+    }
+
+    for (Py_ssize_t ix = 0; ix < nargs; ++ix) {
+        out[ix] = args[ix];
+    }
+
+    for (Py_ssize_t ix = 0; ix < nkwargs; ++ix) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, ix);
+        Py_ssize_t pos = 0;
+
+        while (pos < nkeywords && !keyword_equals(name, keywords[pos])) {
+            ++pos;
+        }
+        if (unlikely(pos == nkeywords)) {
+#if COMPILING_IN_PY2
+            // python 2 ``PyErr_Format`` does not support ``%S``
+            PyObject *str = PyObject_Str(name);
+            if (!str) {
+                return false;
+            }
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got an unexpected keyword argument '%s'",
+                         fname,
+                         PyString_AS_STRING(str));
+            Py_DECREF(str);
+#else
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got an unexpected keyword argument '%S'",
+                         fname,
+                         name);
+#endif  // COMPILING_IN_PY2
+            return false;
+        }
+        if (unlikely(pos < nargs)) {
+            PyErr_Format(PyExc_TypeError,
+                         "argument for %s() given by name ('%s') and"
+                         " position (%zd)",
+                         fname,
+                         keywords[pos],
+                         pos + 1);
+            return false;
+        }
+        out[pos] = args[nargs + ix];
+    }
+
+    for (Py_ssize_t ix = 0; ix < required; ++ix) {
+        if (unlikely(!out[ix])) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() missing required argument '%s' (pos %zd)",
+                         fname,
+                         keywords[ix],
+                         ix + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool
 sortedmap::check(PyObject *ob) {
     return PyObject_IsInstance(ob, (PyObject*) &sortedmap::type);
@@ -97,57 +508,45 @@ sortedmap::check_exact(PyObject *ob) {
     return Py_TYPE(ob) == &sortedmap::type;
 }
 
-void
-sortedmap::abstractiter::dealloc(sortedmap::abstractiter::object *self) {
-    using sortedmap::abstractiter::itertype;
-    using ownedtype = OwnedRef<sortedmap::object>;
-
-    self->iter.~itertype();
-    self->map.~ownedtype();
-    PyObject_Del(self);
-}
-
 PyObject*
-sortedmap::keyiter::elem(sortedmap::abstractiter::itertype it) {
-    return std::get<0>(*it).incref();
+sortedmap::keyiter::elem(sortedmap::keyiter::itertype it) {
+    return sortedmap::abstractiter::pair_key(it);
 }
 
 PyObject*
-sortedmap::valiter::elem(sortedmap::abstractiter::itertype it) {
-    return std::get<1>(*it).incref();
+sortedmap::valiter::elem(sortedmap::valiter::itertype it) {
+    return sortedmap::abstractiter::pair_value(it);
 }
 
 PyObject*
-sortedmap::itemiter::elem(sortedmap::abstractiter::itertype it) {
-    return PyTuple_Pack(2,
-                        sortedmap::keyiter::elem(it),
-                        sortedmap::valiter::elem(it));
+sortedmap::itemiter::elem(sortedmap::itemiter::itertype it) {
+    return sortedmap::abstractiter::pair_item(it);
 }
 
 PyObject*
 sortedmap::keyiter::iter(sortedmap::object *self) {
-    return sortedmap::abstractiter::iter<sortedmap::keyiter::object,
+    return sortedmap::abstractiter::iter<sortedmap::object,
                                          sortedmap::keyiter::type>(self);
 }
 
 PyObject*
 sortedmap::valiter::iter(sortedmap::object *self) {
-    return sortedmap::abstractiter::iter<sortedmap::valiter::object,
+    return sortedmap::abstractiter::iter<sortedmap::object,
                                          sortedmap::valiter::type>(self);
 }
 
 PyObject*
 sortedmap::itemiter::iter(sortedmap::object *self) {
-    return sortedmap::abstractiter::iter<sortedmap::itemiter::object,
+    return sortedmap::abstractiter::iter<sortedmap::object,
                                          sortedmap::itemiter::type>(self);
 }
 
 PyObject*
-sortedmap::abstractview::repr(sortedmap::abstractview::object *self) {
+sortedmap::abstractview::repr(PyObject *self) {
     PyObject *aslist;
     PyObject *ret;
 
-    if (!(aslist = PySequence_List((PyObject*) self))) {
+    if (!(aslist = PySequence_List(self))) {
         return NULL;
     }
     ret = PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name, aslist);
@@ -157,129 +556,641 @@ sortedmap::abstractview::repr(sortedmap::abstractview::object *self) {
 
 PyObject*
 sortedmap::keyview::view(sortedmap::object *self) {
-    return sortedmap::abstractview::view<sortedmap::keyview::object,
+    return sortedmap::abstractview::view<sortedmap::object,
                                          sortedmap::keyview::type>(self);
 }
 
 PyObject*
 sortedmap::valview::view(sortedmap::object *self) {
-    return sortedmap::abstractview::view<sortedmap::valview::object,
+    return sortedmap::abstractview::view<sortedmap::object,
                                          sortedmap::valview::type>(self);
 }
 
 PyObject*
 sortedmap::itemview::view(sortedmap::object *self) {
-    return sortedmap::abstractview::view<sortedmap::itemview::object,
+    return sortedmap::abstractview::view<sortedmap::object,
                                          sortedmap::itemview::type>(self);
 }
 
+bool
+sortedmap::abstractiter::check_chunksize(Py_ssize_t n) {
+    if (unlikely(n < 1)) {
+        PyErr_Format(PyExc_ValueError,
+                     "chunk size must be positive, got %zd",
+                     n);
+        return false;
+    }
+    return true;
+}
+
 void
-sortedmap::abstractview::dealloc(sortedmap::abstractview::object *self) {
-    using ownedtype = OwnedRef<sortedmap::object>;
+sortedmap::chunkiter::dealloc(sortedmap::chunkiter::object *self) {
+    using ownedtype = OwnedRef<sortedmap::chunkiter::iterobject>;
 
-    self->map.~ownedtype();
+    self->iter.~ownedtype();
     PyObject_Del(self);
 }
 
-static sortedmap::object*
-innernew(PyTypeObject *cls, PyObject *keyfunc) {
-    sortedmap::object *self = PyObject_GC_New(sortedmap::object, cls);
-    ;
+PyObject*
+sortedmap::chunkiter::next(sortedmap::chunkiter::object *self) {
+    PyObject *chunk = self->chunk(self->iter.ob, self->n);
 
-    if (unlikely(!self)) {
+    if (chunk && !PyList_GET_SIZE(chunk)) {
+        Py_DECREF(chunk);
         return NULL;
     }
-
-    self = new(self) sortedmap::object;
-    Py_XINCREF(keyfunc);
-    self->map = std::move(sortedmap::maptype(sortedmap::Comparator(keyfunc)));
-    return self;
+    return chunk;
 }
 
-sortedmap::object*
-sortedmap::newobject(PyTypeObject *cls, PyObject *args, PyObject *kwargs) {
-    return innernew(cls, NULL);
+bool
+sortedmap::indexequal::operator()(const sortedmap::indexkey &a,
+                                  const sortedmap::indexkey &b) const {
+    if (a.ob == b.ob) {
+        return true;
+    }
+    if (a.hash != b.hash) {
+        return false;
+    }
+    int status = PyObject_RichCompareBool(a.ob, b.ob, Py_EQ);
+    if (unlikely(status < 0)) {
+        throw PythonError();
+    }
+    return status;
 }
 
-int
-sortedmap::init(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    return (sortedmap::update(self, args, kwargs)) ? 0 : -1;
+static Py_hash_t
+hash_throws(PyObject *key) {
+    Py_hash_t hash = PyObject_Hash(key);
+    if (unlikely(hash == -1)) {
+        throw PythonError();
+    }
+    return hash;
 }
 
-void
-sortedmap::dealloc(sortedmap::object *self) {
-    using sortedmap::maptype;
-
-    sortedmap::clear(self);
-    self->map.~maptype();
-    PyObject_GC_Del(self);
+// Look up the node for ``key``, through the hash index when there is one.
+static sortedmap::maptype::iterator
+find_throws(sortedmap::object *self, PyObject *key) {
+    if (!self->index) {
+        return self->map.find(key);
+    }
+    const auto &it = self->index->find(sortedmap::indexkey{key,
+                                                           hash_throws(key)});
+    if (it == self->index->end()) {
+        return self->map.end();
+    }
+    return std::get<1>(*it);
 }
 
-int
-sortedmap::traverse(sortedmap::object *self, visitproc visit, void *arg) {
-    for (const auto &pair : self->map) {
-        Py_VISIT(pair.first);
-        Py_VISIT(pair.second);
+#ifdef __GLIBCXX__
+static void
+summarize_node(sortedmap::object *self, sortedmap::maptype::iterator node) {
+    if (self->aggregate) {
+        self->aggregate->insert({std::get<0>(*node), std::get<1>(*node)});
     }
-    return 0;
 }
 
-void
-sortedmap::clear(sortedmap::object *self) {
-    self->map.clear();
-}
+// Drop ``node`` from the aggregate tree. Like ``unindex`` this scans for the
+// key if comparing it raises this time.
+static void
+unsummarize(sortedmap::object *self, sortedmap::maptype::iterator node) {
+    if (!self->aggregate) {
+        return;
+    }
 
-PyObject*
-sortedmap::pyclear(sortedmap::object *self) {
-    sortedmap::clear(self);
-    Py_RETURN_NONE;
-}
+    PyObject *key = std::get<0>(*node);
 
-PyObject *
-sortedmap::richcompare(sortedmap::object *self, PyObject *other, int opid) {
-    if (!(opid == Py_EQ || opid == Py_NE) || !sortedmap::check(other)) {
-        Py_RETURN_NOTIMPLEMENTED;
+    try {
+        self->aggregate->erase(key);
+        return;
+    }
+    catch (PythonError &e) {
+        PyErr_Clear();
     }
+    for (auto it = self->aggregate->begin();
+         it != self->aggregate->end();
+         ++it) {
+        if (std::get<0>(*it) == key) {
+            self->aggregate->erase(it);
+            break;
+        }
+    }
+}
 
-    sortedmap::object *asmap = (sortedmap::object*) other;
+static void
+clear_summaries(sortedmap::object *self) {
+    if (self->aggregate) {
+        self->aggregate->clear();
+    }
+}
 
-    if (self->map.size() != asmap->map.size()) {
-        return PyBool_FromLong(opid != Py_EQ);
+// Follows the aggregate tree's entries for a run of map nodes to update them
+// as the nodes' values change. Finding the first entry compares keys and
+// may throw, after that this only follows links.
+class summary_cursor {
+private:
+    sortedmap::aggregatetype *tree;
+    sortedmap::aggregatetype::iterator entry;
+
+public:
+    summary_cursor(sortedmap::object *self,
+                   sortedmap::maptype::iterator node) : tree(NULL) {
+        if (self->aggregate && node != self->map.end()) {
+            entry = self->aggregate->find(std::get<0>(*node));
+            tree = self->aggregate;
+        }
     }
 
-    int status;
+    // Give the current entry ``value`` and step to the next one. The
+    // summaries above it are recomputed by walking its parents.
+    void set(PyObject *value) {
+        using node_iterator = sortedmap::aggregatetype::node_iterator;
 
-    if ((size_t) self->map.key_comp().keyfunc ^
-        (size_t) asmap->map.key_comp().keyfunc) {
-        return PyBool_FromLong(opid != Py_EQ);
-    }
-    else if (self->map.key_comp().keyfunc && asmap->map.key_comp().keyfunc) {
-        status = PyObject_RichCompareBool(self->map.key_comp().keyfunc,
-                                          asmap->map.key_comp().keyfunc,
-                                          opid);
-        if (unlikely(status < 0)) {
-            return NULL;
+        if (!tree) {
+            return;
         }
-        if (!status) {
-            return PyBool_FromLong(opid != Py_EQ);
+        entry->second = value;
+        for (auto node = entry.m_p_nd;
+             node != tree->end().m_p_nd;
+             node = node->m_p_parent) {
+            sortedmap::resummarize(node_iterator(node), tree->node_end());
         }
+        ++entry;
     }
+};
 
-    OwnedRef<PyObject> other_val;
+// The bytes held by the aggregate tree: the tree itself and a node per key
+// holding the colour, three links, the pair and its summary.
+static std::size_t
+aggregate_size(const sortedmap::object *self) {
+    if (!self->aggregate) {
+        return 0;
+    }
+    return sizeof(sortedmap::aggregatetype) +
+        self->aggregate->size() *
+        (4 * sizeof(void*) +
+         sizeof(sortedmap::aggregatetype::value_type) +
+         sizeof(sortedmap::summary));
+}
 
-    for (const auto &pair : self->map) {
-        try{
-            other_val = std::move(asmap->map.at(std::get<0>(pair)));
+// Fold the summaries of the pairs in ``[lo, hi)`` in key order, where a
+// bound of None leaves that end open. This finds the highest node in the
+// range and walks down both of its edges, adding the subtrees which lie
+// wholly inside of the range.
+static sortedmap::summary
+summarize_range_throws(sortedmap::aggregatetype &tree,
+                       PyObject *lo,
+                       PyObject *hi) {
+    using node_iterator = sortedmap::aggregatetype::node_const_iterator;
+
+    const sortedmap::aggregateless &less = tree.get_cmp_fn();
+    node_iterator end = tree.node_end();
+    auto after_lo = [&](node_iterator node) {
+        return lo == Py_None || !less((*node)->first, lo);
+    };
+    auto before_hi = [&](node_iterator node) {
+        return hi == Py_None || less((*node)->first, hi);
+    };
+    auto subtree = [&](node_iterator node) {
+        return (node == end) ? sortedmap::summary() : node.get_metadata();
+    };
+
+    sortedmap::summary total = sortedmap::summary();
+    node_iterator top = tree.node_begin();
+    while (top != end) {
+        if (!after_lo(top)) {
+            top = top.get_r_child();
         }
-        catch (std::out_of_range &e) {
-            return PyBool_FromLong(opid != Py_EQ);
+        else if (!before_hi(top)) {
+            top = top.get_l_child();
         }
-        catch (PythonError &e) {
-            return NULL;
+        else {
+            break;
         }
-        status = PyObject_RichCompareBool(std::get<1>(pair), other_val, opid);
-        if (unlikely(status < 0)) {
-            return NULL;
+    }
+    if (top == end) {
+        return total;
+    }
+
+    // the left edge is found from the top down but sorts from the bottom up
+    std::vector<node_iterator> left;
+    for (node_iterator node = top.get_l_child(); node != end;) {
+        if (after_lo(node)) {
+            left.push_back(node);
+            node = node.get_l_child();
+        }
+        else {
+            node = node.get_r_child();
+        }
+    }
+    for (auto it = left.rbegin(); it != left.rend(); ++it) {
+        total.append(sortedmap::summary::of((**it)->second));
+        total.append(subtree(it->get_r_child()));
+    }
+    total.append(sortedmap::summary::of((*top)->second));
+    for (node_iterator node = top.get_r_child(); node != end;) {
+        if (before_hi(node)) {
+            total.append(subtree(node.get_l_child()));
+            total.append(sortedmap::summary::of((*node)->second));
+            node = node.get_r_child();
+        }
+        else {
+            node = node.get_l_child();
+        }
+    }
+    return total;
+}
+#else
+class summary_cursor {
+public:
+    summary_cursor(sortedmap::object*, sortedmap::maptype::iterator) {}
+    void set(PyObject*) {}
+};
+
+static void
+summarize_node(sortedmap::object*, sortedmap::maptype::iterator) {}
+
+static void
+unsummarize(sortedmap::object*, sortedmap::maptype::iterator) {}
+
+static void
+clear_summaries(sortedmap::object*) {}
+
+static std::size_t
+aggregate_size(const sortedmap::object*) {
+    return 0;
+}
+#endif  // __GLIBCXX__
+
+// Drop a node which is about to be erased from the tree from the hash index
+// and the aggregate tree. This cannot fail: if the key's ``__hash__`` or
+// ``__eq__`` raises this time the entry is found by scanning for the node
+// instead. Any pending exception is kept so this may be called while
+// unwinding.
+static void
+unindex(sortedmap::object *self, sortedmap::maptype::iterator node) {
+    if (!self->index && !self->aggregate) {
+        return;
+    }
+
+    PyObject *key = std::get<0>(*node);
+    PyObject *type;
+    PyObject *value;
+    PyObject *tb;
+    Py_hash_t hash;
+
+    PyErr_Fetch(&type, &value, &tb);
+    unsummarize(self, node);
+    if (!self->index) {
+        PyErr_Restore(type, value, tb);
+        return;
+    }
+    if (likely((hash = PyObject_Hash(key)) != -1)) {
+        try {
+            const auto &it = self->index->find(sortedmap::indexkey{key, hash});
+            if (likely(it != self->index->end() &&
+                       std::get<1>(*it) == node)) {
+                self->index->erase(it);
+                PyErr_Restore(type, value, tb);
+                return;
+            }
+        }
+        catch (PythonError &e) {}
+    }
+    for (auto it = self->index->begin(); it != self->index->end(); ++it) {
+        if (std::get<1>(*it) == node) {
+            self->index->erase(it);
+            break;
+        }
+    }
+    PyErr_Restore(type, value, tb);
+}
+
+// Add a node which was just inserted into the tree to the hash index and the
+// aggregate tree. The node is erased again if this fails so that they never
+// disagree.
+static void
+index_node(sortedmap::object *self,
+           sortedmap::maptype::iterator node,
+           Py_hash_t hash) {
+    try {
+        if (self->index) {
+            self->index->emplace(
+                sortedmap::indexkey{std::get<0>(*node), hash},
+                node);
+        }
+        summarize_node(self, node);
+    }
+    catch (PythonError &e) {
+        unindex(self, node);
+        self->map.erase(node);
+        throw;
+    }
+}
+
+// Rebuild the hash index and aggregate tree after the whole tree was
+// replaced.
+static void
+reindex(sortedmap::object *self) {
+    clear_summaries(self);
+    for (auto it = self->map.begin(); it != self->map.end(); ++it) {
+        summarize_node(self, it);
+    }
+    if (!self->index) {
+        return;
+    }
+    self->index->clear();
+    self->index->reserve(self->map.size());
+    for (auto it = self->map.begin(); it != self->map.end(); ++it) {
+        PyObject *key = std::get<0>(*it);
+        self->index->emplace(sortedmap::indexkey{key, hash_throws(key)}, it);
+    }
+}
+
+// Record a change in the attached journal. This is called before the change
+// is made so that a failure leaves the map and the journal in agreement.
+static void
+journal_throws(sortedmap::object *self,
+               sortedmap::journal_op op,
+               PyObject *key = Py_None,
+               PyObject *value = Py_None) {
+    if (!self->journal) {
+        return;
+    }
+
+    PyObject *pyop = PyLong_FromLong(static_cast<long>(op));
+    if (!pyop) {
+        throw PythonError();
+    }
+    PyObject *result = PyObject_CallFunctionObjArgs(self->journal,
+                                                    pyop,
+                                                    key,
+                                                    value,
+                                                    NULL);
+    Py_DECREF(pyop);
+    if (!result) {
+        throw PythonError();
+    }
+    Py_DECREF(result);
+}
+
+// Give the existing ``node`` for ``key`` a new value, journaling it first.
+// The aggregate tree's entry is found before either so that a failure
+// changes nothing.
+static void
+assign_throws(sortedmap::object *self,
+              sortedmap::maptype::iterator node,
+              PyObject *key,
+              PyObject *value) {
+    summary_cursor summaries(self, node);
+
+    journal_throws(self, sortedmap::journal_op::set, key, value);
+    summaries.set(value);
+    std::get<1>(*node) = std::move(OwnedRef<PyObject>(value));
+}
+
+// Record one change for each of ``changes`` with ``op``. A journal with
+// ``record_many`` takes all of the records in one call or none of them, so a
+// record which cannot be written partway through does not leave the earlier
+// ones behind for a change which is then not made. Other journals are called
+// once per record.
+static void
+journal_many_throws(
+    sortedmap::object *self,
+    sortedmap::journal_op op,
+    const std::vector<std::pair<PyObject*, PyObject*>> &changes) {
+    if (!self->journal || changes.empty()) {
+        return;
+    }
+    if (!self->journal_many) {
+        for (const auto &change : changes) {
+            journal_throws(self,
+                           op,
+                           std::get<0>(change),
+                           std::get<1>(change));
+        }
+        return;
+    }
+
+    PyObject *records = PyList_New(changes.size());
+    if (!records) {
+        throw PythonError();
+    }
+    for (std::size_t n = 0; n < changes.size(); ++n) {
+        PyObject *record = Py_BuildValue("(lOO)",
+                                         static_cast<long>(op),
+                                         std::get<0>(changes[n]),
+                                         std::get<1>(changes[n]));
+        if (!record) {
+            Py_DECREF(records);
+            throw PythonError();
+        }
+        PyList_SET_ITEM(records, n, record);
+    }
+    PyObject *result = PyObject_CallFunctionObjArgs(self->journal_many,
+                                                    records,
+                                                    NULL);
+    Py_DECREF(records);
+    if (!result) {
+        throw PythonError();
+    }
+    Py_DECREF(result);
+}
+
+static sortedmap::object*
+innernew(PyTypeObject *cls,
+         PyObject *keyfunc,
+         bool reverse = false,
+         const sortedmap::options &opts = sortedmap::options()) {
+    using sortedmap::maptype;
+
+    sortedmap::object *self = PyObject_GC_New(sortedmap::object, cls);
+
+    if (unlikely(!self)) {
+        return NULL;
+    }
+
+    // construct the map in place so that its comparator points at the
+    // counters of this object
+    new(&self->map) maptype(sortedmap::Comparator(keyfunc,
+                                                  reverse,
+                                                  &self->stats));
+    self->iter_revision = 0;
+    self->stats = sortedmap::counters();
+    self->opts = opts;
+    self->index = NULL;
+    self->aggregate = NULL;
+    self->journal = NULL;
+    self->journal_many = NULL;
+    if (opts.indexed &&
+        !(self->index = new(std::nothrow) sortedmap::indextype())) {
+        Py_DECREF(self);
+        PyErr_NoMemory();
+        return NULL;
+    }
+#ifdef __GLIBCXX__
+    if (opts.aggregate &&
+        !(self->aggregate = new(std::nothrow) sortedmap::aggregatetype(
+              sortedmap::aggregateless{self->map.key_comp()}))) {
+        Py_DECREF(self);
+        PyErr_NoMemory();
+        return NULL;
+    }
+#endif  // __GLIBCXX__
+    return self;
+}
+
+sortedmap::object*
+sortedmap::newobject(PyTypeObject *cls, PyObject *args, PyObject *kwargs) {
+    return innernew(cls, NULL);
+}
+
+PyObject*
+sortedmap::construct(PyTypeObject *cls,
+                     PyObject *keyfunc,
+                     bool reverse,
+                     const sortedmap::options &opts,
+                     PyObject *args,
+                     PyObject *kwargs) {
+    sortedmap::object *self;
+
+    if (!(self = innernew(cls, keyfunc, reverse, opts))) {
+        return NULL;
+    }
+    if (sortedmap::init(self, args, kwargs)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+
+int
+sortedmap::init(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
+    return (sortedmap::update(self, args, kwargs)) ? 0 : -1;
+}
+
+#if HAVE_VECTORCALL
+PyObject*
+sortedmap::vectorcall(PyObject *cls,
+                      PyObject *const *args,
+                      size_t nargsf,
+                      PyObject *kwnames) {
+    sortedmap::object *self;
+
+    if (!(self = innernew((PyTypeObject*) cls, NULL))) {
+        return NULL;
+    }
+    if (!sortedmap::update_fastcall(self,
+                                    args,
+                                    PyVectorcall_NARGS(nargsf),
+                                    kwnames)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+#endif  // HAVE_VECTORCALL
+
+void
+sortedmap::dealloc(sortedmap::object *self) {
+    using sortedmap::maptype;
+
+    sortedmap::clear(self);
+    self->map.~maptype();
+    delete self->index;
+#ifdef __GLIBCXX__
+    delete self->aggregate;
+#endif  // __GLIBCXX__
+    Py_XDECREF(self->journal);
+    Py_XDECREF(self->journal_many);
+    PyObject_GC_Del(self);
+}
+
+int
+sortedmap::traverse(sortedmap::object *self, visitproc visit, void *arg) {
+    for (const auto &pair : self->map) {
+        Py_VISIT(pair.first);
+        Py_VISIT(pair.second);
+    }
+    Py_VISIT(self->journal);
+    Py_VISIT(self->journal_many);
+    return 0;
+}
+
+void
+sortedmap::clear(sortedmap::object *self) {
+    if (self->map.size()) {
+        sortedmap::bump_revision(self);
+    }
+    if (self->index) {
+        self->index->clear();
+    }
+    clear_summaries(self);
+    self->map.clear();
+}
+
+PyObject*
+sortedmap::pyclear(sortedmap::object *self) {
+    if (self->map.size()) {
+        try {
+            journal_throws(self, sortedmap::journal_op::clear);
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+    sortedmap::clear(self);
+    Py_RETURN_NONE;
+}
+
+PyObject *
+sortedmap::richcompare(sortedmap::object *self, PyObject *other, int opid) {
+    if (!(opid == Py_EQ || opid == Py_NE) || !sortedmap::check(other)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    sortedmap::object *asmap = (sortedmap::object*) other;
+
+    if (self->map.size() != asmap->map.size()) {
+        return PyBool_FromLong(opid != Py_EQ);
+    }
+
+    int status;
+
+    if (self->map.key_comp().reverse != asmap->map.key_comp().reverse) {
+        return PyBool_FromLong(opid != Py_EQ);
+    }
+
+    if ((size_t) self->map.key_comp().keyfunc ^
+        (size_t) asmap->map.key_comp().keyfunc) {
+        return PyBool_FromLong(opid != Py_EQ);
+    }
+    else if (self->map.key_comp().keyfunc && asmap->map.key_comp().keyfunc) {
+        status = PyObject_RichCompareBool(self->map.key_comp().keyfunc,
+                                          asmap->map.key_comp().keyfunc,
+                                          opid);
+        if (unlikely(status < 0)) {
+            return NULL;
+        }
+        if (!status) {
+            return PyBool_FromLong(opid != Py_EQ);
+        }
+    }
+
+    OwnedRef<PyObject> other_val;
+
+    for (const auto &pair : self->map) {
+        try{
+            other_val = std::move(asmap->map.at(std::get<0>(pair)));
+        }
+        catch (std::out_of_range &e) {
+            return PyBool_FromLong(opid != Py_EQ);
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+        status = PyObject_RichCompareBool(std::get<1>(pair), other_val, opid);
+        if (unlikely(status < 0)) {
+            return NULL;
         }
         if (!status) {
             Py_RETURN_FALSE;
@@ -296,8 +1207,9 @@ sortedmap::len(sortedmap::object *self) {
 PyObject*
 sortedmap::getitem(sortedmap::object *self, PyObject *key) {
     try {
-        const auto &it = self->map.find(key);
+        const auto &it = find_throws(self, key);
         if (it == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
             PyErr_SetObject(PyExc_KeyError, key);
             return NULL;
         }
@@ -311,8 +1223,9 @@ sortedmap::getitem(sortedmap::object *self, PyObject *key) {
 PyObject*
 sortedmap::get(sortedmap::object *self, PyObject *key, PyObject *def) {
     try {
-        const auto &it = self->map.find(key);
+        const auto &it = find_throws(self, key);
         if (it == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
             Py_INCREF(def);
             return def;
         }
@@ -324,25 +1237,17 @@ sortedmap::get(sortedmap::object *self, PyObject *key, PyObject *def) {
 }
 
 PyObject*
-sortedmap::pyget(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    const char *keywords[] = {"key", "default", NULL};
-    PyObject *key;
-    PyObject *def = NULL;
-
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|O:get",
-                                     (char**) keywords,
-                                     &key,
-                                     &def)) {
+sortedmap::pyget(sortedmap::object *self,
+                 PyObject *const *args,
+                 Py_ssize_t nargs,
+                 PyObject *kwnames) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[] = {NULL, NULL};
+
+    if (!parse_fastcall("get", keywords, 1, args, nargs, kwnames, argv)) {
         return NULL;
     }
-
-    if (!def) {
-        def = Py_None;
-    }
-
-    return sortedmap::get(self, key, def);
+    return sortedmap::get(self, argv[0], (argv[1]) ? argv[1] : Py_None);
 }
 
 PyObject*
@@ -350,8 +1255,9 @@ sortedmap::pop(sortedmap::object *self, PyObject *key, PyObject *def) {
     try {
         PyObject *ret;
 
-        const auto &it = self->map.find(key);
+        const auto &it = find_throws(self, key);
         if (it == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
             if (!def) {
                 PyErr_SetObject(PyExc_KeyError, key);
             }
@@ -360,10 +1266,15 @@ sortedmap::pop(sortedmap::object *self, PyObject *key, PyObject *def) {
             }
             return def;
         }
+        journal_throws(self,
+                       sortedmap::journal_op::erase,
+                       std::get<0>(*it));
         ret = std::get<1>(*it).incref();
         // use the same iterator to the item for a faster erase
+        unindex(self, it);
         self->map.erase(it);
-        ++self->iter_revision;
+        STAT_INC(&self->stats, erases);
+        sortedmap::bump_revision(self);
         return ret;
     }
     catch (PythonError &e) {
@@ -372,21 +1283,17 @@ sortedmap::pop(sortedmap::object *self, PyObject *key, PyObject *def) {
 }
 
 PyObject*
-sortedmap::pypop(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    const char *keywords[] = {"key", "default", NULL};
-    PyObject *key;
-    PyObject *def = NULL;
-
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|O:pop",
-                                     (char**) keywords,
-                                     &key,
-                                     &def)) {
+sortedmap::pypop(sortedmap::object *self,
+                 PyObject *const *args,
+                 Py_ssize_t nargs,
+                 PyObject *kwnames) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[] = {NULL, NULL};
+
+    if (!parse_fastcall("pop", keywords, 1, args, nargs, kwnames, argv)) {
         return NULL;
     }
-
-    return sortedmap::pop(self, key, def);
+    return sortedmap::pop(self, argv[0], argv[1]);
 }
 
 PyObject*
@@ -413,484 +1320,5145 @@ sortedmap::popitem(sortedmap::object *self, bool front) {
     if (!(ret = sortedmap::itemiter::elem(it))) {
         return NULL;
     }
-    ++self->iter_revision;
+    try {
+        journal_throws(self, sortedmap::journal_op::erase, std::get<0>(*it));
+    }
+    catch (PythonError &e) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    sortedmap::bump_revision(self);
+    unindex(self, it);
     self->map.erase(it);
+    STAT_INC(&self->stats, erases);
     return ret;
 }
 
 PyObject*
 sortedmap::pypopitem(sortedmap::object *self,
-                     PyObject *args,
-                     PyObject *kwargs) {
-    const char *keywords[] = {"first", NULL};
-    PyObject *pyfirst = NULL;
-    int first;
-
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "|O:popitem",
-                                     (char**) keywords,
-                                     &pyfirst)) {
+                     PyObject *const *args,
+                     Py_ssize_t nargs,
+                     PyObject *kwnames) {
+    static const char *const keywords[] = {"first", NULL};
+    PyObject *argv[] = {NULL};
+    int first = true;
+
+    if (!parse_fastcall("popitem", keywords, 0, args, nargs, kwnames, argv)) {
         return NULL;
     }
 
-    if (pyfirst) {
-        first = PyObject_IsTrue(pyfirst);
-        if (first < 0) {
-            return NULL;
-        }
-    }
-    else {
-        first = true;
+    if (argv[0] && (first = PyObject_IsTrue(argv[0])) < 0) {
+        return NULL;
     }
     return sortedmap::popitem(self, first);
 }
 
-static void
-setitem_throws(sortedmap::object *self, PyObject *key, PyObject *value) {
-    const auto &pair = self->map.emplace(key, value);
-    if (std::get<1>(pair)) {
-        ++self->iter_revision;
-    }
-    else {
-        std::get<1>(*std::get<0>(pair)) = std::move(OwnedRef<PyObject>(value));
+PyObject*
+sortedmap::popitems(sortedmap::object *self, Py_ssize_t n, bool front) {
+    sortedmap::maptype::iterator begin;
+    sortedmap::maptype::iterator end;
+    PyObject *ret;
+    PyObject *item;
+
+    if (n < 0) {
+        PyErr_Format(PyExc_ValueError, "n must be non-negative, got %zd", n);
+        return NULL;
     }
-}
+    n = std::min<std::size_t>(n, self->map.size());
 
-int
-sortedmap::setitem(sortedmap::object *self, PyObject *key, PyObject *value) {
-    try {
-        if (!value) {
-            self->map.erase(key);
-            ++self->iter_revision;
-        }
-        else {
-            setitem_throws(self, key, value);
+    if (!(ret = PyList_New(n))) {
+        return NULL;
+    }
+
+    // build every pair first so that we do not lose any items if we fail
+    if (front) {
+        begin = end = self->map.begin();
+        for (Py_ssize_t ix = 0; ix < n; ++ix, ++end) {
+            if (!(item = sortedmap::itemiter::elem(end))) {
+                Py_DECREF(ret);
+                return NULL;
+            }
+            PyList_SET_ITEM(ret, ix, item);
         }
     }
-    catch (PythonError &e) {
-        return -1;
+    else {
+        begin = end = self->map.end();
+        for (Py_ssize_t ix = 0; ix < n; ++ix) {
+            if (!(item = sortedmap::itemiter::elem(--begin))) {
+                Py_DECREF(ret);
+                return NULL;
+            }
+            PyList_SET_ITEM(ret, ix, item);
+        }
     }
-    return 0;
-}
-
 
-PyObject*
-sortedmap::setdefault(sortedmap::object *self, PyObject *key, PyObject *def) {
-    PyObject *ret;
-    try {
-        ret = sortedmap::valiter::elem(
-            std::get<0>(self->map.emplace(key, def)));
-        if (ret != def) {
-            ++self->iter_revision;
+    if (n) {
+        try {
+            if (self->journal) {
+                std::vector<std::pair<PyObject*, PyObject*>> changes;
+                for (auto it = begin; it != end; ++it) {
+                    changes.emplace_back(std::get<0>(*it), Py_None);
+                }
+                journal_many_throws(self,
+                                    sortedmap::journal_op::erase,
+                                    changes);
+            }
         }
-        return ret;
-    }
-    catch (PythonError &e) {
-        return NULL;
+        catch (PythonError &e) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        sortedmap::bump_revision(self);
+        for (auto it = begin; it != end; ++it) {
+            unindex(self, it);
+        }
+        self->map.erase(begin, end);
+        STAT_INC(&self->stats, erases);
     }
+    return ret;
 }
 
 PyObject*
-sortedmap::pysetdefault(sortedmap::object *self,
-                        PyObject *args,
-                        PyObject *kwargs) {
-    const char *keywords[] = {"key", "default", NULL};
-    PyObject *key;
-    PyObject *def = NULL;
+sortedmap::pypopitems(sortedmap::object *self,
+                      PyObject *args,
+                      PyObject *kwargs) {
+    const char *keywords[] = {"n", "first", NULL};
+    Py_ssize_t n;
+    PyObject *pyfirst = NULL;
+    int first = true;
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "O|O:setdefault",
+                                     "n|O:popitems",
                                      (char**) keywords,
-                                     &key,
-                                     &def)) {
+                                     &n,
+                                     &pyfirst)) {
         return NULL;
     }
 
-    if (!def) {
-        def = Py_None;
-    }
-    return sortedmap::setdefault(self, key, def);
-}
-
-int
-sortedmap::contains(sortedmap::object *self, PyObject *key) {
-    try {
-        return self->map.find(key) != self->map.end();
-    }
-    catch (PythonError &e) {
-        return -1;
+    if (pyfirst && (first = PyObject_IsTrue(pyfirst)) < 0) {
+        return NULL;
     }
+    return sortedmap::popitems(self, n, first);
 }
 
 PyObject*
-sortedmap::repr(sortedmap::object *self) {
+sortedmap::iter_chunks(sortedmap::object *self,
+                       PyObject *args,
+                       PyObject *kwargs) {
+    using sortedmap::abstractiter::next_n;
+
+    const char *keywords[] = {"n", "kind", NULL};
+    Py_ssize_t n;
+    const char *kind = "items";
+    sortedmap::iterfunc *iter;
+    sortedmap::chunkiter::chunkfunc *chunk;
     PyObject *it;
-    PyObject *aslist;
-    PyObject *ret;
-    PyObject *keyfunc;
+    sortedmap::chunkiter::object *ret;
 
-    if (!(it = itemiter::iter(self))) {
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "n|s:iter_chunks",
+                                     (char**) keywords,
+                                     &n,
+                                     &kind)) {
         return NULL;
     }
-    aslist = PySequence_List(it);
-    Py_DECREF(it);
-    if (!aslist) {
+    if (!sortedmap::abstractiter::check_chunksize(n)) {
         return NULL;
     }
-    if (self->map.key_comp().keyfunc) {
-        if (!(keyfunc =
-              PyUnicode_FromFormat("[%R]", self->map.key_comp().keyfunc))) {
-            Py_DECREF(aslist);
-            return NULL;
-        }
+
+    if (!strcmp(kind, "keys")) {
+        iter = sortedmap::keyiter::iter;
+        chunk = next_n<sortedmap::object, sortedmap::keyiter::elem>;
+    }
+    else if (!strcmp(kind, "values")) {
+        iter = sortedmap::valiter::iter;
+        chunk = next_n<sortedmap::object, sortedmap::valiter::elem>;
+    }
+    else if (!strcmp(kind, "items")) {
+        iter = sortedmap::itemiter::iter;
+        chunk = next_n<sortedmap::object, sortedmap::itemiter::elem>;
     }
     else {
-        if (!(keyfunc = PyUnicode_FromString(""))) {
-            Py_DECREF(aslist);
-            return NULL;
-        }
+        PyErr_Format(PyExc_ValueError,
+                     "kind must be one of 'keys', 'values' or 'items',"
+                     " got '%s'",
+                     kind);
+        return NULL;
     }
-    ret = PyUnicode_FromFormat("%s%S(%R)",
-                               Py_TYPE(self)->tp_name,
-                               keyfunc,
-                               aslist);
-    Py_DECREF(keyfunc);
-    Py_DECREF(aslist);
-    return ret;
-}
-
-sortedmap::object*
-sortedmap::copy(sortedmap::object *self) {
-    sortedmap::object *ret = innernew(Py_TYPE(self),
-                                      self->map.key_comp().keyfunc);
 
-    if (unlikely(!ret)) {
+    if (!(it = iter(self))) {
         return NULL;
     }
+    if (!(ret = PyObject_New(sortedmap::chunkiter::object,
+                             &sortedmap::chunkiter::type))) {
+        Py_DECREF(it);
+        return NULL;
+    }
+    new(&ret->iter) OwnedRef<sortedmap::chunkiter::iterobject>(
+        (sortedmap::chunkiter::iterobject*) it);
+    Py_DECREF(it);
+    ret->n = n;
+    ret->chunk = chunk;
+    return (PyObject*) ret;
+}
 
-    ret->map = self->map;
-    return ret;
+// Evict pairs from the end chosen by ``evict`` until the map fits in
+// ``maxsize``.
+static void
+trim(sortedmap::object *self) {
+    std::size_t maxsize = self->opts.maxsize;
+
+    if (!maxsize) {
+        return;
+    }
+    while (self->map.size() > maxsize) {
+        auto it = (self->opts.evict_last) ?
+            std::prev(self->map.end()) :
+            self->map.begin();
+        unindex(self, it);
+        self->map.erase(it);
+        STAT_INC(&self->stats, erases);
+    }
 }
 
+// Would inserting ``key`` into a full bounded map just evict it again? This
+// only compares against the boundary key so a rejected insert is O(1).
 static bool
-merge(sortedmap::object *self, PyObject *other) {
-    if (sortedmap::check_exact(other)) {
-        sortedmap::object *asmap = (sortedmap::object*) other;
-        if (!self->map.size() &&
-            self->map.key_comp().keyfunc == asmap->map.key_comp().keyfunc) {
-            // fast path for copy constructor
-            self->map = asmap->map;
-            return true;
+rejects(sortedmap::object *self, PyObject *key) {
+    if (!self->opts.maxsize || self->map.size() < self->opts.maxsize) {
+        return false;
+    }
+    sortedmap::Comparator comp = self->map.key_comp();
+    OwnedRef<PyObject> ownedkey(key);
+    if (self->opts.evict_last) {
+        return comp(std::get<0>(*self->map.rbegin()), ownedkey);
+    }
+    return comp(ownedkey, std::get<0>(*self->map.begin()));
+}
+
+static void
+setitem_throws(sortedmap::object *self, PyObject *key, PyObject *value) {
+    std::size_t size = self->map.size();
+    Py_hash_t hash = 0;
+
+    if (self->index) {
+        // assigning to an existing key only needs the hash probe
+        hash = hash_throws(key);
+        const auto &found = self->index->find(sortedmap::indexkey{key, hash});
+        if (found != self->index->end()) {
+            assign_throws(self, std::get<1>(*found), key, value);
+            return;
         }
+    }
+    if (rejects(self, key)) {
+        return;
+    }
+    // Keys which sort after everything in the map are common (time series
+    // and bulk loads from sorted data) so hint at the end. A correct hint
+    // costs a single comparison and a wrong one adds one comparison to the
+    // normal descent.
+    const auto &it = self->map.emplace_hint(self->map.end(), key, value);
+    STAT_INC(&self->stats, emplaces);
+    if (self->map.size() != size) {
+        // A new key is only journaled once it is in the map so that a key
+        // which cannot be inserted is never recorded.
+        index_node(self, it, hash);
         try {
-            for (const auto &pair : ((sortedmap::object*) other)->map) {
-                setitem_throws(self, std::get<0>(pair), std::get<1>(pair));
-            }
+            journal_throws(self, sortedmap::journal_op::set, key, value);
         }
         catch (PythonError &e) {
-            return false;
+            unindex(self, it);
+            self->map.erase(it);
+            STAT_INC(&self->stats, erases);
+            throw;
         }
-
-        return true;
+        sortedmap::bump_revision(self);
+        trim(self);
+    }
+    else {
+        assign_throws(self, it, key, value);
     }
+}
 
+PyObject*
+sortedmap::append(sortedmap::object *self, PyObject *args) {
     PyObject *key;
+    PyObject *value;
 
-    if (PyDict_Check(other)) {
-        PyObject *value;
-        Py_ssize_t pos = 0;
+    if (!PyArg_UnpackTuple(args, "append", 2, 2, &key, &value)) {
+        return NULL;
+    }
 
-        while (PyDict_Next(other, &pos, &key, &value)) {
-            try {
-                setitem_throws(self, key, value);
-            }
-            catch (PythonError &e) {
-                return false;
+    try {
+        std::size_t size = self->map.size();
+        Py_hash_t hash = (self->index) ? hash_throws(key) : 0;
+        // The end hint only costs the comparison against the last key when
+        // ``key`` belongs at the end. Otherwise the map falls back to a full
+        // descent and we undo whatever it did.
+        auto it = self->map.emplace_hint(self->map.end(), key, value);
+        STAT_INC(&self->stats, emplaces);
+        if (self->map.size() == size || std::next(it) != self->map.end()) {
+            if (self->map.size() != size) {
+                self->map.erase(it);
+                STAT_INC(&self->stats, erases);
             }
+            PyErr_Format(PyExc_ValueError,
+                         "%R does not sort after the last key in the"
+                         " sortedmap",
+                         key);
+            return NULL;
         }
+        index_node(self, it, hash);
+        try {
+            journal_throws(self, sortedmap::journal_op::set, key, value);
+        }
+        catch (PythonError &e) {
+            unindex(self, it);
+            self->map.erase(it);
+            STAT_INC(&self->stats, erases);
+            throw;
+        }
+        sortedmap::bump_revision(self);
+        trim(self);
     }
-    else {
-        PyObject *keys;
-        PyObject *it;
-        PyObject *tmp;
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
 
-        if (unlikely(!(keys = PyMapping_Keys(other)))) {
-            return false;
+int
+sortedmap::setitem(sortedmap::object *self, PyObject *key, PyObject *value) {
+    try {
+        if (!value) {
+            const auto &it = find_throws(self, key);
+            if (it != self->map.end()) {
+                journal_throws(self, sortedmap::journal_op::erase, key);
+                unindex(self, it);
+                self->map.erase(it);
+            }
+            STAT_INC(&self->stats, erases);
+            sortedmap::bump_revision(self);
         }
-
-        it = PyObject_GetIter(keys);
-        Py_DECREF(keys);
-        if (unlikely(!it)) {
-            return false;
+        else {
+            setitem_throws(self, key, value);
         }
-        while ((key = PyIter_Next(it))) {
-            if (unlikely(!(tmp = PyObject_GetItem(other, key)))) {
-                Py_DECREF(key);
-                Py_DECREF(it);
-                return false;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+    return 0;
+}
+
+
+PyObject*
+sortedmap::setdefault(sortedmap::object *self, PyObject *key, PyObject *def) {
+    PyObject *ret;
+    try {
+        Py_hash_t hash = 0;
+        if (self->index) {
+            hash = hash_throws(key);
+            const auto &found = self->index->find(
+                sortedmap::indexkey{key, hash});
+            if (found != self->index->end()) {
+                return sortedmap::valiter::elem(std::get<1>(*found));
             }
+        }
+        const auto &inserted = self->map.emplace(key, def);
+        STAT_INC(&self->stats, emplaces);
+        if (std::get<1>(inserted)) {
+            index_node(self, std::get<0>(inserted), hash);
             try {
-                setitem_throws(self, key, tmp);
+                journal_throws(self, sortedmap::journal_op::set, key, def);
             }
             catch (PythonError &e) {
-                Py_DECREF(key);
-                Py_DECREF(it);
-                return false;
+                unindex(self, std::get<0>(inserted));
+                self->map.erase(std::get<0>(inserted));
+                STAT_INC(&self->stats, erases);
+                throw;
             }
-            Py_DECREF(key);
+            sortedmap::bump_revision(self);
         }
-        Py_DECREF(it);
-        if (unlikely(PyErr_Occurred())) {
+        ret = sortedmap::valiter::elem(std::get<0>(inserted));
+        // ``ret`` is a new reference so it outlives an eviction of its pair
+        trim(self);
+        return ret;
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmap::pysetdefault(sortedmap::object *self,
+                        PyObject *const *args,
+                        Py_ssize_t nargs,
+                        PyObject *kwnames) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[] = {NULL, NULL};
+
+    if (!parse_fastcall("setdefault",
+                        keywords,
+                        1,
+                        args,
+                        nargs,
+                        kwnames,
+                        argv)) {
+        return NULL;
+    }
+    return sortedmap::setdefault(self,
+                                 argv[0],
+                                 (argv[1]) ? argv[1] : Py_None);
+}
+
+int
+sortedmap::contains(sortedmap::object *self, PyObject *key) {
+    try {
+        if (find_throws(self, key) == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
             return false;
         }
+        return true;
+    }
+    catch (PythonError &e) {
+        return -1;
     }
-    return true;
 }
 
-static bool
-merge_from_seq2(sortedmap::object *self, PyObject *seq2) {
-    PyObject *it;
-    Py_ssize_t n;
-    PyObject *item;
-    PyObject *fast;
-
-    if (unlikely(!(it = PyObject_GetIter(seq2)))) {
-        return false;
+namespace {
+    using extract_element =
+        sortedmap::abstractiter::extract_element<sortedmap::object>;
+
+    // Which neighbor of a key to look for.
+    enum class bound {
+        floor,    // greatest key <= key
+        ceiling,  // smallest key >= key
+        lower,    // greatest key < key
+        higher,   // smallest key > key
+    };
+
+    // Find the neighbor of ``key`` in ``map``. This returns ``map.end()``
+    // when there is no such key.
+    template<bound b, typename container>
+    typename container::iterator
+    find_neighbor(container &map, PyObject *key) {
+        typename container::iterator it;
+
+        switch (b) {
+        case bound::ceiling:
+            return map.lower_bound(key);
+        case bound::higher:
+            return map.upper_bound(key);
+        case bound::floor:
+            it = map.upper_bound(key);
+            break;
+        case bound::lower:
+            it = map.lower_bound(key);
+            break;
+        }
+        // floor and lower are the entry just before the bound
+        if (it == map.begin()) {
+            return map.end();
+        }
+        return std::prev(it);
     }
 
-    for (n = 0;;++n) {
-        PyObject *key, *value;
-        Py_ssize_t len;
+    template<bound b, extract_element elem>
+    PyObject*
+    neighbor(sortedmap::object *self,
+             PyObject *const *args,
+             Py_ssize_t nargs,
+             PyObject *kwnames,
+             const char *fname) {
+        static const char *const keywords[] = {"key", "default", NULL};
+        PyObject *argv[] = {NULL, NULL};
+
+        if (!sortedmap::parse_fastcall(fname,
+                                       keywords,
+                                       1,
+                                       args,
+                                       nargs,
+                                       kwnames,
+                                       argv)) {
+            return NULL;
+        }
 
-        fast = NULL;
-        if (unlikely(!(item = PyIter_Next(it)))) {
-            if (unlikely(PyErr_Occurred())) {
-                goto fail;
+        PyObject *key = argv[0];
+        PyObject *def = argv[1];
+
+        try {
+            const auto &it = find_neighbor<b>(self->map, key);
+            if (it == self->map.end()) {
+                if (!def) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                }
+                else {
+                    Py_INCREF(def);
+                }
+                return def;
             }
-            break;
+            return elem(it);
         }
-
-        // convert item to sequence, and verify length 2
-        if (unlikely(!(fast = PySequence_Fast(item, "")))) {
-            if (PyErr_ExceptionMatches(PyExc_TypeError))
-                PyErr_Format(PyExc_TypeError,
-                             "cannot convert sortedmap update "
-                             "sequence element %zd to a sequence",
-                             n);
-            goto fail;
+        catch (PythonError &e) {
+            return NULL;
         }
-        len = PySequence_Fast_GET_SIZE(fast);
-        if (unlikely(len != 2)) {
-            PyErr_Format(PyExc_ValueError,
-                         "sortedmap update sequence element %zd "
-                         "has length %zd; 2 is required",
-                         n, len);
-            goto fail;
+    }
+
+    template<bool front, extract_element elem>
+    PyObject*
+    peek(sortedmap::object *self) {
+        if (!self->map.size()) {
+            PyErr_SetString(PyExc_KeyError, "sortedmap is empty");
+            return NULL;
         }
+        return elem((front) ? self->map.cbegin() : --self->map.cend());
+    }
+}
+
+PyObject*
+sortedmap::floor_item(sortedmap::object *self,
+                      PyObject *const *args,
+                      Py_ssize_t nargs,
+                      PyObject *kwnames) {
+    return neighbor<bound::floor, itemiter::elem>(self,
+                                                  args,
+                                                  nargs,
+                                                  kwnames,
+                                                  "floor_item");
+}
+
+PyObject*
+sortedmap::floor_key(sortedmap::object *self,
+                     PyObject *const *args,
+                     Py_ssize_t nargs,
+                     PyObject *kwnames) {
+    return neighbor<bound::floor, keyiter::elem>(self,
+                                                 args,
+                                                 nargs,
+                                                 kwnames,
+                                                 "floor_key");
+}
+
+PyObject*
+sortedmap::ceiling_item(sortedmap::object *self,
+                        PyObject *const *args,
+                        Py_ssize_t nargs,
+                        PyObject *kwnames) {
+    return neighbor<bound::ceiling, itemiter::elem>(self,
+                                                    args,
+                                                    nargs,
+                                                    kwnames,
+                                                    "ceiling_item");
+}
+
+PyObject*
+sortedmap::ceiling_key(sortedmap::object *self,
+                       PyObject *const *args,
+                       Py_ssize_t nargs,
+                       PyObject *kwnames) {
+    return neighbor<bound::ceiling, keyiter::elem>(self,
+                                                   args,
+                                                   nargs,
+                                                   kwnames,
+                                                   "ceiling_key");
+}
+
+PyObject*
+sortedmap::lower_item(sortedmap::object *self,
+                      PyObject *const *args,
+                      Py_ssize_t nargs,
+                      PyObject *kwnames) {
+    return neighbor<bound::lower, itemiter::elem>(self,
+                                                  args,
+                                                  nargs,
+                                                  kwnames,
+                                                  "lower_item");
+}
+
+PyObject*
+sortedmap::lower_key(sortedmap::object *self,
+                     PyObject *const *args,
+                     Py_ssize_t nargs,
+                     PyObject *kwnames) {
+    return neighbor<bound::lower, keyiter::elem>(self,
+                                                 args,
+                                                 nargs,
+                                                 kwnames,
+                                                 "lower_key");
+}
+
+PyObject*
+sortedmap::higher_item(sortedmap::object *self,
+                       PyObject *const *args,
+                       Py_ssize_t nargs,
+                       PyObject *kwnames) {
+    return neighbor<bound::higher, itemiter::elem>(self,
+                                                   args,
+                                                   nargs,
+                                                   kwnames,
+                                                   "higher_item");
+}
+
+PyObject*
+sortedmap::higher_key(sortedmap::object *self,
+                      PyObject *const *args,
+                      Py_ssize_t nargs,
+                      PyObject *kwnames) {
+    return neighbor<bound::higher, keyiter::elem>(self,
+                                                  args,
+                                                  nargs,
+                                                  kwnames,
+                                                  "higher_key");
+}
+
+PyObject*
+sortedmap::first_item(sortedmap::object *self) {
+    return peek<true, itemiter::elem>(self);
+}
+
+PyObject*
+sortedmap::first_key(sortedmap::object *self) {
+    return peek<true, keyiter::elem>(self);
+}
+
+PyObject*
+sortedmap::last_item(sortedmap::object *self) {
+    return peek<false, itemiter::elem>(self);
+}
+
+PyObject*
+sortedmap::last_key(sortedmap::object *self) {
+    return peek<false, keyiter::elem>(self);
+}
+
+// Find the entries of ``map`` in ``[lo, hi)`` where a bound of None leaves
+// that end open. A backwards range is empty.
+static void
+find_range(sortedmap::maptype &map,
+           PyObject *lo,
+           PyObject *hi,
+           sortedmap::maptype::iterator &begin,
+           sortedmap::maptype::iterator &end) {
+    begin = (lo == Py_None) ? map.begin() : map.lower_bound(lo);
+    if (hi == Py_None) {
+        end = map.end();
+    }
+    else if (lo != Py_None && !map.key_comp()(lo, hi)) {
+        end = begin;
+    }
+    else {
+        end = map.lower_bound(hi);
+    }
+}
+
+PyObject*
+sortedmap::count_range(sortedmap::object *self,
+                       PyObject *const *args,
+                       Py_ssize_t nargs,
+                       PyObject *kwnames) {
+    static const char *const keywords[] = {"lo", "hi", NULL};
+    PyObject *argv[] = {NULL, NULL};
+    sortedmap::maptype::iterator begin;
+    sortedmap::maptype::iterator end;
+
+    if (!parse_fastcall("count_range",
+                        keywords,
+                        0,
+                        args,
+                        nargs,
+                        kwnames,
+                        argv)) {
+        return NULL;
+    }
+
+    try {
+#ifdef __GLIBCXX__
+        if (self->aggregate) {
+            return PyLong_FromSize_t(
+                summarize_range_throws(*self->aggregate,
+                                       (argv[0]) ? argv[0] : Py_None,
+                                       (argv[1]) ? argv[1] : Py_None).count);
+        }
+#endif  // __GLIBCXX__
+        find_range(self->map,
+                   (argv[0]) ? argv[0] : Py_None,
+                   (argv[1]) ? argv[1] : Py_None,
+                   begin,
+                   end);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    if (begin == self->map.begin() && end == self->map.end()) {
+        return PyLong_FromSize_t(self->map.size());
+    }
+    // std::map keeps no subtree sizes, so this walks the range, but only
+    // follows node links without comparing any keys
+    return PyLong_FromSize_t(std::distance(begin, end));
+}
+
+// Erase the pairs in ``[lo, hi)`` for which ``pred(key, value)`` is
+// ``remove_when``. ``pred`` sees the whole range before anything is erased so
+// that it never observes a half filtered map and an exception leaves the map
+// as it was. The matching nodes are then erased through their iterators with
+// a single revision bump.
+static PyObject*
+filter(sortedmap::object *self,
+       const char *fname,
+       bool remove_when,
+       PyObject *const *args,
+       Py_ssize_t nargs,
+       PyObject *kwnames) {
+    static const char *const keywords[] = {"pred", "lo", "hi", NULL};
+    PyObject *argv[] = {NULL, NULL, NULL};
+    sortedmap::maptype::iterator begin;
+    sortedmap::maptype::iterator end;
+
+    if (!sortedmap::parse_fastcall(fname,
+                                   keywords,
+                                   1,
+                                   args,
+                                   nargs,
+                                   kwnames,
+                                   argv)) {
+        return NULL;
+    }
+
+    try {
+        find_range(self->map,
+                   (argv[1]) ? argv[1] : Py_None,
+                   (argv[2]) ? argv[2] : Py_None,
+                   begin,
+                   end);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+
+    unsigned long revision = self->iter_revision;
+    std::vector<sortedmap::maptype::iterator> doomed;
+    for (auto it = begin; it != end; ++it) {
+        PyObject *result = PyObject_CallFunctionObjArgs(
+            argv[0],
+            (PyObject*) std::get<0>(*it),
+            (PyObject*) std::get<1>(*it),
+            NULL);
+        int status;
+
+        if (!result) {
+            return NULL;
+        }
+        status = PyObject_IsTrue(result);
+        Py_DECREF(result);
+        if (status < 0) {
+            return NULL;
+        }
+        if (self->iter_revision != revision) {
+            PyErr_Format(PyExc_RuntimeError,
+                         "sortedmap changed size during %s",
+                         fname);
+            return NULL;
+        }
+        if (status == remove_when) {
+            doomed.push_back(it);
+        }
+    }
+
+    if (doomed.size()) {
+        try {
+            if (self->journal) {
+                std::vector<std::pair<PyObject*, PyObject*>> changes;
+                changes.reserve(doomed.size());
+                for (const auto &it : doomed) {
+                    changes.emplace_back(std::get<0>(*it), Py_None);
+                }
+                journal_many_throws(self,
+                                    sortedmap::journal_op::erase,
+                                    changes);
+            }
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+
+        // Dropping the last reference to a key or value may run arbitrary
+        // code so hold them until every node is erased.
+        std::vector<OwnedRef<PyObject>> graveyard;
+        graveyard.reserve(2 * doomed.size());
+
+        sortedmap::bump_revision(self);
+        for (const auto &it : doomed) {
+            graveyard.emplace_back(std::get<0>(*it));
+            graveyard.emplace_back(std::move(std::get<1>(*it)));
+            unindex(self, it);
+            self->map.erase(it);
+            STAT_INC(&self->stats, erases);
+        }
+    }
+    return PyLong_FromSize_t(doomed.size());
+}
+
+PyObject*
+sortedmap::remove_if(sortedmap::object *self,
+                     PyObject *const *args,
+                     Py_ssize_t nargs,
+                     PyObject *kwnames) {
+    return filter(self, "remove_if", true, args, nargs, kwnames);
+}
+
+PyObject*
+sortedmap::retain_if(sortedmap::object *self,
+                     PyObject *const *args,
+                     Py_ssize_t nargs,
+                     PyObject *kwnames) {
+    return filter(self, "retain_if", false, args, nargs, kwnames);
+}
+
+namespace {
+    // Read ``ob`` as a C long if it is an exact int which fits in one.
+    bool
+    exact_long(PyObject *ob, long &out) {
+#if COMPILING_IN_PY2
+        if (PyInt_CheckExact(ob)) {
+            out = PyInt_AS_LONG(ob);
+            return true;
+        }
+        return false;
+#else
+        int overflow;
+        if (!PyLong_CheckExact(ob)) {
+            return false;
+        }
+        out = PyLong_AsLongAndOverflow(ob, &overflow);
+        return !overflow;
+#endif  // COMPILING_IN_PY2
+    }
+
+    // Box a C long as the type Python's own int arithmetic would return.
+    PyObject*
+    tolong(long l) {
+#if COMPILING_IN_PY2
+        return PyInt_FromLong(l);
+#else
+        return PyLong_FromLong(l);
+#endif  // COMPILING_IN_PY2
+    }
+
+    // One of the ``mul`` or ``add`` operands of ``map_values`` along with the
+    // C forms it may be used in without going through the number protocol.
+    struct scalar {
+        PyObject *ob = NULL;
+        bool is_long = false;
+        bool is_double = false;
+        long l = 0;
+        double d = 0;
+
+        scalar(PyObject *ob) : ob(ob) {
+            if (!ob) {
+                return;
+            }
+            if (PyFloat_CheckExact(ob)) {
+                d = PyFloat_AS_DOUBLE(ob);
+                is_double = true;
+            }
+            else if (exact_long(ob, l)) {
+                // this is how float arithmetic converts an int operand
+                d = static_cast<double>(l);
+                is_long = is_double = true;
+            }
+        }
+    };
+
+    // Compute ``value * mul + add`` where either operand may be missing.
+    // Exact ints which fit in a C long and exact floats are handled without
+    // allocating the intermediate product; anything else, including a C
+    // long overflow, uses ``PyNumber_Multiply`` and ``PyNumber_Add`` to get
+    // the same result that Python would.
+    PyObject*
+    affine(PyObject *value, const scalar &mul, const scalar &add) {
+        long l;
+        double d;
+
+        if (PyFloat_CheckExact(value)) {
+            d = PyFloat_AS_DOUBLE(value);
+            if ((!mul.ob || mul.is_double) && (!add.ob || add.is_double)) {
+                if (mul.ob) {
+                    d *= mul.d;
+                }
+                if (add.ob) {
+                    d += add.d;
+                }
+                return PyFloat_FromDouble(d);
+            }
+        }
+        else if (exact_long(value, l)) {
+            if (!mul.ob || mul.is_long) {
+                long product = l;
+                if (!mul.ob || !__builtin_mul_overflow(l, mul.l, &product)) {
+                    long total;
+                    if (!add.ob) {
+                        return tolong(product);
+                    }
+                    if (add.is_long) {
+                        if (!__builtin_add_overflow(product, add.l, &total)) {
+                            return tolong(total);
+                        }
+                    }
+                    else if (add.is_double) {
+                        return PyFloat_FromDouble(
+                            static_cast<double>(product) + add.d);
+                    }
+                }
+            }
+            else if (mul.is_double && (!add.ob || add.is_double)) {
+                d = static_cast<double>(l) * mul.d;
+                if (add.ob) {
+                    d += add.d;
+                }
+                return PyFloat_FromDouble(d);
+            }
+        }
+
+        PyObject *result = value;
+        Py_INCREF(result);
+        if (mul.ob) {
+            PyObject *tmp = PyNumber_Multiply(result, mul.ob);
+            Py_DECREF(result);
+            if (!(result = tmp)) {
+                return NULL;
+            }
+        }
+        if (add.ob) {
+            PyObject *tmp = PyNumber_Add(result, add.ob);
+            Py_DECREF(result);
+            result = tmp;
+        }
+        return result;
+    }
+}
+
+// Replace every value in ``[lo, hi)`` with ``func(value)`` or
+// ``value * mul + add``. All of the new values are computed before any are
+// stored so an exception leaves the map as it was. The values are then
+// swapped into the existing nodes, so the keys and the hash index are never
+// touched and iterators over the map stay valid.
+PyObject*
+sortedmap::map_values(sortedmap::object *self,
+                      PyObject *const *args,
+                      Py_ssize_t nargs,
+                      PyObject *kwnames) {
+    static const char *const keywords[] = {"func", "lo", "hi", "mul", "add",
+                                           NULL};
+    PyObject *argv[] = {NULL, NULL, NULL, NULL, NULL};
+    sortedmap::maptype::iterator begin;
+    sortedmap::maptype::iterator end;
+
+    if (!parse_fastcall("map_values",
+                        keywords,
+                        0,
+                        args,
+                        nargs,
+                        kwnames,
+                        argv)) {
+        return NULL;
+    }
+
+    PyObject *func = (argv[0] == Py_None) ? NULL : argv[0];
+    scalar mul((argv[3] == Py_None) ? NULL : argv[3]);
+    scalar add((argv[4] == Py_None) ? NULL : argv[4]);
+    if (!func == !(mul.ob || add.ob)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "map_values() needs exactly one of func or mul and"
+                        " add");
+        return NULL;
+    }
+
+    try {
+        find_range(self->map,
+                   (argv[1]) ? argv[1] : Py_None,
+                   (argv[2]) ? argv[2] : Py_None,
+                   begin,
+                   end);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+
+    unsigned long revision = self->iter_revision;
+    std::vector<OwnedRef<PyObject>> fresh;
+    for (auto it = begin; it != end; ++it) {
+        PyObject *value = std::get<1>(*it);
+        PyObject *result = (func) ?
+            PyObject_CallFunctionObjArgs(func, value, NULL) :
+            affine(value, mul, add);
+
+        if (!result) {
+            return NULL;
+        }
+        fresh.emplace_back(result);
+        Py_DECREF(result);
+        if (self->iter_revision != revision) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "sortedmap changed size during map_values");
+            return NULL;
+        }
+    }
+
+    try {
+        summary_cursor summaries(self, begin);
+
+        if (self->journal) {
+            std::vector<std::pair<PyObject*, PyObject*>> changes;
+            std::size_t n = 0;
+            for (auto it = begin; it != end; ++it, ++n) {
+                if (fresh[n].ob != std::get<1>(*it).ob) {
+                    changes.emplace_back(std::get<0>(*it), fresh[n].ob);
+                }
+            }
+            journal_many_throws(self, sortedmap::journal_op::set, changes);
+        }
+        if (self->iter_revision != revision) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "sortedmap changed size during map_values");
+            return NULL;
+        }
+
+        // The old values are swapped into ``fresh`` and released after every
+        // node is updated because dropping them may run arbitrary code.
+        std::size_t n = 0;
+        for (auto it = begin; it != end; ++it, ++n) {
+            std::swap(std::get<1>(*it).ob, fresh[n].ob);
+            summaries.set(std::get<1>(*it));
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+namespace {
+    // Add the values in ``[begin, end)`` from left to right starting at 0.
+    // Runs of exact ints which fit in a C long and of exact floats are added
+    // without allocating an intermediate object for each step.
+    PyObject*
+    sum_values(sortedmap::maptype::iterator begin,
+               sortedmap::maptype::iterator end) {
+        enum class mode {
+            ints,     // ``itotal`` holds the sum
+            floats,   // ``ftotal`` holds the sum
+            objects,  // ``total`` holds the sum
+        };
+
+        mode m = mode::ints;
+        long itotal = 0;
+        double ftotal = 0;
+        PyObject *total = NULL;
+        PyObject *tmp;
+
+        for (; begin != end; ++begin) {
+            PyObject *value = std::get<1>(*begin);
+
+            if (m == mode::ints) {
+                long lvalue;
+#if COMPILING_IN_PY2
+                if (PyInt_CheckExact(value)) {
+                    lvalue = PyInt_AS_LONG(value);
+#else
+                int overflow;
+                if (PyLong_CheckExact(value) &&
+                    (lvalue = PyLong_AsLongAndOverflow(value, &overflow),
+                     !overflow)) {
+#endif  // COMPILING_IN_PY2
+                    long next;
+                    if (!__builtin_add_overflow(itotal, lvalue, &next)) {
+                        itotal = next;
+                        continue;
+                    }
+                }
+                else if (PyFloat_CheckExact(value)) {
+                    // int + float is a float
+                    ftotal = (double) itotal + PyFloat_AS_DOUBLE(value);
+                    m = mode::floats;
+                    continue;
+                }
+                if (!(total = PyLong_FromLong(itotal))) {
+                    return NULL;
+                }
+                m = mode::objects;
+            }
+            else if (m == mode::floats) {
+                if (PyFloat_CheckExact(value)) {
+                    ftotal += PyFloat_AS_DOUBLE(value);
+                    continue;
+                }
+                if (!(total = PyFloat_FromDouble(ftotal))) {
+                    return NULL;
+                }
+                m = mode::objects;
+            }
+
+            tmp = PyNumber_Add(total, value);
+            Py_DECREF(total);
+            if (!(total = tmp)) {
+                return NULL;
+            }
+        }
+
+        switch (m) {
+        case mode::ints:
+            return PyLong_FromLong(itotal);
+        case mode::floats:
+            return PyFloat_FromDouble(ftotal);
+        default:
+            return total;
+        }
+    }
+
+    // Find the smallest or, when ``greatest`` is set, the largest value in
+    // ``[begin, end)``. Like ``min`` and ``max`` the first of equal values is
+    // returned.
+    template<bool greatest>
+    PyObject*
+    extreme_value(sortedmap::maptype::iterator begin,
+                  sortedmap::maptype::iterator end) {
+        if (begin == end) {
+            PyErr_Format(PyExc_ValueError,
+                         "aggregate() %s of an empty range",
+                         (greatest) ? "max" : "min");
+            return NULL;
+        }
+
+        PyObject *best = std::get<1>(*begin);
+        while (++begin != end) {
+            PyObject *value = std::get<1>(*begin);
+            if ((greatest) ? key_less(best, value) : key_less(value, best)) {
+                best = value;
+            }
+        }
+        Py_INCREF(best);
+        return best;
+    }
+
+#ifdef __GLIBCXX__
+    // Reduce a range from its summary into ``ret``, which is NULL on error.
+    // This returns false if the range has to be walked instead because it
+    // holds values the summary does not reduce, is empty for ``min`` or
+    // ``max``, or ``op`` is not known.
+    bool
+    reduce_summary(const sortedmap::summary &s,
+                   const char *op,
+                   PyObject *&ret) {
+        PyObject *best;
+
+        if (!strcmp(op, "count")) {
+            ret = PyLong_FromSize_t(s.count);
+            return true;
+        }
+        if (s.others) {
+            return false;
+        }
+        if (!strcmp(op, "sum")) {
+            if (s.overflow) {
+                return false;
+            }
+            ret = (s.floats) ?
+                PyFloat_FromDouble((double) s.isum + s.fsum) :
+                PyLong_FromLongLong(s.isum);
+            return true;
+        }
+        if (!strcmp(op, "min")) {
+            best = s.min;
+        }
+        else if (!strcmp(op, "max")) {
+            best = s.max;
+        }
+        else {
+            return false;
+        }
+        if (!best) {
+            return false;
+        }
+        Py_INCREF(best);
+        ret = best;
+        return true;
+    }
+#endif  // __GLIBCXX__
+}
+
+PyObject*
+sortedmap::aggregate(sortedmap::object *self,
+                     PyObject *const *args,
+                     Py_ssize_t nargs,
+                     PyObject *kwnames) {
+    static const char *const keywords[] = {"lo", "hi", "op", NULL};
+    PyObject *argv[] = {NULL, NULL, NULL};
+    sortedmap::maptype::iterator begin;
+    sortedmap::maptype::iterator end;
+    const char *op = "sum";
+
+    if (!parse_fastcall("aggregate",
+                        keywords,
+                        0,
+                        args,
+                        nargs,
+                        kwnames,
+                        argv)) {
+        return NULL;
+    }
+    if (argv[2]) {
+#if COMPILING_IN_PY2
+        op = PyString_AsString(argv[2]);
+#else
+        op = PyUnicode_AsUTF8(argv[2]);
+#endif  // COMPILING_IN_PY2
+        if (!op) {
+            return NULL;
+        }
+    }
+
+    try {
+#ifdef __GLIBCXX__
+        PyObject *ret;
+        if (self->aggregate &&
+            reduce_summary(summarize_range_throws(
+                               *self->aggregate,
+                               (argv[0]) ? argv[0] : Py_None,
+                               (argv[1]) ? argv[1] : Py_None),
+                           op,
+                           ret)) {
+            return ret;
+        }
+#endif  // __GLIBCXX__
+        find_range(self->map,
+                   (argv[0]) ? argv[0] : Py_None,
+                   (argv[1]) ? argv[1] : Py_None,
+                   begin,
+                   end);
+
+        if (!strcmp(op, "sum")) {
+            return sum_values(begin, end);
+        }
+        if (!strcmp(op, "min")) {
+            return extreme_value<false>(begin, end);
+        }
+        if (!strcmp(op, "max")) {
+            return extreme_value<true>(begin, end);
+        }
+        if (!strcmp(op, "count")) {
+            return PyLong_FromSize_t(std::distance(begin, end));
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    PyErr_Format(PyExc_ValueError,
+                 "op must be one of 'sum', 'min', 'max' or 'count', got '%s'",
+                 op);
+    return NULL;
+}
+
+// Format the part of the repr that names the class and how it was
+// specialized, for example ``sortedmap[len]``.
+static PyObject*
+ordering_repr(PyTypeObject *cls,
+              PyObject *keyfunc,
+              bool reverse,
+              const sortedmap::options &opts = sortedmap::options()) {
+    if (!reverse && !opts.maxsize && !opts.indexed && !opts.aggregate) {
+        if (keyfunc) {
+            return PyUnicode_FromFormat("%s[%R]", cls->tp_name, keyfunc);
+        }
+        return PyUnicode_FromString(cls->tp_name);
+    }
+
+    std::string args;
+    auto arg = [&args](const std::string &text) {
+        args += (args.empty()) ? text : ", " + text;
+    };
+    if (reverse) {
+        arg("reverse=True");
+    }
+    if (opts.maxsize) {
+        arg("maxsize=" + std::to_string(opts.maxsize));
+        if (opts.evict_last) {
+            arg("evict='last'");
+        }
+    }
+    if (opts.indexed) {
+        arg("index=True");
+    }
+    if (opts.aggregate) {
+        arg("aggregate=True");
+    }
+    if (keyfunc) {
+        return PyUnicode_FromFormat("%s.configure(keyfunc=%R, %s)",
+                                    cls->tp_name,
+                                    keyfunc,
+                                    args.c_str());
+    }
+    return PyUnicode_FromFormat("%s.configure(%s)",
+                                cls->tp_name,
+                                args.c_str());
+}
+
+PyObject*
+sortedmap::repr(sortedmap::object *self) {
+    PyObject *it;
+    PyObject *aslist;
+    PyObject *ret;
+    PyObject *prefix;
+
+    if (!(it = itemiter::iter(self))) {
+        return NULL;
+    }
+    aslist = PySequence_List(it);
+    Py_DECREF(it);
+    if (!aslist) {
+        return NULL;
+    }
+    if (!(prefix = ordering_repr(Py_TYPE(self),
+                                 self->map.key_comp().keyfunc,
+                                 self->map.key_comp().reverse,
+                                 self->opts))) {
+        Py_DECREF(aslist);
+        return NULL;
+    }
+    ret = PyUnicode_FromFormat("%S(%R)", prefix, aslist);
+    Py_DECREF(prefix);
+    Py_DECREF(aslist);
+    return ret;
+}
+
+sortedmap::object*
+sortedmap::copy(sortedmap::object *self) {
+    sortedmap::object *ret = innernew(Py_TYPE(self),
+                                      self->map.key_comp().keyfunc,
+                                      self->map.key_comp().reverse,
+                                      self->opts);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+
+    ret->map = self->map;
+    try {
+        reindex(ret);
+    }
+    catch (PythonError &e) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+// The key of an entry in a sortedmap or a sortedset.
+static const OwnedRef<PyObject>&
+entry_key(const sortedmap::maptype::value_type &pair) {
+    return std::get<0>(pair);
+}
+
+static const OwnedRef<PyObject>&
+entry_key(const OwnedRef<PyObject> &key) {
+    return key;
+}
+
+// Find the first entry at or after ``pos`` whose key is not less than
+// ``key``. Every entry before ``pos`` must already be less than ``key``.
+// This gallops forward from ``pos`` so it makes O(log d) comparisons where d
+// is the distance moved, though it still steps through the d nodes.
+template<typename iterator>
+static iterator
+gallop_lower_bound(sortedmap::Comparator &comp,
+                   iterator pos,
+                   iterator end,
+                   const OwnedRef<PyObject> &key) {
+    if (pos == end || !comp(entry_key(*pos), key)) {
+        return pos;
+    }
+
+    // ``lo`` is always known to be less than ``key``
+    iterator lo = pos;
+    for (std::size_t step = 1;; step *= 2) {
+        iterator hi = lo;
+        std::size_t n = 0;
+
+        while (n < step && hi != end) {
+            ++hi;
+            ++n;
+        }
+        if (hi == end || !comp(entry_key(*hi), key)) {
+            // the answer is in (lo, hi]; binary search the n - 1 entries
+            // strictly between them
+            iterator first = std::next(lo);
+            std::size_t len = n - 1;
+
+            while (len) {
+                std::size_t half = len / 2;
+                iterator mid = std::next(first, half);
+
+                if (comp(entry_key(*mid), key)) {
+                    first = std::next(mid);
+                    len -= half + 1;
+                }
+                else {
+                    len = half;
+                }
+            }
+            return first;
+        }
+        lo = hi;
+    }
+}
+
+#ifdef __GLIBCXX__
+// libstdc++ links every node to its parent, so a finger can climb to the
+// smallest subtree which must hold the answer and descend from there. This
+// visits O(log d) nodes for an answer d entries away where stepping through
+// the entries would visit all d of them, each one likely a cache miss.
+static const OwnedRef<PyObject>&
+node_key(std::_Rb_tree_node_base *node) {
+    using nodetype = std::_Rb_tree_node<sortedmap::maptype::value_type>;
+    return std::get<0>(*static_cast<nodetype*>(node)->_M_valptr());
+}
+
+template<bool upper>
+static sortedmap::maptype::iterator
+finger_bound(sortedmap::object *map,
+             sortedmap::maptype::iterator pos,
+             const OwnedRef<PyObject> &key) {
+    sortedmap::Comparator comp = map->map.key_comp();
+    std::_Rb_tree_node_base *header = map->map.end()._M_node;
+    std::_Rb_tree_node_base *node = pos._M_node;
+    std::_Rb_tree_node_base *result = header;
+    // is ``n`` before the answer?
+    auto before = [&](std::_Rb_tree_node_base *n) {
+        return (upper) ? !comp(key, node_key(n)) : comp(node_key(n), key);
+    };
+
+    if (node == header) {
+        return (upper) ? map->map.upper_bound(key) : map->map.lower_bound(key);
+    }
+
+    if (before(node)) {
+        // The answer is after the finger. Climb until a parent which is
+        // entered from the left is not before the answer, the answer is
+        // then that parent or in the subtree we came from.
+        for (;;) {
+            std::_Rb_tree_node_base *parent = node->_M_parent;
+            if (parent == header) {
+                break;
+            }
+            if (node == parent->_M_left && !before(parent)) {
+                result = parent;
+                break;
+            }
+            node = parent;
+        }
+    }
+    else {
+        // The answer is the finger or before it. Climb until a parent which
+        // is entered from the right is before the answer, the answer is
+        // then in the subtree we came from.
+        result = node;
+        for (;;) {
+            std::_Rb_tree_node_base *parent = node->_M_parent;
+            if (parent == header) {
+                break;
+            }
+            if (node == parent->_M_right && before(parent)) {
+                break;
+            }
+            node = parent;
+        }
+    }
+
+    // the usual bound search, starting from the subtree we stopped in
+    while (node) {
+        if (!before(node)) {
+            result = node;
+            node = node->_M_left;
+        }
+        else {
+            node = node->_M_right;
+        }
+    }
+    return sortedmap::maptype::iterator(result);
+}
+#else
+template<bool upper>
+static sortedmap::maptype::iterator
+finger_bound(sortedmap::object *map,
+             sortedmap::maptype::iterator,
+             const OwnedRef<PyObject> &key) {
+    return (upper) ? map->map.upper_bound(key) : map->map.lower_bound(key);
+}
+#endif  // __GLIBCXX__
+
+// Move a finger to the first entry whose key is not less than ``key``.
+static void
+finger_seek_throws(sortedmap::finger::object *self,
+                   const OwnedRef<PyObject> &key) {
+    sortedmap::object *map = self->map.ob;
+
+    if (self->iter_revision != map->iter_revision) {
+        // the node under the finger may be gone
+        self->pos = map->map.lower_bound(key);
+        self->iter_revision = map->iter_revision;
+        return;
+    }
+    self->pos = finger_bound<false>(map, self->pos, key);
+}
+
+// Is the finger on ``key`` after seeking to it?
+static bool
+finger_find_throws(sortedmap::finger::object *self, PyObject *key) {
+    OwnedRef<PyObject> ownedkey(key);
+    sortedmap::object *map = self->map.ob;
+
+    finger_seek_throws(self, ownedkey);
+    if (self->pos == map->map.end() ||
+        map->map.key_comp()(ownedkey, std::get<0>(*self->pos))) {
+        STAT_INC(&map->stats, failed_lookups);
+        return false;
+    }
+    return true;
+}
+
+sortedmap::finger::object*
+sortedmap::finger::newfinger(sortedmap::object *map, PyObject *key) {
+    sortedmap::finger::object *self;
+
+    if (!(self = PyObject_New(sortedmap::finger::object,
+                              &sortedmap::finger::type))) {
+        return NULL;
+    }
+    new(&self->map) OwnedRef<sortedmap::object>(map);
+    self->iter_revision = map->iter_revision;
+    try {
+        self->pos = (key) ? map->map.lower_bound(key) : map->map.begin();
+    }
+    catch (PythonError &e) {
+        self->pos = map->map.end();
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+void
+sortedmap::finger::dealloc(sortedmap::finger::object *self) {
+    using ownedtype = OwnedRef<sortedmap::object>;
+
+    self->map.~ownedtype();
+    PyObject_Del(self);
+}
+
+PyObject*
+sortedmap::finger::seek(sortedmap::finger::object *self, PyObject *key) {
+    try {
+        finger_seek_throws(self, key);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    if (self->pos == self->map.ob->map.end()) {
+        Py_RETURN_NONE;
+    }
+    return sortedmap::itemiter::elem(self->pos);
+}
+
+PyObject*
+sortedmap::finger::get(sortedmap::finger::object *self, PyObject *args) {
+    PyObject *key;
+    PyObject *def = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &def)) {
+        return NULL;
+    }
+    try {
+        if (!finger_find_throws(self, key)) {
+            Py_INCREF(def);
+            return def;
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    return std::get<1>(*self->pos).incref();
+}
+
+PyObject*
+sortedmap::finger::getitem(sortedmap::finger::object *self, PyObject *key) {
+    try {
+        if (!finger_find_throws(self, key)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    return std::get<1>(*self->pos).incref();
+}
+
+int
+sortedmap::finger::contains(sortedmap::finger::object *self, PyObject *key) {
+    try {
+        return finger_find_throws(self, key);
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+PyObject*
+sortedmap::pyfinger(sortedmap::object *self,
+                    PyObject *const *args,
+                    Py_ssize_t nargs,
+                    PyObject *kwnames) {
+    static const char *const keywords[] = {"key", NULL};
+    PyObject *argv[] = {NULL};
+
+    if (!parse_fastcall("finger", keywords, 0, args, nargs, kwnames, argv)) {
+        return NULL;
+    }
+    return (PyObject*) sortedmap::finger::newfinger(
+        self,
+        (argv[0] == Py_None) ? NULL : argv[0]);
+}
+
+// Look up the value at the greatest key not greater than each of ``keys``.
+// The search for each probe starts from the answer to the last one so sorted
+// probes are answered in one merged walk over the map: a few entries are
+// stepped through and then, for a far away answer, the search climbs from
+// there like a finger.
+PyObject*
+sortedmap::asof(sortedmap::object *self,
+                PyObject *const *args,
+                Py_ssize_t nargs,
+                PyObject *kwnames) {
+    static const char *const keywords[] = {"keys", "default", NULL};
+    PyObject *argv[] = {NULL, NULL};
+
+    if (!parse_fastcall("asof", keywords, 1, args, nargs, kwnames, argv)) {
+        return NULL;
+    }
+
+    PyObject *def = (argv[1]) ? argv[1] : Py_None;
+    // a tuple cannot be resized by the comparisons
+    PyObject *fast = PySequence_Tuple(argv[0]);
+    if (!fast) {
+        return NULL;
+    }
+
+    Py_ssize_t size = PyTuple_GET_SIZE(fast);
+    PyObject **keys = PySequence_Fast_ITEMS(fast);
+    PyObject *ret = PyList_New(size);
+    if (!ret) {
+        Py_DECREF(fast);
+        return NULL;
+    }
+
+    sortedmap::Comparator comp = self->map.key_comp();
+    unsigned long revision = self->iter_revision;
+    auto begin = self->map.begin();
+    auto end = self->map.end();
+    // the first entry greater than the last probe
+    auto pos = begin;
+
+    try {
+        for (Py_ssize_t n = 0; n < size; ++n) {
+            OwnedRef<PyObject> key(keys[n]);
+
+            if (pos == begin || !comp(key, std::get<0>(*std::prev(pos)))) {
+                // the answer is at or after ``pos``
+                int steps = 0;
+                while (pos != end && !comp(key, std::get<0>(*pos))) {
+                    if (++steps > 4) {
+                        pos = finger_bound<true>(self, pos, key);
+                        break;
+                    }
+                    ++pos;
+                }
+            }
+            else {
+                // the probes went backwards
+                pos = self->map.upper_bound(key);
+            }
+            if (self->iter_revision != revision) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "sortedmap changed size during asof");
+                throw PythonError();
+            }
+
+            PyObject *value = (pos == begin) ?
+                def :
+                (PyObject*) std::get<1>(*std::prev(pos));
+            Py_INCREF(value);
+            PyList_SET_ITEM(ret, n, value);
+        }
+    }
+    catch (PythonError &e) {
+        Py_DECREF(ret);
+        Py_DECREF(fast);
+        return NULL;
+    }
+    Py_DECREF(fast);
+    return ret;
+}
+
+// Insert or replace ``pair`` given ``pos``, the first entry of ``self`` whose
+// key is not less than the key of ``pair``. This returns the entry after
+// ``pair`` which is where the search for the next larger key may start.
+static sortedmap::maptype::iterator
+merge_at(sortedmap::object *self,
+         sortedmap::Comparator &comp,
+         sortedmap::maptype::iterator pos,
+         const sortedmap::maptype::value_type &pair) {
+    if (pos != self->map.end() &&
+        !comp(std::get<0>(pair), std::get<0>(*pos))) {
+        assign_throws(self, pos, std::get<0>(pair), std::get<1>(pair));
+        return std::next(pos);
+    }
+    Py_hash_t hash = (self->index) ? hash_throws(std::get<0>(pair)) : 0;
+    index_node(self,
+               self->map.emplace_hint(pos,
+                                      std::get<0>(pair),
+                                      std::get<1>(pair)),
+               hash);
+    STAT_INC(&self->stats, emplaces);
+    return pos;
+}
+
+// Merge a map with the same ordering into ``self`` with a single forward
+// walk over both maps. This makes O(m log(n / m)) comparisons for m new
+// entries into a map of size n instead of O(m log(n)).
+static void
+merge_sorted_throws(sortedmap::object *self, sortedmap::object *other) {
+    sortedmap::Comparator comp = self->map.key_comp();
+    std::size_t size = self->map.size();
+    auto pos = self->map.begin();
+
+    try {
+        for (const auto &pair : other->map) {
+            pos = gallop_lower_bound(comp,
+                                     pos,
+                                     self->map.end(),
+                                     std::get<0>(pair));
+            pos = merge_at(self, comp, pos, pair);
+        }
+    }
+    catch (PythonError &e) {
+        if (self->map.size() != size) {
+            sortedmap::bump_revision(self);
+            trim(self);
+        }
+        throw;
+    }
+    if (self->map.size() != size) {
+        sortedmap::bump_revision(self);
+        trim(self);
+    }
+}
+
+static bool
+merge(sortedmap::object *self, PyObject *other) {
+    if (sortedmap::check_exact(other)) {
+        sortedmap::object *asmap = (sortedmap::object*) other;
+        // a journal records each pair so only the plain inserts apply
+        if (!self->journal &&
+            self->map.key_comp() == asmap->map.key_comp()) {
+            if (!self->map.size()) {
+                // fast path for copy constructor
+                self->map = asmap->map;
+                try {
+                    reindex(self);
+                }
+                catch (PythonError &e) {
+                    sortedmap::clear(self);
+                    return false;
+                }
+                if (self->map.size()) {
+                    sortedmap::bump_revision(self);
+                    trim(self);
+                }
+                return true;
+            }
+            try {
+                merge_sorted_throws(self, asmap);
+            }
+            catch (PythonError &e) {
+                return false;
+            }
+            return true;
+        }
+        try {
+            for (const auto &pair : asmap->map) {
+                setitem_throws(self, std::get<0>(pair), std::get<1>(pair));
+            }
+        }
+        catch (PythonError &e) {
+            return false;
+        }
+
+        return true;
+    }
+
+    PyObject *key;
+
+    if (PyDict_Check(other)) {
+        PyObject *value;
+        Py_ssize_t pos = 0;
+
+        while (PyDict_Next(other, &pos, &key, &value)) {
+            try {
+                setitem_throws(self, key, value);
+            }
+            catch (PythonError &e) {
+                return false;
+            }
+        }
+    }
+    else {
+        PyObject *keys;
+        PyObject *it;
+        PyObject *tmp;
+
+        if (unlikely(!(keys = PyMapping_Keys(other)))) {
+            return false;
+        }
+
+        it = PyObject_GetIter(keys);
+        Py_DECREF(keys);
+        if (unlikely(!it)) {
+            return false;
+        }
+        while ((key = PyIter_Next(it))) {
+            if (unlikely(!(tmp = PyObject_GetItem(other, key)))) {
+                Py_DECREF(key);
+                Py_DECREF(it);
+                return false;
+            }
+            try {
+                setitem_throws(self, key, tmp);
+            }
+            catch (PythonError &e) {
+                Py_DECREF(key);
+                Py_DECREF(it);
+                return false;
+            }
+            Py_DECREF(key);
+        }
+        Py_DECREF(it);
+        if (unlikely(PyErr_Occurred())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+merge_from_seq2(sortedmap::object *self, PyObject *seq2) {
+    PyObject *it;
+    Py_ssize_t n;
+    PyObject *item;
+    PyObject *fast;
+
+    if (unlikely(!(it = PyObject_GetIter(seq2)))) {
+        return false;
+    }
+
+    for (n = 0;;++n) {
+        PyObject *key, *value;
+        Py_ssize_t len;
+
+        fast = NULL;
+        if (unlikely(!(item = PyIter_Next(it)))) {
+            if (unlikely(PyErr_Occurred())) {
+                goto fail;
+            }
+            break;
+        }
+
+        // convert item to sequence, and verify length 2
+        if (unlikely(!(fast = PySequence_Fast(item, "")))) {
+            if (PyErr_ExceptionMatches(PyExc_TypeError))
+                PyErr_Format(PyExc_TypeError,
+                             "cannot convert sortedmap update "
+                             "sequence element %zd to a sequence",
+                             n);
+            goto fail;
+        }
+        len = PySequence_Fast_GET_SIZE(fast);
+        if (unlikely(len != 2)) {
+            PyErr_Format(PyExc_ValueError,
+                         "sortedmap update sequence element %zd "
+                         "has length %zd; 2 is required",
+                         n, len);
+            goto fail;
+        }
+
+        // update with this (key, value) pair
+        key = PySequence_Fast_GET_ITEM(fast, 0);
+        value = PySequence_Fast_GET_ITEM(fast, 1);
+        try{
+            setitem_throws(self, key, value);
+        }
+        catch (PythonError &e) {
+            goto fail;
+        }
+        Py_DECREF(fast);
+        Py_DECREF(item);
+    }
+
+    n = 0;
+    goto return_;
+fail:
+    Py_XDECREF(item);
+    Py_XDECREF(fast);
+    n = -1;
+return_:
+    Py_DECREF(it);
+    return !Py_SAFE_DOWNCAST(n, Py_ssize_t, int);
+}
+
+// Update ``self`` from the optional positional argument to ``update``.
+static bool
+update_arg(sortedmap::object *self, PyObject *arg) {
+#if !COMPILING_IN_PY2
+    _Py_IDENTIFIER(keys);
+
+    if (_PyObject_HasAttrId(arg, &PyId_keys))
+#else
+    if (PyObject_HasAttrString(arg, "keys"))
+#endif  // !COMPILING_IN_PY2
+    {
+        return merge(self, arg);
+    }
+    return merge_from_seq2(self, arg);
+}
+
+bool
+sortedmap::update(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
+    PyObject *arg = NULL;
+
+    if (unlikely(!PyArg_UnpackTuple(args, "update", 0, 1, &arg))) {
+        return false;
+    }
+
+    if (arg && unlikely(!update_arg(self, arg))) {
+        return false;
+    }
+    if (kwargs && PyDict_Size(kwargs)) {
+        if (unlikely(!merge(self, kwargs))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+sortedmap::update_fastcall(sortedmap::object *self,
+                           PyObject *const *args,
+                           Py_ssize_t nargs,
+                           PyObject *kwnames) {
+    if (unlikely(nargs > 1)) {
+        PyErr_Format(PyExc_TypeError,
+                     "update expected at most 1 arguments, got %zd",
+                     nargs);
+        return false;
+    }
+
+    if (nargs && unlikely(!update_arg(self, args[0]))) {
+        return false;
+    }
+    if (kwnames) {
+        // the keyword arguments are the pairs, no need to build a dict
+        try {
+            for (Py_ssize_t ix = 0; ix < PyTuple_GET_SIZE(kwnames); ++ix) {
+                setitem_throws(self,
+                               PyTuple_GET_ITEM(kwnames, ix),
+                               args[nargs + ix]);
+            }
+        }
+        catch (PythonError &e) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PyObject*
+sortedmap::pyupdate(sortedmap::object *self,
+                    PyObject *const *args,
+                    Py_ssize_t nargs,
+                    PyObject *kwnames) {
+    if (unlikely(!sortedmap::update_fastcall(self, args, nargs, kwnames))) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+PyObject*
+sortedmap::absorb(sortedmap::object *self, PyObject *other) {
+    if (!sortedmap::check(other)) {
+        PyErr_Format(PyExc_TypeError,
+                     "absorb() argument must be a sortedmap, not %.200s",
+                     Py_TYPE(other)->tp_name);
+        return NULL;
+    }
+    if (other == (PyObject*) self) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot absorb a sortedmap into itself");
+        return NULL;
+    }
+
+    sortedmap::object *asmap = (sortedmap::object*) other;
+    sortedmap::Comparator comp = self->map.key_comp();
+    // a journal records each pair so only the plain inserts apply
+    bool same_order = !self->journal && comp == asmap->map.key_comp();
+    // When ``other`` has a journal its pairs are erased together after the
+    // loop so that their erase records are written in one batch.
+    bool defer = asmap->journal != NULL;
+    bool failed = false;
+    std::size_t size = self->map.size();
+    auto pos = self->map.begin();
+    auto it = asmap->map.begin();
+
+    if (asmap->map.size()) {
+        sortedmap::bump_revision(asmap);
+    }
+    try {
+        while (it != asmap->map.end()) {
+            if (same_order) {
+                pos = gallop_lower_bound(comp,
+                                         pos,
+                                         self->map.end(),
+                                         std::get<0>(*it));
+                pos = merge_at(self, comp, pos, *it);
+            }
+            else {
+                setitem_throws(self, std::get<0>(*it), std::get<1>(*it));
+            }
+            if (defer) {
+                ++it;
+                continue;
+            }
+            // release the node as soon as its pair lives in ``self``
+            unindex(asmap, it);
+            it = asmap->map.erase(it);
+            STAT_INC(&asmap->stats, erases);
+        }
+    }
+    catch (PythonError &e) {
+        failed = true;
+    }
+
+    if (defer && it != asmap->map.begin()) {
+        // Keep an insert error over a journal error. If the erases cannot
+        // be recorded the moved pairs stay in ``other`` as well.
+        PyObject *type;
+        PyObject *value;
+        PyObject *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        try {
+            std::vector<std::pair<PyObject*, PyObject*>> changes;
+            for (auto moved = asmap->map.begin(); moved != it; ++moved) {
+                changes.emplace_back(std::get<0>(*moved), Py_None);
+            }
+            journal_many_throws(asmap, sortedmap::journal_op::erase, changes);
+            for (auto moved = asmap->map.begin(); moved != it; ++moved) {
+                unindex(asmap, moved);
+            }
+            asmap->map.erase(asmap->map.begin(), it);
+            STAT_INC(&asmap->stats, erases);
+        }
+        catch (PythonError &e) {
+            if (failed) {
+                PyErr_Clear();
+            }
+            failed = true;
+        }
+        if (type) {
+            PyErr_Restore(type, value, tb);
+        }
+    }
+
+    if (self->map.size() != size) {
+        sortedmap::bump_revision(self);
+        trim(self);
+    }
+    if (failed) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+sortedmap::object*
+sortedmap::fromkeys(PyTypeObject *cls, PyObject *seq, PyObject *value) {
+    sortedmap::object *self;
+    PyObject *it;
+    PyObject *key;
+
+    if (unlikely(!(it = PyObject_GetIter(seq)))) {
+        return NULL;
+    }
+
+    if (unlikely(!(self = innernew(cls, NULL)))) {
+        Py_DECREF(it);
+        return NULL;
+    }
+
+    while ((key = PyIter_Next(it))) {
+        self->map.emplace(key, value);
+        STAT_INC(&self->stats, emplaces);
+        Py_DECREF(key);
+    }
+    Py_DECREF(it);
+    if (unlikely(PyErr_Occurred())) {
+        return NULL;
+    }
+
+    return self;
+}
+
+sortedmap::object*
+sortedmap::pyfromkeys(PyObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"seq", "value", NULL};
+    PyObject *seq;
+    PyObject *value = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|O:fromkeys",
+                                     (char**) keywords,
+                                     &seq,
+                                     &value)) {
+        return NULL;
+    }
+
+    if (!value) {
+        value = Py_None;
+    }
+
+    return sortedmap::fromkeys((PyTypeObject*) cls, seq, value);
+}
+
+PyObject*
+sortedmap::configure(PyObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {
+        "keyfunc", "reverse", "maxsize", "evict", "index", "aggregate", NULL,
+    };
+    PyObject *keyfunc = Py_None;
+    PyObject *pyreverse = NULL;
+    PyObject *pymaxsize = Py_None;
+    PyObject *pyevict = NULL;
+    PyObject *pyindex = NULL;
+    PyObject *pyaggregate = NULL;
+    int reverse = false;
+    int indexed = false;
+    int aggregate = false;
+    sortedmap::options opts = sortedmap::options();
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|OOOOOO:configure",
+                                     (char**) keywords,
+                                     &keyfunc,
+                                     &pyreverse,
+                                     &pymaxsize,
+                                     &pyevict,
+                                     &pyindex,
+                                     &pyaggregate)) {
+        return NULL;
+    }
+
+    if (pyreverse && (reverse = PyObject_IsTrue(pyreverse)) < 0) {
+        return NULL;
+    }
+    if (pyindex && (indexed = PyObject_IsTrue(pyindex)) < 0) {
+        return NULL;
+    }
+    opts.indexed = indexed;
+    if (pyaggregate && (aggregate = PyObject_IsTrue(pyaggregate)) < 0) {
+        return NULL;
+    }
+    opts.aggregate = aggregate;
+    if (pymaxsize != Py_None) {
+        Py_ssize_t maxsize = PyNumber_AsSsize_t(pymaxsize,
+                                                PyExc_OverflowError);
+        if (maxsize == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (maxsize < 1) {
+            PyErr_Format(PyExc_ValueError,
+                         "maxsize must be positive, got %zd",
+                         maxsize);
+            return NULL;
+        }
+        opts.maxsize = maxsize;
+    }
+    if (pyevict) {
+#if COMPILING_IN_PY2
+        const char *evict = PyString_AsString(pyevict);
+#else
+        const char *evict = PyUnicode_AsUTF8(pyevict);
+#endif  // COMPILING_IN_PY2
+        if (!evict) {
+            return NULL;
+        }
+        if (!strcmp(evict, "last")) {
+            opts.evict_last = true;
+        }
+        else if (strcmp(evict, "first")) {
+            PyErr_Format(PyExc_ValueError,
+                         "evict must be 'first' or 'last', got %R",
+                         pyevict);
+            return NULL;
+        }
+    }
+    return (PyObject*) sortedmap::meta::newpartial(
+        cls,
+        (keyfunc == Py_None) ? NULL : keyfunc,
+        reverse,
+        opts);
+}
+
+// The bytes of each node of ``Tree``. libstdc++ allocates each entry as an
+// ``_Rb_tree_node``: the colour, parent, left and right links followed by
+// the entry itself.
+template<typename Tree>
+static constexpr std::size_t
+node_size() {
+#ifdef __GLIBCXX__
+    return sizeof(std::_Rb_tree_node<typename Tree::value_type>);
+#else
+    return 4 * sizeof(void*) + sizeof(typename Tree::value_type);
+#endif  // __GLIBCXX__
+}
+
+// The bytes the allocator adds on top of ``node_size`` for each node.
+template<typename Tree>
+static std::size_t
+node_slack(const Tree &tree) {
+#if defined(__GLIBCXX__) && defined(__GLIBC__)
+    if (!tree.size()) {
+        return 0;
+    }
+    // every node is the same size so they all land in the same malloc size
+    // class; glibc also keeps a size_t header before each chunk
+    return malloc_usable_size(const_cast<std::_Rb_tree_node_base*>(
+                                  tree.cbegin()._M_node)) +
+        sizeof(std::size_t) - node_size<Tree>();
+#else
+    return 0;
+#endif  // __GLIBCXX__ && __GLIBC__
+}
+
+// The bytes held by the hash index: the table itself, its bucket array and a
+// node per key holding the next link and the (key, node) entry.
+static std::size_t
+index_size(const sortedmap::object *self) {
+    if (!self->index) {
+        return 0;
+    }
+    return sizeof(sortedmap::indextype) +
+        self->index->bucket_count() * sizeof(void*) +
+        self->index->size() *
+        (sizeof(void*) + sizeof(sortedmap::indextype::value_type));
+}
+
+PyObject*
+sortedmap::sizeof_(sortedmap::object *self) {
+    std::size_t size = Py_TYPE(self)->tp_basicsize +
+        self->map.size() *
+        (node_size<sortedmap::maptype>() + node_slack(self->map)) +
+        index_size(self) +
+        aggregate_size(self);
+    return PyLong_FromSize_t(size);
+}
+
+static bool
+set_size(PyObject *dict, const char *name, std::size_t size) {
+    PyObject *value;
+    int status;
+
+    if (!(value = PyLong_FromSize_t(size))) {
+        return false;
+    }
+    status = PyDict_SetItemString(dict, name, value);
+    Py_DECREF(value);
+    return !status;
+}
+
+// Add the ``sys.getsizeof`` of ``ob`` to ``total`` unless it was already
+// counted.
+static bool
+add_object_size(PyObject *getsizeof,
+                std::unordered_set<PyObject*> &seen,
+                PyObject *ob,
+                std::size_t &total) {
+    PyObject *pysize;
+    Py_ssize_t size;
+
+    if (!std::get<1>(seen.insert(ob))) {
+        return true;
+    }
+    if (!(pysize = PyObject_CallFunctionObjArgs(getsizeof, ob, NULL))) {
+        return false;
+    }
+    size = PyNumber_AsSsize_t(pysize, PyExc_OverflowError);
+    Py_DECREF(pysize);
+    if (unlikely(size == -1 && PyErr_Occurred())) {
+        return false;
+    }
+    total += size;
+    return true;
+}
+
+PyObject*
+sortedmap::memory_usage(sortedmap::object *self,
+                        PyObject *args,
+                        PyObject *kwargs) {
+    const char *keywords[] = {"deep", NULL};
+    PyObject *pydeep = NULL;
+    int deep = false;
+    std::size_t header = Py_TYPE(self)->tp_basicsize;
+    std::size_t nodes = self->map.size() * node_size<sortedmap::maptype>();
+    std::size_t slack = self->map.size() * node_slack(self->map);
+    std::size_t index = index_size(self);
+    std::size_t aggregate = aggregate_size(self);
+    std::size_t keys = 0;
+    std::size_t values = 0;
+    PyObject *ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:memory_usage",
+                                     (char**) keywords,
+                                     &pydeep)) {
+        return NULL;
+    }
+
+    if (pydeep && (deep = PyObject_IsTrue(pydeep)) < 0) {
+        return NULL;
+    }
+
+    if (deep) {
+        PyObject *sys;
+        PyObject *getsizeof;
+        std::unordered_set<PyObject*> seen;
+
+        if (!(sys = PyImport_ImportModule("sys"))) {
+            return NULL;
+        }
+        getsizeof = PyObject_GetAttrString(sys, "getsizeof");
+        Py_DECREF(sys);
+        if (!getsizeof) {
+            return NULL;
+        }
+
+        // collect the objects first so that a ``__sizeof__`` which mutates
+        // this map cannot invalidate our iterator
+        std::vector<OwnedRef<PyObject>> keyobs;
+        std::vector<OwnedRef<PyObject>> valobs;
+        keyobs.reserve(self->map.size());
+        valobs.reserve(self->map.size());
+        for (const auto &pair : self->map) {
+            keyobs.emplace_back(std::get<0>(pair));
+            valobs.emplace_back(std::get<1>(pair));
+        }
+        for (const auto &ob : keyobs) {
+            if (!add_object_size(getsizeof, seen, ob, keys)) {
+                Py_DECREF(getsizeof);
+                return NULL;
+            }
+        }
+        for (const auto &ob : valobs) {
+            if (!add_object_size(getsizeof, seen, ob, values)) {
+                Py_DECREF(getsizeof);
+                return NULL;
+            }
+        }
+        Py_DECREF(getsizeof);
+    }
+
+    if (!(ret = PyDict_New())) {
+        return NULL;
+    }
+    if (!set_size(ret, "object", header) ||
+        !set_size(ret, "nodes", nodes) ||
+        !set_size(ret, "slack", slack) ||
+        (self->index && !set_size(ret, "index", index)) ||
+        (self->aggregate && !set_size(ret, "aggregate", aggregate)) ||
+        (deep && (!set_size(ret, "keys", keys) ||
+                  !set_size(ret, "values", values))) ||
+        !set_size(ret,
+                  "total",
+                  header + nodes + slack + index + aggregate + keys +
+                  values)) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+#ifdef SORTEDMAP_STATS
+// The height of the red black tree backing ``map``. This walks the nodes
+// directly so it is only available with libstdc++; otherwise -1 is returned.
+static long
+tree_height(const sortedmap::maptype &map) {
+#ifdef __GLIBCXX__
+    std::vector<std::pair<std::_Rb_tree_node_base*, long>> stack;
+    long height = 0;
+
+    // the parent of the header node is the root of the tree
+    if (map.cend()._M_node->_M_parent) {
+        stack.emplace_back(map.cend()._M_node->_M_parent, 1);
+    }
+    while (stack.size()) {
+        auto node = std::get<0>(stack.back());
+        long depth = std::get<1>(stack.back());
+
+        stack.pop_back();
+        height = std::max(height, depth);
+        if (node->_M_left) {
+            stack.emplace_back(node->_M_left, depth + 1);
+        }
+        if (node->_M_right) {
+            stack.emplace_back(node->_M_right, depth + 1);
+        }
+    }
+    return height;
+#else
+    return -1;
+#endif  // __GLIBCXX__
+}
+
+PyObject*
+sortedmap::pystats(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"reset", NULL};
+    PyObject *pyreset = NULL;
+    int reset = false;
+    PyObject *ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:stats",
+                                     (char**) keywords,
+                                     &pyreset)) {
+        return NULL;
+    }
+
+    if (pyreset && (reset = PyObject_IsTrue(pyreset)) < 0) {
+        return NULL;
+    }
+
+    const std::array<std::pair<const char*, unsigned long>, 8> fields = {{
+        {"comparisons", self->stats.comparisons},
+        {"keyfunc_calls", self->stats.keyfunc_calls},
+        {"emplaces", self->stats.emplaces},
+        {"erases", self->stats.erases},
+        {"failed_lookups", self->stats.failed_lookups},
+        {"revision_bumps", self->stats.revision_bumps},
+        {"iterator_invalidations", self->stats.iterator_invalidations},
+        {"size", self->map.size()},
+    }};
+    PyObject *value;
+    long height;
+
+    if (!(ret = PyDict_New())) {
+        return NULL;
+    }
+    for (const auto &field : fields) {
+        if (!(value = PyLong_FromUnsignedLong(std::get<1>(field)))) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        if (PyDict_SetItemString(ret, std::get<0>(field), value)) {
+            Py_DECREF(value);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+
+    if ((height = tree_height(self->map)) < 0) {
+        value = Py_None;
+        Py_INCREF(value);
+    }
+    else if (!(value = PyLong_FromLong(height))) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    if (PyDict_SetItemString(ret, "height", value)) {
+        Py_DECREF(value);
+        Py_DECREF(ret);
+        return NULL;
+    }
+    Py_DECREF(value);
+
+    if (reset) {
+        self->stats = sortedmap::counters();
+    }
+    return ret;
+}
+#endif  // SORTEDMAP_STATS
+
+PyObject*
+sortedmap::get_iter_revision(object *self) {
+    return PyLong_FromUnsignedLong(self->iter_revision);
+}
+
+PyObject*
+sortedmap::get_keyfunc(object *self) {
+    PyObject *ret =self->map.key_comp().keyfunc;
+    if (!ret) {
+        ret = Py_None;
+    }
+    Py_INCREF(ret);
+    return ret;
+}
+
+PyObject*
+sortedmap::get_reverse(object *self) {
+    return PyBool_FromLong(self->map.key_comp().reverse);
+}
+
+PyObject*
+sortedmap::get_maxsize(object *self) {
+    if (!self->opts.maxsize) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromSize_t(self->opts.maxsize);
+}
+
+PyObject*
+sortedmap::get_evict(object *self) {
+    return PyUnicode_FromString((self->opts.evict_last) ? "last" : "first");
+}
+
+PyObject*
+sortedmap::get_index(object *self) {
+    return PyBool_FromLong(self->index != NULL);
+}
+
+PyObject*
+sortedmap::get_journal(object *self) {
+    if (!self->journal) {
+        Py_RETURN_NONE;
+    }
+    return PyObject_GetAttrString(self->journal, "__self__");
+}
+
+int
+sortedmap::set_journal(object *self, PyObject *journal) {
+    PyObject *record = NULL;
+    PyObject *record_many = NULL;
+
+    if (journal && journal != Py_None) {
+        if (!(record = PyObject_GetAttrString(journal, "record"))) {
+            if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+                PyErr_Format(PyExc_TypeError,
+                             "journal must have a record method, got"
+                             " %.200s",
+                             Py_TYPE(journal)->tp_name);
+            }
+            return -1;
+        }
+        if (!(record_many = PyObject_GetAttrString(journal, "record_many"))) {
+            if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+                Py_DECREF(record);
+                return -1;
+            }
+            // batches fall back to one ``record`` call per change
+            PyErr_Clear();
+        }
+    }
+    PyObject *old = self->journal;
+    PyObject *old_many = self->journal_many;
+    self->journal = record;
+    self->journal_many = record_many;
+    Py_XDECREF(old);
+    Py_XDECREF(old_many);
+    return 0;
+}
+
+void
+sortedmap::meta::partial::dealloc(sortedmap::meta::partial::object *self) {
+    using ownedtype = OwnedRef<PyObject>;
+    using ownedcls = OwnedRef<PyTypeObject>;
+
+    PyObject_GC_UnTrack(self);
+    self->cls.~ownedcls();
+    self->keyfunc.~ownedtype();
+    PyObject_GC_Del(self);
+}
+
+PyObject*
+sortedmap::meta::partial::call(sortedmap::meta::partial::object *self,
+                               PyObject *args,
+                               PyObject *kwargs) {
+    return self->construct(self->cls.ob,
+                           self->keyfunc.ob,
+                           self->reverse,
+                           self->opts,
+                           args,
+                           kwargs);
+}
+
+#if HAVE_VECTORCALL
+PyObject*
+sortedmap::meta::partial::vectorcall(PyObject *callable,
+                                     PyObject *const *args,
+                                     size_t nargsf,
+                                     PyObject *kwnames) {
+    sortedmap::meta::partial::object *self =
+        (sortedmap::meta::partial::object*) callable;
+    sortedmap::object *m;
+
+    if (!(m = innernew(self->cls,
+                       self->keyfunc.ob,
+                       self->reverse,
+                       self->opts))) {
+        return NULL;
+    }
+    if (!sortedmap::update_fastcall(m,
+                                    args,
+                                    PyVectorcall_NARGS(nargsf),
+                                    kwnames)) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    return (PyObject*) m;
+}
+#endif  // HAVE_VECTORCALL
+
+PyObject*
+sortedmap::meta::partial::repr(sortedmap::meta::partial::object *self) {
+    if (!self->keyfunc.ob &&
+        !self->reverse &&
+        !self->opts.maxsize &&
+        !self->opts.indexed &&
+        !self->opts.aggregate) {
+        return PyUnicode_FromFormat("%s.configure()", self->cls.ob->tp_name);
+    }
+    return ordering_repr(self->cls.ob,
+                         self->keyfunc.ob,
+                         self->reverse,
+                         self->opts);
+}
+
+int
+sortedmap::meta::partial::traverse(sortedmap::meta::partial::object *self,
+                                   visitproc visit,
+                                   void *arg) {
+    Py_VISIT((PyObject*) self->cls.ob);
+    Py_VISIT(self->keyfunc);
+    return 0;
+}
+
+int
+sortedmap::meta::partial::clear(sortedmap::meta::partial::object *self) {
+    // release the references but leave the members alive for dealloc
+    self->cls = OwnedRef<PyTypeObject>();
+    self->keyfunc = OwnedRef<PyObject>();
+    return 0;
+}
+
+sortedmap::meta::partial::object*
+sortedmap::meta::newpartial(PyObject *cls,
+                            PyObject *keyfunc,
+                            bool reverse,
+                            const sortedmap::options &opts) {
+    sortedmap::meta::partial::object *partial;
+    bool has_options = (opts.maxsize ||
+                        opts.evict_last ||
+                        opts.indexed ||
+                        opts.aggregate);
+
+    if (!PyType_Check(cls)) {
+        PyErr_Format(PyExc_TypeError, "%R is not a type object", cls);
+        return NULL;
+    }
+    if (has_options &&
+        !PyType_IsSubtype((PyTypeObject*) cls, &sortedmap::type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s does not support maxsize, evict, index or aggregate",
+                     ((PyTypeObject*) cls)->tp_name);
+        return NULL;
+    }
+    if (opts.indexed && keyfunc) {
+        // the index hashes the keys themselves, not what ``keyfunc`` makes
+        PyErr_SetString(PyExc_ValueError,
+                        "index=True cannot be combined with a keyfunc");
+        return NULL;
+    }
+
+    if (!(partial = PyObject_GC_New(sortedmap::meta::partial::object,
+                                    &sortedmap::meta::partial::type))) {
+        return NULL;
+    }
+    new(partial) sortedmap::meta::partial::object;
+    partial->cls = std::move((PyTypeObject*) cls);
+    partial->keyfunc = std::move(keyfunc);
+    partial->reverse = reverse;
+    partial->opts = opts;
+    if (PyType_IsSubtype((PyTypeObject*) cls, &sortedmultimap::type)) {
+        partial->construct = sortedmultimap::construct;
+    }
+    else if (PyType_IsSubtype((PyTypeObject*) cls, &sortedset::type)) {
+        partial->construct = sortedset::construct;
+    }
+    else {
+        partial->construct = sortedmap::construct;
+    }
+#if HAVE_VECTORCALL
+    // only sortedmap has a vectorcall constructor, the others fall back to
+    // ``call``
+    partial->vectorcall = (partial->construct == sortedmap::construct) ?
+        sortedmap::meta::partial::vectorcall :
+        NULL;
+#endif  // HAVE_VECTORCALL
+    PyObject_GC_Track(partial);
+    return partial;
+}
+
+sortedmap::meta::partial::object*
+sortedmap::meta::getitem(PyObject *cls, PyObject *keyfunc) {
+    return sortedmap::meta::newpartial(cls,
+                                       keyfunc,
+                                       false,
+                                       sortedmap::options());
+}
+
+bool
+sortedmultimap::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &sortedmultimap::type);
+}
+
+PyObject*
+sortedmultimap::keyiter::elem(sortedmultimap::keyiter::itertype it) {
+    return sortedmap::abstractiter::pair_key(it);
+}
+
+PyObject*
+sortedmultimap::valiter::elem(sortedmultimap::valiter::itertype it) {
+    return sortedmap::abstractiter::pair_value(it);
+}
+
+PyObject*
+sortedmultimap::itemiter::elem(sortedmultimap::itemiter::itertype it) {
+    return sortedmap::abstractiter::pair_item(it);
+}
+
+PyObject*
+sortedmultimap::keyiter::iter(sortedmultimap::object *self) {
+    return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                         sortedmultimap::keyiter::type>(self);
+}
+
+PyObject*
+sortedmultimap::valiter::iter(sortedmultimap::object *self) {
+    return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                         sortedmultimap::valiter::type>(self);
+}
+
+PyObject*
+sortedmultimap::itemiter::iter(sortedmultimap::object *self) {
+    return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                         sortedmultimap::itemiter::type>(self);
+}
+
+PyObject*
+sortedmultimap::keyview::view(sortedmultimap::object *self) {
+    return sortedmap::abstractview::view<sortedmultimap::object,
+                                         sortedmultimap::keyview::type>(self);
+}
+
+PyObject*
+sortedmultimap::valview::view(sortedmultimap::object *self) {
+    return sortedmap::abstractview::view<sortedmultimap::object,
+                                         sortedmultimap::valview::type>(self);
+}
+
+PyObject*
+sortedmultimap::itemview::view(sortedmultimap::object *self) {
+    return sortedmap::abstractview::view<sortedmultimap::object,
+                                         sortedmultimap::itemview::type>(self);
+}
+
+static sortedmultimap::object*
+innernew_multi(PyTypeObject *cls, PyObject *keyfunc, bool reverse) {
+    using sortedmultimap::maptype;
+
+    sortedmultimap::object *self = PyObject_GC_New(sortedmultimap::object,
+                                                   cls);
+
+    if (unlikely(!self)) {
+        return NULL;
+    }
+
+    new(&self->map) maptype(sortedmap::Comparator(keyfunc,
+                                                  reverse,
+                                                  &self->stats));
+    self->iter_revision = 0;
+    self->stats = sortedmap::counters();
+    return self;
+}
+
+sortedmultimap::object*
+sortedmultimap::newobject(PyTypeObject *cls,
+                          PyObject *args,
+                          PyObject *kwargs) {
+    return innernew_multi(cls, NULL, false);
+}
+
+PyObject*
+sortedmultimap::construct(PyTypeObject *cls,
+                          PyObject *keyfunc,
+                          bool reverse,
+                          const sortedmap::options&,
+                          PyObject *args,
+                          PyObject *kwargs) {
+    sortedmultimap::object *self;
+
+    if (!(self = innernew_multi(cls, keyfunc, reverse))) {
+        return NULL;
+    }
+    if (sortedmultimap::init(self, args, kwargs)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+
+int
+sortedmultimap::init(sortedmultimap::object *self,
+                     PyObject *args,
+                     PyObject *kwargs) {
+    return (sortedmultimap::update(self, args, kwargs)) ? 0 : -1;
+}
+
+void
+sortedmultimap::dealloc(sortedmultimap::object *self) {
+    using sortedmultimap::maptype;
+
+    PyObject_GC_UnTrack(self);
+    self->map.~maptype();
+    PyObject_GC_Del(self);
+}
+
+int
+sortedmultimap::traverse(sortedmultimap::object *self,
+                         visitproc visit,
+                         void *arg) {
+    for (const auto &pair : self->map) {
+        Py_VISIT(pair.first);
+        Py_VISIT(pair.second);
+    }
+    return 0;
+}
+
+int
+sortedmultimap::clear(sortedmultimap::object *self) {
+    self->map.clear();
+    sortedmultimap::bump_revision(self);
+    return 0;
+}
+
+PyObject*
+sortedmultimap::pyclear(sortedmultimap::object *self) {
+    sortedmultimap::clear(self);
+    Py_RETURN_NONE;
+}
+
+// Two multimaps are equal when they have the same ordering and hold equal
+// pairs in the same order, including the order of values for equal keys.
+PyObject*
+sortedmultimap::richcompare(sortedmultimap::object *self,
+                            PyObject *other,
+                            int opid) {
+    if (!(opid == Py_EQ || opid == Py_NE) ||
+        !sortedmultimap::check(other)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    sortedmultimap::object *asmap = (sortedmultimap::object*) other;
+
+    if (self->map.size() != asmap->map.size() ||
+        !(self->map.key_comp() == asmap->map.key_comp())) {
+        return PyBool_FromLong(opid != Py_EQ);
+    }
+
+    int status;
+    auto it = self->map.cbegin();
+    auto other_it = asmap->map.cbegin();
+
+    for (; it != self->map.cend(); ++it, ++other_it) {
+        status = PyObject_RichCompareBool(std::get<0>(*it),
+                                          std::get<0>(*other_it),
+                                          Py_EQ);
+        if (status > 0) {
+            status = PyObject_RichCompareBool(std::get<1>(*it),
+                                              std::get<1>(*other_it),
+                                              Py_EQ);
+        }
+        if (unlikely(status < 0)) {
+            return NULL;
+        }
+        if (!status) {
+            return PyBool_FromLong(opid != Py_EQ);
+        }
+    }
+    return PyBool_FromLong(opid == Py_EQ);
+}
+
+Py_ssize_t
+sortedmultimap::len(sortedmultimap::object *self) {
+    return self->map.size();
+}
+
+// Collect the results of ``elem`` for each pair in ``[begin, end)``.
+template<typename iterator, typename extract>
+static PyObject*
+collect(iterator begin, iterator end, extract elem) {
+    PyObject *ret;
+    PyObject *ob;
+
+    if (!(ret = PyList_New(0))) {
+        return NULL;
+    }
+    for (; begin != end; ++begin) {
+        if (!(ob = elem(begin))) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        if (PyList_Append(ret, ob)) {
+            Py_DECREF(ob);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(ob);
+    }
+    return ret;
+}
+
+PyObject*
+sortedmultimap::getitem(sortedmultimap::object *self, PyObject *key) {
+    try {
+        const auto &range = self->map.equal_range(key);
+        if (range.first == range.second) {
+            STAT_INC(&self->stats, failed_lookups);
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+        return collect(range.first,
+                       range.second,
+                       sortedmultimap::valiter::elem);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+int
+sortedmultimap::setitem(sortedmultimap::object *self,
+                        PyObject *key,
+                        PyObject *value) {
+    if (value) {
+        PyErr_Format(PyExc_TypeError,
+                     "'%.200s' object does not support item assignment,"
+                     " use add(key, value)",
+                     Py_TYPE(self)->tp_name);
+        return -1;
+    }
+
+    try {
+        // ``erase`` compares every entry with ``key`` once more than
+        // ``equal_range`` so find the range first
+        const auto &range = self->map.equal_range(key);
+        if (range.first == range.second) {
+            STAT_INC(&self->stats, failed_lookups);
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        self->map.erase(range.first, range.second);
+        STAT_INC(&self->stats, erases);
+        sortedmultimap::bump_revision(self);
+        return 0;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+int
+sortedmultimap::contains(sortedmultimap::object *self, PyObject *key) {
+    try {
+        if (self->map.find(key) == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
+            return false;
+        }
+        return true;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+static void
+add_throws(sortedmultimap::object *self, PyObject *key, PyObject *value) {
+    // A hint of ``end()`` places the new pair after every equal key, the
+    // same as ``emplace``, and costs a single comparison when the key sorts
+    // last, which is common for time series and bulk loads.
+    self->map.emplace_hint(self->map.end(), key, value);
+    STAT_INC(&self->stats, emplaces);
+    sortedmultimap::bump_revision(self);
+}
+
+PyObject*
+sortedmultimap::add(sortedmultimap::object *self, PyObject *args) {
+    PyObject *key;
+    PyObject *value;
+
+    if (!PyArg_UnpackTuple(args, "add", 2, 2, &key, &value)) {
+        return NULL;
+    }
+    try {
+        add_throws(self, key, value);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmultimap::count(sortedmultimap::object *self, PyObject *key) {
+    try {
+        const auto &range = self->map.equal_range(key);
+        return PyLong_FromSize_t(std::distance(range.first, range.second));
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmultimap::equal_range(sortedmultimap::object *self, PyObject *key) {
+    try {
+        const auto &range = self->map.equal_range(key);
+        return collect(range.first,
+                       range.second,
+                       sortedmultimap::itemiter::elem);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmultimap::popitem(sortedmultimap::object *self,
+                        PyObject *args,
+                        PyObject *kwargs) {
+    const char *keywords[] = {"first", NULL};
+    PyObject *pyfirst = NULL;
+    int first = true;
+    sortedmultimap::maptype::iterator it;
+    PyObject *ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:popitem",
+                                     (char**) keywords,
+                                     &pyfirst)) {
+        return NULL;
+    }
+    if (pyfirst && (first = PyObject_IsTrue(pyfirst)) < 0) {
+        return NULL;
+    }
+
+    if (self->map.empty()) {
+        PyErr_SetString(PyExc_KeyError, "sortedmultimap is empty");
+        return NULL;
+    }
+
+    it = (first) ? self->map.begin() : std::prev(self->map.end());
+    if (!(ret = sortedmultimap::itemiter::elem(it))) {
+        return NULL;
+    }
+    sortedmultimap::bump_revision(self);
+    self->map.erase(it);
+    STAT_INC(&self->stats, erases);
+    return ret;
+}
+
+PyObject*
+sortedmultimap::repr(sortedmultimap::object *self) {
+    PyObject *aslist;
+    PyObject *ret;
+    PyObject *prefix;
+
+    if (!(aslist = collect(self->map.cbegin(),
+                           self->map.cend(),
+                           sortedmultimap::itemiter::elem))) {
+        return NULL;
+    }
+    if (!(prefix = ordering_repr(Py_TYPE(self),
+                                 self->map.key_comp().keyfunc,
+                                 self->map.key_comp().reverse))) {
+        Py_DECREF(aslist);
+        return NULL;
+    }
+    ret = PyUnicode_FromFormat("%S(%R)", prefix, aslist);
+    Py_DECREF(prefix);
+    Py_DECREF(aslist);
+    return ret;
+}
+
+sortedmultimap::object*
+sortedmultimap::copy(sortedmultimap::object *self) {
+    sortedmultimap::object *ret =
+        innernew_multi(Py_TYPE(self),
+                       self->map.key_comp().keyfunc,
+                       self->map.key_comp().reverse);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+
+    ret->map = self->map;
+    return ret;
+}
+
+// Add each ``(key, value)`` pair of ``seq2``.
+static bool
+add_from_seq2(sortedmultimap::object *self, PyObject *seq2) {
+    PyObject *it;
+    PyObject *item;
+    PyObject *fast;
+    Py_ssize_t len;
+
+    if (unlikely(!(it = PyObject_GetIter(seq2)))) {
+        return false;
+    }
+
+    for (Py_ssize_t n = 0;; ++n) {
+        if (!(item = PyIter_Next(it))) {
+            Py_DECREF(it);
+            return !PyErr_Occurred();
+        }
+
+        fast = PySequence_Fast(item, "");
+        Py_DECREF(item);
+        if (unlikely(!fast)) {
+            if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+                PyErr_Format(PyExc_TypeError,
+                             "cannot convert sortedmultimap update "
+                             "sequence element %zd to a sequence",
+                             n);
+            }
+            Py_DECREF(it);
+            return false;
+        }
+        len = PySequence_Fast_GET_SIZE(fast);
+        if (unlikely(len != 2)) {
+            PyErr_Format(PyExc_ValueError,
+                         "sortedmultimap update sequence element %zd "
+                         "has length %zd; 2 is required",
+                         n, len);
+            Py_DECREF(fast);
+            Py_DECREF(it);
+            return false;
+        }
+
+        try {
+            add_throws(self,
+                       PySequence_Fast_GET_ITEM(fast, 0),
+                       PySequence_Fast_GET_ITEM(fast, 1));
+        }
+        catch (PythonError &e) {
+            Py_DECREF(fast);
+            Py_DECREF(it);
+            return false;
+        }
+        Py_DECREF(fast);
+    }
+}
+
+// Add the pairs of a mapping. Another sortedmultimap contributes every
+// value it holds, other mappings one value per key.
+static bool
+add_from_mapping(sortedmultimap::object *self, PyObject *mapping) {
+    PyObject *items;
+    bool ret;
+
+    if (sortedmultimap::check(mapping)) {
+        // copy first in case ``mapping`` is ``self``
+        sortedmultimap::maptype pairs =
+            ((sortedmultimap::object*) mapping)->map;
+
+        try {
+            for (const auto &pair : pairs) {
+                add_throws(self, std::get<0>(pair), std::get<1>(pair));
+            }
+        }
+        catch (PythonError &e) {
+            return false;
+        }
+        return true;
+    }
+
+    if (!(items = PyMapping_Items(mapping))) {
+        return false;
+    }
+    ret = add_from_seq2(self, items);
+    Py_DECREF(items);
+    return ret;
+}
+
+bool
+sortedmultimap::update(sortedmultimap::object *self,
+                       PyObject *args,
+                       PyObject *kwargs) {
+    PyObject *arg = NULL;
+
+    if (unlikely(!PyArg_UnpackTuple(args, "update", 0, 1, &arg))) {
+        return false;
+    }
+
+    if (arg) {
+#if !COMPILING_IN_PY2
+        _Py_IDENTIFIER(keys);
+
+        if (_PyObject_HasAttrId(arg, &PyId_keys))
+#else
+        if (PyObject_HasAttrString(arg, "keys"))
+#endif  // !COMPILING_IN_PY2
+        {
+            if (unlikely(!add_from_mapping(self, arg))) {
+                return false;
+            }
+        }
+        else if (unlikely(!add_from_seq2(self, arg))) {
+            return false;
+        }
+    }
+    if (kwargs && PyDict_Size(kwargs)) {
+        if (unlikely(!add_from_mapping(self, kwargs))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PyObject*
+sortedmultimap::pyupdate(sortedmultimap::object *self,
+                         PyObject *args,
+                         PyObject *kwargs) {
+    if (unlikely(!sortedmultimap::update(self, args, kwargs))) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmultimap::get_iter_revision(sortedmultimap::object *self) {
+    return PyLong_FromUnsignedLong(self->iter_revision);
+}
+
+PyObject*
+sortedmultimap::get_keyfunc(sortedmultimap::object *self) {
+    PyObject *ret = self->map.key_comp().keyfunc;
+    if (!ret) {
+        ret = Py_None;
+    }
+    Py_INCREF(ret);
+    return ret;
+}
+
+PyObject*
+sortedmultimap::get_reverse(sortedmultimap::object *self) {
+    return PyBool_FromLong(self->map.key_comp().reverse);
+}
+
+bool
+sortedset::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &sortedset::type);
+}
+
+PyObject*
+sortedset::iter::elem(sortedset::iter::itertype it) {
+    return sortedmap::abstractiter::set_key(it);
+}
+
+PyObject*
+sortedset::iter::iter(sortedset::object *self) {
+    return sortedmap::abstractiter::iter<sortedset::object,
+                                         sortedset::iter::type>(self);
+}
+
+static sortedset::object*
+innernew_set(PyTypeObject *cls, PyObject *keyfunc, bool reverse) {
+    using sortedset::settype;
+
+    sortedset::object *self = PyObject_GC_New(sortedset::object, cls);
+
+    if (unlikely(!self)) {
+        return NULL;
+    }
+
+    new(&self->map) settype(sortedmap::Comparator(keyfunc,
+                                                  reverse,
+                                                  &self->stats));
+    self->iter_revision = 0;
+    self->stats = sortedmap::counters();
+    return self;
+}
+
+// A new empty set with the same ordering as ``self``.
+static sortedset::object*
+empty_like(sortedset::object *self) {
+    return innernew_set(Py_TYPE(self),
+                        self->map.key_comp().keyfunc,
+                        self->map.key_comp().reverse);
+}
+
+sortedset::object*
+sortedset::newobject(PyTypeObject *cls, PyObject *args, PyObject *kwargs) {
+    return innernew_set(cls, NULL, false);
+}
+
+PyObject*
+sortedset::construct(PyTypeObject *cls,
+                     PyObject *keyfunc,
+                     bool reverse,
+                     const sortedmap::options&,
+                     PyObject *args,
+                     PyObject *kwargs) {
+    sortedset::object *self;
+
+    if (!(self = innernew_set(cls, keyfunc, reverse))) {
+        return NULL;
+    }
+    if (sortedset::init(self, args, kwargs)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+
+int
+sortedset::init(sortedset::object *self, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"it", NULL};
+    PyObject *it = NULL;
+    PyObject *res;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:sortedset",
+                                     (char**) keywords,
+                                     &it)) {
+        return -1;
+    }
+    if (!it) {
+        return 0;
+    }
+    if (!(res = sortedset::update(self, it))) {
+        return -1;
+    }
+    Py_DECREF(res);
+    return 0;
+}
+
+void
+sortedset::dealloc(sortedset::object *self) {
+    using sortedset::settype;
+
+    PyObject_GC_UnTrack(self);
+    self->map.~settype();
+    PyObject_GC_Del(self);
+}
+
+int
+sortedset::traverse(sortedset::object *self, visitproc visit, void *arg) {
+    for (const auto &key : self->map) {
+        Py_VISIT(key);
+    }
+    return 0;
+}
+
+int
+sortedset::clear(sortedset::object *self) {
+    self->map.clear();
+    sortedset::bump_revision(self);
+    return 0;
+}
+
+PyObject*
+sortedset::pyclear(sortedset::object *self) {
+    sortedset::clear(self);
+    Py_RETURN_NONE;
+}
+
+Py_ssize_t
+sortedset::len(sortedset::object *self) {
+    return self->map.size();
+}
+
+int
+sortedset::contains(sortedset::object *self, PyObject *key) {
+    try {
+        if (self->map.find(key) == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
+            return false;
+        }
+        return true;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+static void
+add_throws(sortedset::object *self, PyObject *key) {
+    // hint at the end for sorted bulk loads, see ``setitem_throws``
+    std::size_t size = self->map.size();
+
+    self->map.emplace_hint(self->map.end(), key);
+    if (self->map.size() != size) {
+        STAT_INC(&self->stats, emplaces);
+        sortedset::bump_revision(self);
+    }
+}
+
+PyObject*
+sortedset::add(sortedset::object *self, PyObject *key) {
+    try {
+        add_throws(self, key);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// Remove ``key``, returning 1 if it was removed, 0 if it was not in the set
+// or -1 with an exception raised.
+static int
+discard_key(sortedset::object *self, PyObject *key) {
+    try {
+        const auto &it = self->map.find(key);
+        if (it == self->map.end()) {
+            STAT_INC(&self->stats, failed_lookups);
+            return 0;
+        }
+        self->map.erase(it);
+        STAT_INC(&self->stats, erases);
+        sortedset::bump_revision(self);
+        return 1;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+PyObject*
+sortedset::discard(sortedset::object *self, PyObject *key) {
+    if (discard_key(self, key) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedset::remove(sortedset::object *self, PyObject *key) {
+    switch (discard_key(self, key)) {
+    case 0:
+        PyErr_SetObject(PyExc_KeyError, key);
+        // fallthrough
+    case -1:
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedset::pop(sortedset::object *self, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"first", NULL};
+    PyObject *pyfirst = NULL;
+    int first = true;
+    sortedset::settype::iterator it;
+    PyObject *ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:pop",
+                                     (char**) keywords,
+                                     &pyfirst)) {
+        return NULL;
+    }
+    if (pyfirst && (first = PyObject_IsTrue(pyfirst)) < 0) {
+        return NULL;
+    }
+
+    if (self->map.empty()) {
+        PyErr_SetString(PyExc_KeyError, "sortedset is empty");
+        return NULL;
+    }
+
+    it = (first) ? self->map.begin() : std::prev(self->map.end());
+    ret = it->incref();
+    sortedset::bump_revision(self);
+    self->map.erase(it);
+    STAT_INC(&self->stats, erases);
+    return ret;
+}
+
+// Is ``other`` a sortedset which orders its keys like ``self``?
+static bool
+same_ordering(sortedset::object *self, PyObject *other) {
+    return sortedset::check(other) &&
+        self->map.key_comp() == ((sortedset::object*) other)->map.key_comp();
+}
+
+PyObject*
+sortedset::update(sortedset::object *self, PyObject *other) {
+    PyObject *it;
+    PyObject *key;
+
+    if (other == (PyObject*) self) {
+        Py_RETURN_NONE;
+    }
+    if (same_ordering(self, other)) {
+        // The keys arrive in order so each search gallops forward from the
+        // last insert, this is linear in the size of both sets.
+        sortedmap::Comparator comp = self->map.key_comp();
+        std::size_t size = self->map.size();
+        auto pos = self->map.begin();
+        bool failed = false;
+
+        try {
+            for (const auto &key : ((sortedset::object*) other)->map) {
+                pos = gallop_lower_bound(comp, pos, self->map.end(), key);
+                if (pos == self->map.end() || comp(key, *pos)) {
+                    pos = self->map.emplace_hint(pos, key);
+                }
+                ++pos;
+            }
+        }
+        catch (PythonError &e) {
+            failed = true;
+        }
+        // some keys may be in even if a comparison raised
+        if (self->map.size() != size) {
+            sortedset::bump_revision(self);
+        }
+        if (failed) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+
+    if (!(it = PyObject_GetIter(other))) {
+        return NULL;
+    }
+    while ((key = PyIter_Next(it))) {
+        try {
+            add_throws(self, key);
+        }
+        catch (PythonError &e) {
+            Py_DECREF(key);
+            Py_DECREF(it);
+            return NULL;
+        }
+        Py_DECREF(key);
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedset::repr(sortedset::object *self) {
+    PyObject *aslist;
+    PyObject *ret;
+    PyObject *prefix;
+
+    if (!(aslist = collect(self->map.cbegin(),
+                           self->map.cend(),
+                           sortedset::iter::elem))) {
+        return NULL;
+    }
+    if (!(prefix = ordering_repr(Py_TYPE(self),
+                                 self->map.key_comp().keyfunc,
+                                 self->map.key_comp().reverse))) {
+        Py_DECREF(aslist);
+        return NULL;
+    }
+    ret = PyUnicode_FromFormat("%S(%R)", prefix, aslist);
+    Py_DECREF(prefix);
+    Py_DECREF(aslist);
+    return ret;
+}
+
+sortedset::object*
+sortedset::copy(sortedset::object *self) {
+    sortedset::object *ret = empty_like(self);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+
+    ret->map = self->map;
+    return ret;
+}
+
+namespace {
+    template<bound b>
+    PyObject*
+    set_neighbor(sortedset::object *self, PyObject *args, const char *fmt) {
+        PyObject *key;
+        PyObject *def = NULL;
+
+        if (!PyArg_ParseTuple(args, fmt, &key, &def)) {
+            return NULL;
+        }
+
+        try {
+            const auto &it = find_neighbor<b>(self->map, key);
+            if (it == self->map.end()) {
+                if (!def) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                }
+                else {
+                    Py_INCREF(def);
+                }
+                return def;
+            }
+            return it->incref();
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+}
+
+PyObject*
+sortedset::floor(sortedset::object *self, PyObject *args) {
+    return set_neighbor<bound::floor>(self, args, "O|O:floor");
+}
+
+PyObject*
+sortedset::ceiling(sortedset::object *self, PyObject *args) {
+    return set_neighbor<bound::ceiling>(self, args, "O|O:ceiling");
+}
+
+PyObject*
+sortedset::lower(sortedset::object *self, PyObject *args) {
+    return set_neighbor<bound::lower>(self, args, "O|O:lower");
+}
+
+PyObject*
+sortedset::higher(sortedset::object *self, PyObject *args) {
+    return set_neighbor<bound::higher>(self, args, "O|O:higher");
+}
+
+PyObject*
+sortedset::first(sortedset::object *self) {
+    if (self->map.empty()) {
+        PyErr_SetString(PyExc_KeyError, "sortedset is empty");
+        return NULL;
+    }
+    return self->map.begin()->incref();
+}
+
+PyObject*
+sortedset::last(sortedset::object *self) {
+    if (self->map.empty()) {
+        PyErr_SetString(PyExc_KeyError, "sortedset is empty");
+        return NULL;
+    }
+    return std::prev(self->map.end())->incref();
+}
+
+PyObject*
+sortedset::range(sortedset::object *self, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"lo", "hi", NULL};
+    PyObject *lo = Py_None;
+    PyObject *hi = Py_None;
+    sortedset::settype::iterator begin;
+    sortedset::settype::iterator end;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|OO:range",
+                                     (char**) keywords,
+                                     &lo,
+                                     &hi)) {
+        return NULL;
+    }
+
+    try {
+        begin = (lo == Py_None) ? self->map.begin() : self->map.lower_bound(lo);
+        if (hi == Py_None) {
+            end = self->map.end();
+        }
+        else if (lo != Py_None && !self->map.key_comp()(lo, hi)) {
+            // an empty or backwards range
+            end = begin;
+        }
+        else {
+            end = self->map.lower_bound(hi);
+        }
+        return collect(begin, end, sortedset::iter::elem);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+// Return ``other`` as a sortedset ordered like ``self``. Sortedsets with the
+// same ordering are returned as is, anything else is copied into a new set.
+static sortedset::object*
+ordered_like(sortedset::object *self, PyObject *other) {
+    sortedset::object *ret;
+    PyObject *res;
+
+    if (same_ordering(self, other)) {
+        Py_INCREF(other);
+        return (sortedset::object*) other;
+    }
+    if (!(ret = empty_like(self))) {
+        return NULL;
+    }
+    if (!(res = sortedset::update(ret, other))) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    Py_DECREF(res);
+    return ret;
+}
+
+// Merge ``self`` and ``other`` into a new set with one of the sorted range
+// algorithms from ``<algorithm>``. Both sets are walked once so this makes
+// O(n + m) comparisons.
+template<typename algorithm>
+static PyObject*
+merge_sets(sortedset::object *self, PyObject *other, algorithm f) {
+    sortedset::object *rhs;
+    sortedset::object *ret;
+
+    if (!(rhs = ordered_like(self, other))) {
+        return NULL;
+    }
+    if (!(ret = empty_like(self))) {
+        Py_DECREF(rhs);
+        return NULL;
+    }
+
+    try {
+        // the keys come out in order so each insert is at the end
+        f(self->map.begin(),
+          self->map.end(),
+          rhs->map.begin(),
+          rhs->map.end(),
+          std::inserter(ret->map, ret->map.end()),
+          self->map.key_comp());
+    }
+    catch (PythonError &e) {
+        Py_DECREF(ret);
+        Py_DECREF(rhs);
+        return NULL;
+    }
+    Py_DECREF(rhs);
+    return (PyObject*) ret;
+}
+
+namespace {
+    using setiter = sortedset::settype::iterator;
+    using setinserter = std::insert_iterator<sortedset::settype>;
+}
+
+PyObject*
+sortedset::union_(sortedset::object *self, PyObject *other) {
+    return merge_sets(self,
+                      other,
+                      std::set_union<setiter,
+                                     setiter,
+                                     setinserter,
+                                     sortedmap::Comparator>);
+}
+
+PyObject*
+sortedset::intersection(sortedset::object *self, PyObject *other) {
+    return merge_sets(self,
+                      other,
+                      std::set_intersection<setiter,
+                                            setiter,
+                                            setinserter,
+                                            sortedmap::Comparator>);
+}
+
+PyObject*
+sortedset::difference(sortedset::object *self, PyObject *other) {
+    return merge_sets(self,
+                      other,
+                      std::set_difference<setiter,
+                                          setiter,
+                                          setinserter,
+                                          sortedmap::Comparator>);
+}
+
+PyObject*
+sortedset::symmetric_difference(sortedset::object *self, PyObject *other) {
+    return merge_sets(
+        self,
+        other,
+        std::set_symmetric_difference<setiter,
+                                      setiter,
+                                      setinserter,
+                                      sortedmap::Comparator>);
+}
+
+// Is every key of ``sub`` in ``super``? Both must have the same ordering.
+static int
+includes(sortedset::object *super, sortedset::object *sub) {
+    if (sub->map.size() > super->map.size()) {
+        return 0;
+    }
+    try {
+        return std::includes(super->map.begin(),
+                             super->map.end(),
+                             sub->map.begin(),
+                             sub->map.end(),
+                             super->map.key_comp());
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+// Apply ``f(self, ordered_like(self, other))`` and box the result.
+static PyObject*
+compare_sets(sortedset::object *self,
+             PyObject *other,
+             int (*f)(sortedset::object*, sortedset::object*)) {
+    sortedset::object *rhs;
+    int status;
+
+    if (!(rhs = ordered_like(self, other))) {
+        return NULL;
+    }
+    status = f(self, rhs);
+    Py_DECREF(rhs);
+    if (status < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(status);
+}
+
+static int
+is_subset(sortedset::object *self, sortedset::object *other) {
+    return includes(other, self);
+}
+
+static int
+is_superset(sortedset::object *self, sortedset::object *other) {
+    return includes(self, other);
+}
+
+static int
+is_disjoint(sortedset::object *self, sortedset::object *other) {
+    sortedmap::Comparator comp = self->map.key_comp();
+    auto a = self->map.begin();
+    auto b = other->map.begin();
+
+    try {
+        while (a != self->map.end() && b != other->map.end()) {
+            if (comp(*a, *b)) {
+                ++a;
+            }
+            else if (comp(*b, *a)) {
+                ++b;
+            }
+            else {
+                return 0;
+            }
+        }
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+    return 1;
+}
+
+PyObject*
+sortedset::issubset(sortedset::object *self, PyObject *other) {
+    return compare_sets(self, other, is_subset);
+}
+
+PyObject*
+sortedset::issuperset(sortedset::object *self, PyObject *other) {
+    return compare_sets(self, other, is_superset);
+}
+
+PyObject*
+sortedset::isdisjoint(sortedset::object *self, PyObject *other) {
+    return compare_sets(self, other, is_disjoint);
+}
+
+PyObject*
+sortedset::richcompare(sortedset::object *self, PyObject *other, int opid) {
+    sortedset::object *rhs;
+    int status;
+
+    if (!sortedset::check(other)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    if (!(rhs = ordered_like(self, other))) {
+        return NULL;
+    }
+
+    std::size_t lsize = self->map.size();
+    std::size_t rsize = rhs->map.size();
+
+    switch (opid) {
+    case Py_EQ:
+    case Py_NE:
+        status = lsize == rsize && includes(self, rhs);
+        break;
+    case Py_LT:
+        status = lsize < rsize && includes(rhs, self);
+        break;
+    case Py_LE:
+        status = includes(rhs, self);
+        break;
+    case Py_GT:
+        status = lsize > rsize && includes(self, rhs);
+        break;
+    case Py_GE:
+        status = includes(self, rhs);
+        break;
+    default:
+        Py_DECREF(rhs);
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    Py_DECREF(rhs);
+    if (status < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong((opid == Py_NE) ? !status : status);
+}
+
+// The operators only combine two sortedsets, like ``set`` the methods accept
+// any iterable.
+#define SORTEDSET_BINOP(name, method)                                   \
+    PyObject*                                                           \
+    sortedset::name(PyObject *a, PyObject *b) {                         \
+        if (!sortedset::check(a) || !sortedset::check(b)) {             \
+            Py_RETURN_NOTIMPLEMENTED;                                   \
+        }                                                               \
+        return sortedset::method((sortedset::object*) a, b);            \
+    }
+
+SORTEDSET_BINOP(or_, union_)
+SORTEDSET_BINOP(and_, intersection)
+SORTEDSET_BINOP(sub, difference)
+SORTEDSET_BINOP(xor_, symmetric_difference)
+
+#undef SORTEDSET_BINOP
+
+PyObject*
+sortedset::sizeof_(sortedset::object *self) {
+    std::size_t size = Py_TYPE(self)->tp_basicsize +
+        self->map.size() *
+        (node_size<sortedset::settype>() + node_slack(self->map));
+    return PyLong_FromSize_t(size);
+}
+
+PyObject*
+sortedset::memory_usage(sortedset::object *self,
+                        PyObject *args,
+                        PyObject *kwargs) {
+    const char *keywords[] = {"deep", NULL};
+    PyObject *pydeep = NULL;
+    int deep = false;
+    std::size_t header = Py_TYPE(self)->tp_basicsize;
+    std::size_t nodes = self->map.size() * node_size<sortedset::settype>();
+    std::size_t slack = self->map.size() * node_slack(self->map);
+    std::size_t keys = 0;
+    PyObject *ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|O:memory_usage",
+                                     (char**) keywords,
+                                     &pydeep)) {
+        return NULL;
+    }
+
+    if (pydeep && (deep = PyObject_IsTrue(pydeep)) < 0) {
+        return NULL;
+    }
+
+    if (deep) {
+        PyObject *sys;
+        PyObject *getsizeof;
+        std::unordered_set<PyObject*> seen;
+
+        if (!(sys = PyImport_ImportModule("sys"))) {
+            return NULL;
+        }
+        getsizeof = PyObject_GetAttrString(sys, "getsizeof");
+        Py_DECREF(sys);
+        if (!getsizeof) {
+            return NULL;
+        }
+
+        // collect the keys first so that a ``__sizeof__`` which mutates
+        // this set cannot invalidate our iterator
+        std::vector<OwnedRef<PyObject>> keyobs(self->map.begin(),
+                                               self->map.end());
+        for (const auto &ob : keyobs) {
+            if (!add_object_size(getsizeof, seen, ob, keys)) {
+                Py_DECREF(getsizeof);
+                return NULL;
+            }
+        }
+        Py_DECREF(getsizeof);
+    }
+
+    if (!(ret = PyDict_New())) {
+        return NULL;
+    }
+    if (!set_size(ret, "object", header) ||
+        !set_size(ret, "nodes", nodes) ||
+        !set_size(ret, "slack", slack) ||
+        (deep && !set_size(ret, "keys", keys)) ||
+        !set_size(ret, "total", header + nodes + slack + keys)) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+PyObject*
+sortedset::get_iter_revision(sortedset::object *self) {
+    return PyLong_FromUnsignedLong(self->iter_revision);
+}
+
+PyObject*
+sortedset::get_keyfunc(sortedset::object *self) {
+    PyObject *ret = self->map.key_comp().keyfunc;
+    if (!ret) {
+        ret = Py_None;
+    }
+    Py_INCREF(ret);
+    return ret;
+}
+
+PyObject*
+sortedset::get_reverse(sortedset::object *self) {
+    return PyBool_FromLong(self->map.key_comp().reverse);
+}
+
+#if SORTEDMAP_HAVE_SHM
+namespace {
+    const char shm_magic[8] = {'S', 'M', 'S', 'H', 'A', 'R', 'E', '1'};
+
+    std::size_t
+    segment_length(std::size_t capacity) {
+        return sharedmap::data_offset + 2 * capacity * sizeof(sharedmap::slot);
+    }
+
+    sharedmap::slot*
+    keys_of(sharedmap::header *h) {
+        return reinterpret_cast<sharedmap::slot*>(
+            reinterpret_cast<char*>(h) + sharedmap::data_offset);
+    }
+
+    sharedmap::slot*
+    values_of(sharedmap::header *h) {
+        // the capacity is fixed when the segment is created
+        return keys_of(h) + h->capacity;
+    }
+
+    // The size as seen by a reader. A read which overlaps a write may see
+    // any value here so keep it in bounds until the read is validated.
+    std::size_t
+    read_size(sharedmap::header *h) {
+        return std::min<std::uint64_t>(h->size, h->capacity);
+    }
+
+    // Wait out a write in progress and return the sequence to validate the
+    // read against. A writer which died inside of a write leaves the
+    // sequence odd, so check for signals while waiting and give up after
+    // ``self->timeout`` seconds when it is set.
+    std::uint64_t
+    read_begin_throws(sharedmap::object *self) {
+        using clock = std::chrono::steady_clock;
+
+        sharedmap::header *h = self->segment;
+        std::uint64_t sequence;
+        std::size_t spins = 0;
+        clock::time_point start;
+
+        while ((sequence = h->sequence.load(std::memory_order_acquire)) & 1) {
+            if (!spins++) {
+                start = clock::now();
+            }
+            else if (!(spins % 1024)) {
+                if (PyErr_CheckSignals()) {
+                    throw PythonError();
+                }
+                std::chrono::duration<double> waited = clock::now() - start;
+                if (self->timeout >= 0 && waited.count() > self->timeout) {
+#if COMPILING_IN_PY2
+                    PyObject *exc = PyExc_OSError;
+#else
+                    PyObject *exc = PyExc_TimeoutError;
+#endif
+                    PyObject *msg = PyUnicode_FromFormat(
+                        "timed out waiting for a write to %R",
+                        self->name);
+                    if (msg) {
+                        PyErr_SetObject(exc, msg);
+                        Py_DECREF(msg);
+                    }
+                    throw PythonError();
+                }
+            }
+            sched_yield();
+        }
+        return sequence;
+    }
+
+    // Did the segment stay the same since ``read_begin_throws``?
+    bool
+    read_valid(sharedmap::header *h, std::uint64_t sequence) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return h->sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    // Run ``f`` until it reads the segment without overlapping a write. ``f``
+    // may only write to its own locals.
+    template<typename F>
+    void
+    read_consistent(sharedmap::object *self, F f) {
+        std::uint64_t sequence;
+        do {
+            sequence = read_begin_throws(self);
+            f();
+        } while (!read_valid(self->segment, sequence));
+    }
+
+    // Keep the sequence odd while this is alive so that readers retry. The
+    // sequence is already odd if the last writer died inside of a write;
+    // step over it so that the write which clears up after it wakes the
+    // readers when it is done.
+    class write_section {
+    private:
+        sharedmap::header *h;
+
+    public:
+        write_section(sharedmap::header *h) : h(h) {
+            std::uint64_t sequence =
+                h->sequence.load(std::memory_order_relaxed);
+            h->sequence.store(sequence + 1 + (sequence & 1),
+                              std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        ~write_section() {
+            h->sequence.store(h->sequence.load(std::memory_order_relaxed) + 1,
+                              std::memory_order_release);
+        }
+    };
+
+    bool
+    slot_less(char code, sharedmap::slot a, sharedmap::slot b) {
+        return (code == 'q') ? a.q < b.q : a.d < b.d;
+    }
+
+    // NaN is unordered with every key so it is never stored and never
+    // found.
+    bool
+    slot_isnan(char code, sharedmap::slot s) {
+        return code == 'd' && std::isnan(s.d);
+    }
+
+    std::size_t
+    slot_lower_bound(char code,
+                const sharedmap::slot *keys,
+                std::size_t size,
+                sharedmap::slot key) {
+        if (code == 'q') {
+            return std::lower_bound(
+                keys,
+                keys + size,
+                key,
+                [](sharedmap::slot a, sharedmap::slot b) {
+                    return a.q < b.q;
+                }) - keys;
+        }
+        return std::lower_bound(
+            keys,
+            keys + size,
+            key,
+            [](sharedmap::slot a, sharedmap::slot b) {
+                return a.d < b.d;
+            }) - keys;
+    }
+
+    std::size_t
+    slot_upper_bound(char code,
+                const sharedmap::slot *keys,
+                std::size_t size,
+                sharedmap::slot key) {
+        if (code == 'q') {
+            return std::upper_bound(
+                keys,
+                keys + size,
+                key,
+                [](sharedmap::slot a, sharedmap::slot b) {
+                    return a.q < b.q;
+                }) - keys;
+        }
+        return std::upper_bound(
+            keys,
+            keys + size,
+            key,
+            [](sharedmap::slot a, sharedmap::slot b) {
+                return a.d < b.d;
+            }) - keys;
+    }
+
+    // Convert ``ob`` to a slot of type ``code``. Ints are not truncated from
+    // floats so that ``m[1.5]`` cannot find the key 1.
+    sharedmap::slot
+    toslot_throws(char code, PyObject *ob) {
+        sharedmap::slot ret;
+
+        if (code == 'q') {
+            PyObject *index = PyNumber_Index(ob);
+            if (!index) {
+                throw PythonError();
+            }
+            ret.q = PyLong_AsLongLong(index);
+            Py_DECREF(index);
+            if (ret.q == -1 && PyErr_Occurred()) {
+                throw PythonError();
+            }
+        }
+        else {
+            ret.d = PyFloat_AsDouble(ob);
+            if (ret.d == -1.0 && PyErr_Occurred()) {
+                throw PythonError();
+            }
+        }
+        return ret;
+    }
+
+    PyObject*
+    fromslot(char code, sharedmap::slot s) {
+        return (code == 'q') ? PyLong_FromLongLong(s.q) :
+            PyFloat_FromDouble(s.d);
+    }
+
+    PyObject*
+    slot_pair(sharedmap::header *h,
+              sharedmap::slot key,
+              sharedmap::slot value) {
+        PyObject *k = fromslot(h->keytype, key);
+        PyObject *v;
+
+        if (!k) {
+            return NULL;
+        }
+        if (!(v = fromslot(h->valuetype, value))) {
+            Py_DECREF(k);
+            return NULL;
+        }
+
+        PyObject *ret = PyTuple_New(2);
+        if (!ret) {
+            Py_DECREF(k);
+            Py_DECREF(v);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(ret, 0, k);
+        PyTuple_SET_ITEM(ret, 1, v);
+        return ret;
+    }
+
+    bool
+    valid_code(char code) {
+        return code == 'q' || code == 'd';
+    }
+
+    const char*
+    segment_name(PyObject *name) {
+#if COMPILING_IN_PY2
+        return PyString_AsString(name);
+#else
+        return PyUnicode_AsUTF8(name);
+#endif  // COMPILING_IN_PY2
+    }
+
+    sharedmap::header*
+    open_throws(sharedmap::object *self) {
+        if (!self->segment) {
+            PyErr_SetString(PyExc_ValueError,
+                            "I/O operation on closed sharedmap");
+            throw PythonError();
+        }
+        return self->segment;
+    }
+
+    sharedmap::header*
+    writable_throws(sharedmap::object *self) {
+        sharedmap::header *h = open_throws(self);
+
+        if (!self->writable) {
+            PyErr_SetString(PyExc_TypeError,
+                            "sharedmap was opened read only");
+            throw PythonError();
+        }
+        return h;
+    }
+
+    sharedmap::object*
+    wrap(PyTypeObject *cls,
+         PyObject *name,
+         sharedmap::header *h,
+         std::size_t length,
+         bool writable) {
+        sharedmap::object *self = PyObject_New(sharedmap::object, cls);
+
+        if (!self) {
+            munmap(h, length);
+            return NULL;
+        }
+        self->segment = h;
+        self->length = length;
+        Py_INCREF(name);
+        self->name = name;
+        self->writable = writable;
+        self->timeout = -1;
+        return self;
+    }
+
+    // Look up ``key`` and copy its value out of the segment.
+    bool
+    find_slot_throws(sharedmap::object *self,
+                     PyObject *key,
+                     sharedmap::slot &value) {
+        sharedmap::header *h = self->segment;
+        sharedmap::slot k = toslot_throws(h->keytype, key);
+        bool found;
+
+        if (slot_isnan(h->keytype, k)) {
+            return false;
+        }
+        read_consistent(self, [&] {
+            const sharedmap::slot *keys = keys_of(h);
+            std::size_t size = read_size(h);
+            std::size_t pos = slot_lower_bound(h->keytype, keys, size, k);
+
+            found = pos < size && !slot_less(h->keytype, k, keys[pos]);
+            if (found) {
+                value = values_of(h)[pos];
+            }
+        });
+        return found;
+    }
+
+    // Set a pair inside of a ``write_section``.
+    void
+    set_throws(sharedmap::header *h,
+               sharedmap::slot key,
+               sharedmap::slot value) {
+        sharedmap::slot *keys = keys_of(h);
+        sharedmap::slot *values = values_of(h);
+        std::size_t size = h->size;
+        // bulk loads from sorted data append at the end
+        std::size_t pos = (size && slot_less(h->keytype, keys[size - 1], key)) ?
+            size :
+            slot_lower_bound(h->keytype, keys, size, key);
+
+        if (pos < size && !slot_less(h->keytype, key, keys[pos])) {
+            values[pos] = value;
+            return;
+        }
+        if (size == h->capacity) {
+            PyErr_Format(PyExc_ValueError,
+                         "sharedmap is full, its capacity is %llu",
+                         (unsigned long long) h->capacity);
+            throw PythonError();
+        }
+        std::memmove(keys + pos + 1, keys + pos, (size - pos) * sizeof(*keys));
+        std::memmove(values + pos + 1,
+                     values + pos,
+                     (size - pos) * sizeof(*values));
+        keys[pos] = key;
+        values[pos] = value;
+        h->size = size + 1;
+    }
+
+    std::pair<sharedmap::slot, sharedmap::slot>
+    topair_throws(sharedmap::header *h, PyObject *key, PyObject *value) {
+        sharedmap::slot k = toslot_throws(h->keytype, key);
+
+        if (slot_isnan(h->keytype, k)) {
+            PyErr_SetString(PyExc_ValueError, "sharedmap keys cannot be nan");
+            throw PythonError();
+        }
+        return {k, toslot_throws(h->valuetype, value)};
+    }
+
+    // The range of positions with keys in ``[lo, hi)``, either of which may
+    // be None. This is called inside of ``read``.
+    void
+    slot_range(sharedmap::header *h,
+               bool has_lo,
+               sharedmap::slot lo,
+               bool has_hi,
+               sharedmap::slot hi,
+               std::size_t &begin,
+               std::size_t &end) {
+        const sharedmap::slot *keys = keys_of(h);
+        std::size_t size = read_size(h);
+
+        begin = (has_lo) ? slot_lower_bound(h->keytype, keys, size, lo) : 0;
+        end = (has_hi) ? slot_lower_bound(h->keytype, keys, size, hi) : size;
+        end = std::max(begin, end);
+    }
+
+    enum class range_kind {
+        keys,
+        values,
+        items,
+    };
+
+    PyObject*
+    range_list(sharedmap::object *self,
+          PyObject *args,
+          PyObject *kwargs,
+          const char *format,
+          range_kind kind) {
+        const char *keywords[] = {"lo", "hi", NULL};
+        PyObject *pylo = Py_None;
+        PyObject *pyhi = Py_None;
+        std::vector<sharedmap::slot> keys;
+        std::vector<sharedmap::slot> values;
+        PyObject *ret;
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kwargs,
+                                         format,
+                                         (char**) keywords,
+                                         &pylo,
+                                         &pyhi)) {
+            return NULL;
+        }
+        try {
+            sharedmap::header *h = open_throws(self);
+            sharedmap::slot lo = {0};
+            sharedmap::slot hi = {0};
+
+            if (pylo != Py_None) {
+                lo = toslot_throws(h->keytype, pylo);
+            }
+            if (pyhi != Py_None) {
+                hi = toslot_throws(h->keytype, pyhi);
+            }
+            if (slot_isnan(h->keytype, lo) || slot_isnan(h->keytype, hi)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "sharedmap bounds cannot be nan");
+                throw PythonError();
+            }
+            read_consistent(self, [&] {
+                std::size_t begin;
+                std::size_t end;
+
+                slot_range(h,
+                           pylo != Py_None,
+                           lo,
+                           pyhi != Py_None,
+                           hi,
+                           begin,
+                           end);
+                if (kind != range_kind::values) {
+                    keys.assign(keys_of(h) + begin, keys_of(h) + end);
+                }
+                if (kind != range_kind::keys) {
+                    values.assign(values_of(h) + begin, values_of(h) + end);
+                }
+            });
+
+            std::size_t n = std::max(keys.size(), values.size());
+            if (!(ret = PyList_New(n))) {
+                return NULL;
+            }
+            for (std::size_t ix = 0; ix < n; ++ix) {
+                PyObject *item;
+
+                switch (kind) {
+                case range_kind::keys:
+                    item = fromslot(h->keytype, keys[ix]);
+                    break;
+                case range_kind::values:
+                    item = fromslot(h->valuetype, values[ix]);
+                    break;
+                default:
+                    item = slot_pair(h, keys[ix], values[ix]);
+                }
+                if (!item) {
+                    Py_DECREF(ret);
+                    return NULL;
+                }
+                PyList_SET_ITEM(ret, ix, item);
+            }
+            return ret;
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+
+    PyObject*
+    neighbor(sharedmap::object *self,
+             PyObject *args,
+             const char *format,
+             bool floor) {
+        PyObject *key;
+        PyObject *def = NULL;
+
+        if (!PyArg_ParseTuple(args, format, &key, &def)) {
+            return NULL;
+        }
+        try {
+            sharedmap::header *h = open_throws(self);
+            sharedmap::slot k = toslot_throws(h->keytype, key);
+            sharedmap::slot found_key;
+            sharedmap::slot found_value;
+            bool found = false;
+
+            read_consistent(self, [&] {
+                if (slot_isnan(h->keytype, k)) {
+                    return;
+                }
+                const sharedmap::slot *keys = keys_of(h);
+                std::size_t size = read_size(h);
+                std::size_t pos;
+
+                if (floor) {
+                    pos = slot_upper_bound(h->keytype, keys, size, k);
+                    found = pos > 0;
+                    --pos;
+                }
+                else {
+                    pos = slot_lower_bound(h->keytype, keys, size, k);
+                    found = pos < size;
+                }
+                if (found) {
+                    found_key = keys[pos];
+                    found_value = values_of(h)[pos];
+                }
+            });
+            if (!found) {
+                if (!def) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                    return NULL;
+                }
+                Py_INCREF(def);
+                return def;
+            }
+            return slot_pair(h, found_key, found_value);
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+}
+
+bool
+sharedmap::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &sharedmap::type);
+}
+
+sharedmap::object*
+sharedmap::newobject(PyTypeObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"name", "writable", "timeout", NULL};
+    PyObject *name;
+    PyObject *pywritable = NULL;
+    PyObject *pytimeout = Py_None;
+    int writable = false;
+    double timeout = -1;
+    const char *cname;
+    int fd;
+    struct stat st;
+    void *addr;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|OO:sharedmap",
+                                     (char**) keywords,
+                                     &name,
+                                     &pywritable,
+                                     &pytimeout)) {
+        return NULL;
+    }
+    if (pywritable && (writable = PyObject_IsTrue(pywritable)) < 0) {
+        return NULL;
+    }
+    if (pytimeout != Py_None) {
+        if ((timeout = PyFloat_AsDouble(pytimeout)) == -1 &&
+            PyErr_Occurred()) {
+            return NULL;
+        }
+        if (!(timeout >= 0)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "timeout must be a non-negative number");
+            return NULL;
+        }
+    }
+    if (!(cname = segment_name(name))) {
+        return NULL;
+    }
+
+    if ((fd = shm_open(cname, (writable) ? O_RDWR : O_RDONLY, 0)) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        return NULL;
+    }
+    if (fstat(fd, &st)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        ::close(fd);
+        return NULL;
+    }
+    if ((std::size_t) st.st_size < sharedmap::data_offset) {
+        ::close(fd);
+        PyErr_Format(PyExc_ValueError, "%R is not a sharedmap", name);
+        return NULL;
+    }
+    addr = mmap(NULL,
+                st.st_size,
+                (writable) ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED,
+                fd,
+                0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        return NULL;
+    }
+
+    sharedmap::header *h = static_cast<sharedmap::header*>(addr);
+    if (memcmp(h->magic, shm_magic, sizeof(shm_magic)) ||
+        !valid_code(h->keytype) ||
+        !valid_code(h->valuetype) ||
+        h->capacity > (st.st_size - sharedmap::data_offset) /
+                      (2 * sizeof(sharedmap::slot))) {
+        munmap(addr, st.st_size);
+        PyErr_Format(PyExc_ValueError, "%R is not a sharedmap", name);
+        return NULL;
+    }
+
+    sharedmap::object *self = wrap(cls, name, h, st.st_size, writable);
+    if (self) {
+        self->timeout = timeout;
+    }
+    return self;
+}
+
+PyObject*
+sharedmap::create(PyTypeObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"name",
+                              "capacity",
+                              "keytype",
+                              "valuetype",
+                              "data",
+                              NULL};
+    PyObject *name;
+    Py_ssize_t capacity;
+    const char *keytype = "q";
+    const char *valuetype = "d";
+    PyObject *data = NULL;
+    const char *cname;
+    std::size_t length;
+    int fd;
+    void *addr;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "On|ssO:create",
+                                     (char**) keywords,
+                                     &name,
+                                     &capacity,
+                                     &keytype,
+                                     &valuetype,
+                                     &data)) {
+        return NULL;
+    }
+    if (capacity <= 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "capacity must be positive, got %zd",
+                     capacity);
+        return NULL;
+    }
+    if ((std::size_t) capacity > (PY_SSIZE_T_MAX - sharedmap::data_offset) /
+                                 (2 * sizeof(sharedmap::slot))) {
+        PyErr_SetString(PyExc_OverflowError, "capacity is too large");
+        return NULL;
+    }
+    if (strlen(keytype) != 1 || !valid_code(*keytype) ||
+        strlen(valuetype) != 1 || !valid_code(*valuetype)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "keytype and valuetype must be 'q' or 'd'");
+        return NULL;
+    }
+    if (!(cname = segment_name(name))) {
+        return NULL;
+    }
+
+    if ((fd = shm_open(cname, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        return NULL;
+    }
+    length = segment_length(capacity);
+    if (ftruncate(fd, length)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        ::close(fd);
+        shm_unlink(cname);
+        return NULL;
+    }
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        shm_unlink(cname);
+        return NULL;
+    }
+
+    // the segment starts zeroed, fill in the header before the magic
+    // marks it as ready to open
+    sharedmap::header *h = static_cast<sharedmap::header*>(addr);
+    h->sequence.store(0, std::memory_order_relaxed);
+    h->capacity = capacity;
+    h->size = 0;
+    h->keytype = *keytype;
+    h->valuetype = *valuetype;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h->magic, shm_magic, sizeof(shm_magic));
+
+    sharedmap::object *self = wrap(cls, name, h, length, true);
+    if (!self) {
+        shm_unlink(cname);
+        return NULL;
+    }
+    if (data) {
+        PyObject *result = sharedmap::update(self, data);
+        if (!result) {
+            Py_DECREF(self);
+            shm_unlink(cname);
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    return (PyObject*) self;
+}
+
+PyObject*
+sharedmap::unlink(PyObject *cls, PyObject *name) {
+    const char *cname = segment_name(name);
+
+    if (!cname) {
+        return NULL;
+    }
+    if (shm_unlink(cname)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+void
+sharedmap::dealloc(sharedmap::object *self) {
+    if (self->segment) {
+        munmap(self->segment, self->length);
+    }
+    Py_DECREF(self->name);
+    PyObject_Del(self);
+}
+
+PyObject*
+sharedmap::close(sharedmap::object *self) {
+    if (self->segment) {
+        munmap(self->segment, self->length);
+        self->segment = NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sharedmap::enter(sharedmap::object *self) {
+    Py_INCREF(self);
+    return (PyObject*) self;
+}
+
+PyObject*
+sharedmap::exit(sharedmap::object *self, PyObject *args) {
+    return sharedmap::close(self);
+}
+
+Py_ssize_t
+sharedmap::len(sharedmap::object *self) {
+    try {
+        sharedmap::header *h = open_throws(self);
+        std::size_t size;
+
+        read_consistent(self, [&] { size = read_size(h); });
+        return size;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+PyObject*
+sharedmap::getitem(sharedmap::object *self, PyObject *key) {
+    try {
+        sharedmap::header *h = open_throws(self);
+        sharedmap::slot value;
 
-        // update with this (key, value) pair
-        key = PySequence_Fast_GET_ITEM(fast, 0);
-        value = PySequence_Fast_GET_ITEM(fast, 1);
-        try{
-            setitem_throws(self, key, value);
-        }
-        catch (PythonError &e) {
-            goto fail;
+        if (!find_slot_throws(self, key, value)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
         }
-        Py_DECREF(fast);
-        Py_DECREF(item);
+        return fromslot(h->valuetype, value);
+    }
+    catch (PythonError &e) {
+        return NULL;
     }
-
-    n = 0;
-    goto return_;
-fail:
-    Py_XDECREF(item);
-    Py_XDECREF(fast);
-    n = -1;
-return_:
-    Py_DECREF(it);
-    return !Py_SAFE_DOWNCAST(n, Py_ssize_t, int);
 }
 
-bool
-sortedmap::update(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    PyObject *arg = NULL;
+PyObject*
+sharedmap::get(sharedmap::object *self, PyObject *args) {
+    PyObject *key;
+    PyObject *def = Py_None;
 
-    if (unlikely(!PyArg_UnpackTuple(args, "update", 0, 1, &arg))) {
-        return false;
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &def)) {
+        return NULL;
     }
+    try {
+        sharedmap::header *h = open_throws(self);
+        sharedmap::slot value;
 
-    if (arg) {
-#if !COMPILING_IN_PY2
-        _Py_IDENTIFIER(keys);
+        if (!find_slot_throws(self, key, value)) {
+            Py_INCREF(def);
+            return def;
+        }
+        return fromslot(h->valuetype, value);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
 
-        if (_PyObject_HasAttrId(arg, &PyId_keys))
-#else
-        if (PyObject_HasAttrString(arg, "keys"))
-#endif  // !COMPILING_IN_PY2
-        {
+int
+sharedmap::contains(sharedmap::object *self, PyObject *key) {
+    try {
+        sharedmap::slot value;
 
-            if (unlikely(!merge(self, arg))) {
-                return false;
-            }
-        }
-        else {
-            if (unlikely(!merge_from_seq2(self, arg))) {
-                return false;
-            }
-        }
+        open_throws(self);
+        return find_slot_throws(self, key, value);
     }
-    if (kwargs && PyDict_Size(kwargs)) {
-        if (unlikely(!merge(self, kwargs))) {
-            return false;
-        }
+    catch (PythonError &e) {
+        return -1;
     }
-    return true;
 }
 
-PyObject*
-sortedmap::pyupdate(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    if (unlikely(!sortedmap::update(self, args, kwargs))) {
-        return NULL;
+int
+sharedmap::setitem(sharedmap::object *self, PyObject *key, PyObject *value) {
+    try {
+        sharedmap::header *h = writable_throws(self);
+
+        if (value) {
+            auto pair = topair_throws(h, key, value);
+            write_section section(h);
+            set_throws(h, std::get<0>(pair), std::get<1>(pair));
+            return 0;
+        }
+
+        sharedmap::slot k = toslot_throws(h->keytype, key);
+        sharedmap::slot *keys = keys_of(h);
+        sharedmap::slot *values = values_of(h);
+        std::size_t size = h->size;
+        std::size_t pos = slot_lower_bound(h->keytype, keys, size, k);
+
+        if (slot_isnan(h->keytype, k) ||
+            pos == size ||
+            slot_less(h->keytype, k, keys[pos])) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        write_section section(h);
+        std::memmove(keys + pos,
+                     keys + pos + 1,
+                     (size - pos - 1) * sizeof(*keys));
+        std::memmove(values + pos,
+                     values + pos + 1,
+                     (size - pos - 1) * sizeof(*values));
+        h->size = size - 1;
+        return 0;
+    }
+    catch (PythonError &e) {
+        return -1;
     }
-    Py_RETURN_NONE;
 }
 
-sortedmap::object*
-sortedmap::fromkeys(PyTypeObject *cls, PyObject *seq, PyObject *value) {
-    sortedmap::object *self;
+PyObject*
+sharedmap::update(sharedmap::object *self, PyObject *other) {
+    std::vector<std::pair<sharedmap::slot, sharedmap::slot>> pairs;
+    PyObject *items;
     PyObject *it;
-    PyObject *key;
+    PyObject *item;
 
-    if (unlikely(!(it = PyObject_GetIter(seq)))) {
+    // convert every pair before the write so readers are not held up by
+    // calls back into Python
+    if (PyDict_Check(other)) {
+        items = PyDict_Items(other);
+    }
+    else if (PyObject_HasAttrString(other, "items")) {
+        items = PyObject_CallMethod(other, (char*) "items", NULL);
+    }
+    else {
+        Py_INCREF(other);
+        items = other;
+    }
+    if (!items) {
+        return NULL;
+    }
+    it = PyObject_GetIter(items);
+    Py_DECREF(items);
+    if (!it) {
         return NULL;
     }
 
-    if (unlikely(!(self = innernew(cls, NULL)))) {
+    try {
+        sharedmap::header *h = writable_throws(self);
+
+        while ((item = PyIter_Next(it))) {
+            PyObject *key;
+            PyObject *value;
+
+            if (!PyArg_UnpackTuple(item, "update", 2, 2, &key, &value)) {
+                Py_DECREF(item);
+                throw PythonError();
+            }
+            try {
+                pairs.push_back(topair_throws(h, key, value));
+            }
+            catch (PythonError &e) {
+                Py_DECREF(item);
+                throw;
+            }
+            Py_DECREF(item);
+        }
         Py_DECREF(it);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+
+        write_section section(h);
+        for (const auto &pair : pairs) {
+            set_throws(h, std::get<0>(pair), std::get<1>(pair));
+        }
+    }
+    catch (PythonError &e) {
+        Py_XDECREF(it);
         return NULL;
     }
+    Py_RETURN_NONE;
+}
 
-    while ((key = PyIter_Next(it))) {
-        self->map.emplace(key, value);
-        Py_DECREF(key);
+PyObject*
+sharedmap::pyclear(sharedmap::object *self) {
+    try {
+        sharedmap::header *h = writable_throws(self);
+        write_section section(h);
+        h->size = 0;
     }
-    Py_DECREF(it);
-    if (unlikely(PyErr_Occurred())) {
+    catch (PythonError &e) {
         return NULL;
     }
-
-    return self;
+    Py_RETURN_NONE;
 }
 
-sortedmap::object*
-sortedmap::pyfromkeys(PyObject *cls, PyObject *args, PyObject *kwargs) {
-    const char *keywords[] = {"seq", "value", NULL};
-    PyObject *seq;
-    PyObject *value = NULL;
+PyObject*
+sharedmap::floor_item(sharedmap::object *self, PyObject *args) {
+    return neighbor(self, args, "O|O:floor_item", true);
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|O:fromkeys",
-                                     (char**) keywords,
-                                     &seq,
-                                     &value)) {
-        return NULL;
-    }
+PyObject*
+sharedmap::ceiling_item(sharedmap::object *self, PyObject *args) {
+    return neighbor(self, args, "O|O:ceiling_item", false);
+}
 
-    if (!value) {
-        value = Py_None;
-    }
+PyObject*
+sharedmap::keys(sharedmap::object *self, PyObject *args, PyObject *kwargs) {
+    return range_list(self, args, kwargs, "|OO:keys", range_kind::keys);
+}
 
-    return sortedmap::fromkeys((PyTypeObject*) cls, seq, value);
+PyObject*
+sharedmap::values(sharedmap::object *self, PyObject *args, PyObject *kwargs) {
+    return range_list(self, args, kwargs, "|OO:values", range_kind::values);
 }
 
 PyObject*
-sortedmap::get_iter_revision(object *self) {
-    return PyLong_FromUnsignedLong(self->iter_revision);
+sharedmap::items(sharedmap::object *self, PyObject *args, PyObject *kwargs) {
+    return range_list(self, args, kwargs, "|OO:items", range_kind::items);
 }
 
 PyObject*
-sortedmap::get_keyfunc(object *self) {
-    PyObject *ret =self->map.key_comp().keyfunc;
-    if (!ret) {
-        ret = Py_None;
+sharedmap::iter(sharedmap::object *self) {
+    sharedmap::keyiter::object *ret;
+    std::uint64_t sequence;
+
+    try {
+        open_throws(self);
+        sequence = read_begin_throws(self);
     }
-    Py_INCREF(ret);
-    return ret;
+    catch (PythonError &e) {
+        return NULL;
+    }
+    if (!(ret = PyObject_New(sharedmap::keyiter::object,
+                             &sharedmap::keyiter::type))) {
+        return NULL;
+    }
+    new(&ret->map) OwnedRef<sharedmap::object>(self);
+    ret->pos = 0;
+    ret->sequence = sequence;
+    return (PyObject*) ret;
 }
 
 void
-sortedmap::meta::partial::dealloc(sortedmap::meta::partial::object *self) {
-    using ownedtype = OwnedRef<PyObject>;
-    using ownedcls = OwnedRef<PyTypeObject>;
+sharedmap::keyiter::dealloc(sharedmap::keyiter::object *self) {
+    using ownedtype = OwnedRef<sharedmap::object>;
 
-    self->cls.~ownedcls();
-    self->keyfunc.~ownedtype();
-    PyObject_GC_Del(self);
+    self->map.~ownedtype();
+    PyObject_Del(self);
 }
 
-sortedmap::object*
-sortedmap::meta::partial::call(sortedmap::meta::partial::object *self,
-                               PyObject *args,
-                               PyObject *kwargs) {
-    sortedmap::object *m;
+PyObject*
+sharedmap::keyiter::next(sharedmap::keyiter::object *self) {
+    try {
+        sharedmap::header *h = open_throws(self->map.ob);
+        std::uint64_t sequence = read_begin_throws(self->map.ob);
+        sharedmap::slot key;
+        bool done = self->pos >= read_size(h);
 
-    if (!(m = innernew(self->cls, self->keyfunc.ob))) {
-        return NULL;
+        if (!done) {
+            key = keys_of(h)[self->pos];
+        }
+        if (sequence != self->sequence || !read_valid(h, sequence)) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "sharedmap changed during iteration");
+            return NULL;
+        }
+        if (done) {
+            return NULL;
+        }
+        ++self->pos;
+        return fromslot(h->keytype, key);
     }
-    if (sortedmap::init(m, args, kwargs)) {
-        Py_DECREF(m);
+    catch (PythonError &e) {
         return NULL;
     }
-    return m;
 }
 
 PyObject*
-sortedmap::meta::partial::repr(sortedmap::meta::partial::object *self) {
-    return PyUnicode_FromFormat("%s[%R]",
-                                self->cls.ob->tp_name,
-                                self->keyfunc.ob);
-}
+sharedmap::repr(sharedmap::object *self) {
+    Py_ssize_t size;
 
-int
-sortedmap::meta::partial::traverse(sortedmap::meta::partial::object *self,
-                                   visitproc visit,
-                                   void *arg) {
-    Py_VISIT((PyObject*) self->cls.ob);
-    Py_VISIT(self->keyfunc);
-    return 0;
+    if (!self->segment) {
+        return PyUnicode_FromFormat("<closed %s %R>",
+                                    Py_TYPE(self)->tp_name,
+                                    self->name);
+    }
+    if ((size = sharedmap::len(self)) < 0) {
+        return NULL;
+    }
+    return PyUnicode_FromFormat("<%s %R keytype='%c' valuetype='%c'"
+                                " size=%zd capacity=%zd>",
+                                Py_TYPE(self)->tp_name,
+                                self->name,
+                                self->segment->keytype,
+                                self->segment->valuetype,
+                                size,
+                                (Py_ssize_t) self->segment->capacity);
 }
 
-void
-sortedmap::meta::partial::clear(sortedmap::meta::partial::object *self) {
-    using ownedtype = OwnedRef<PyObject>;
-    using ownedcls = OwnedRef<PyTypeObject>;
+PyObject*
+sharedmap::get_name(sharedmap::object *self) {
+    Py_INCREF(self->name);
+    return self->name;
+}
 
-    self->cls.~ownedcls();
-    self->keyfunc.~ownedtype();
+PyObject*
+sharedmap::get_capacity(sharedmap::object *self) {
+    try {
+        return PyLong_FromUnsignedLongLong(open_throws(self)->capacity);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
 }
 
-sortedmap::meta::partial::object*
-sortedmap::meta::getitem(PyObject *cls, PyObject *keyfunc) {
-    sortedmap::meta::partial::object *partial;
+PyObject*
+sharedmap::get_keytype(sharedmap::object *self) {
+    try {
+        return PyUnicode_FromStringAndSize(&open_throws(self)->keytype, 1);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
 
-    if (!PyType_Check(cls)) {
-        PyErr_Format(PyExc_TypeError, "%R is not a type object", cls);
+PyObject*
+sharedmap::get_valuetype(sharedmap::object *self) {
+    try {
+        return PyUnicode_FromStringAndSize(&open_throws(self)->valuetype, 1);
+    }
+    catch (PythonError &e) {
         return NULL;
     }
+}
 
-    if (!(partial = PyObject_GC_New(sortedmap::meta::partial::object,
-                                    &sortedmap::meta::partial::type))) {
+PyObject*
+sharedmap::get_writable(sharedmap::object *self) {
+    return PyBool_FromLong(self->writable);
+}
+
+PyObject*
+sharedmap::get_version(sharedmap::object *self) {
+    try {
+        open_throws(self);
+        return PyLong_FromUnsignedLongLong(read_begin_throws(self) / 2);
+    }
+    catch (PythonError &e) {
         return NULL;
     }
-    new(partial) sortedmap::meta::partial::object;
-    partial->cls = std::move((PyTypeObject*) cls);
-    partial->keyfunc = std::move(keyfunc);
-    return partial;
 }
+#endif  // SORTEDMAP_HAVE_SHM
 
 #define MODULE_NAME "sortedmap._sortedmap"
 PyDoc_STRVAR(module_doc,
@@ -920,12 +6488,37 @@ init_sortedmap(void)
                                      &sortedmap::keyiter::type,
                                      &sortedmap::valiter::type,
                                      &sortedmap::itemiter::type,
+                                     &sortedmap::chunkiter::type,
+                                     &sortedmap::finger::type,
                                      &sortedmap::keyview::type,
                                      &sortedmap::valview::type,
-                                     &sortedmap::itemiter::type,
-                                     &sortedmap::type};
+                                     &sortedmap::itemview::type,
+                                     &sortedmap::type,
+                                     &sortedmultimap::keyiter::type,
+                                     &sortedmultimap::valiter::type,
+                                     &sortedmultimap::itemiter::type,
+                                     &sortedmultimap::keyview::type,
+                                     &sortedmultimap::valview::type,
+                                     &sortedmultimap::itemview::type,
+                                     &sortedmultimap::type,
+                                     &sortedset::iter::type,
+                                     &sortedset::type,
+#if SORTEDMAP_HAVE_SHM
+                                     &sharedmap::keyiter::type,
+                                     &sharedmap::type,
+#endif  // SORTEDMAP_HAVE_SHM
+                                     };
     PyObject *m;
 
+    if (!sortedmap::Comparator::import_extractors()) {
+        return ERROR_RETURN;
+    }
+
+#if HAVE_VECTORCALL
+    // let ``sortedmap(...)`` skip building the args tuple and kwargs dict
+    sortedmap::type.tp_vectorcall = sortedmap::vectorcall;
+#endif  // HAVE_VECTORCALL
+
     for (const auto &t : ts) {
         if (PyType_Ready(t)) {
             return ERROR_RETURN;
@@ -941,10 +6534,30 @@ init_sortedmap(void)
         return ERROR_RETURN;
     }
 
+    Py_INCREF(&sortedmap::type);
     if (PyModule_AddObject(m, "sortedmap", (PyObject*) &sortedmap::type)) {
         Py_DECREF(m);
         return ERROR_RETURN;
     }
+    Py_INCREF(&sortedmultimap::type);
+    if (PyModule_AddObject(m,
+                           "sortedmultimap",
+                           (PyObject*) &sortedmultimap::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+    Py_INCREF(&sortedset::type);
+    if (PyModule_AddObject(m, "sortedset", (PyObject*) &sortedset::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+#if SORTEDMAP_HAVE_SHM
+    Py_INCREF(&sharedmap::type);
+    if (PyModule_AddObject(m, "sharedmap", (PyObject*) &sharedmap::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+#endif  // SORTEDMAP_HAVE_SHM
 
 #if !COMPILING_IN_PY2
     return m;
@@ -0,0 +1,705 @@
+"""A sorted mapping which may grow larger than memory.
+
+``diskmap`` is a log structured merge tree. Writes go to an in memory
+``sortedmap`` (the memtable). When the memtable holds ``memtable_size``
+entries it is frozen and written to an immutable sorted run on disk. Each run
+holds the records in order, a sparse index of the first key in each block and
+a bloom filter over its keys. Reads merge the memtable with the runs, newest
+first, through ``mmap``. When there are more than ``max_runs`` runs they are
+merged into one, on a background thread by default.
+
+Keys and values are stored with ``pickle``. The run files are only meant to
+be read by the same Python which wrote them.
+"""
+import bisect
+import heapq
+import io
+import itertools
+import mmap
+import numbers
+import os
+import pickle
+import struct
+import threading
+import zlib
+try:
+    from collections.abc import MutableMapping
+except ImportError:  # Python 2
+    from collections import MutableMapping
+
+from ._sortedmap import sortedmap
+
+
+_MAGIC = b'SMRUN002'
+_FOOTER = struct.Struct('<QQQ8s')  # index offset, bloom offset, count, magic
+_LENGTH = struct.Struct('<I')
+_BLOOM_HEADER = struct.Struct('<QI')  # number of bits, number of hashes
+_PROTOCOL = pickle.HIGHEST_PROTOCOL
+_MANIFEST = 'MANIFEST'
+
+# stored as the memtable value of a deleted key
+_deleted = object()
+_missing = object()
+
+
+def _identity(ob):
+    return ob
+
+
+class _Reversed(object):
+    """Invert the ordering of a sort key for maps with ``reverse=True``.
+    """
+    __slots__ = 'ob',
+
+    def __init__(self, ob):
+        self.ob = ob
+
+    def __lt__(self, other):
+        return other.ob < self.ob
+
+    def __eq__(self, other):
+        return self.ob == other.ob
+
+    def __ne__(self, other):
+        return not self == other
+
+
+def _normalize(key):
+    # Keys which compare equal must hash the same in the bloom filter. The
+    # numeric tower is the common case where equal keys pickle differently.
+    if isinstance(key, numbers.Integral):
+        return int(key)
+    if isinstance(key, float) and key.is_integer():
+        return int(key)
+    if isinstance(key, tuple):
+        return tuple(_normalize(k) for k in key)
+    return key
+
+
+class _Bloom(object):
+    """A bloom filter using double hashing over the pickled key.
+    """
+    def __init__(self, nbits, nhashes, bits=None):
+        self.nbits = nbits
+        self.nhashes = nhashes
+        if bits is None:
+            bits = bytearray((nbits + 7) // 8)
+        self.bits = bits
+
+    @classmethod
+    def for_count(cls, count, bits_per_key):
+        nbits = max(64, count * bits_per_key)
+        # k = ln(2) * m / n minimizes the false positive rate
+        return cls(nbits, max(1, min(30, int(bits_per_key * 0.69))))
+
+    @classmethod
+    def frombuffer(cls, buf, offset):
+        nbits, nhashes = _BLOOM_HEADER.unpack_from(buf, offset)
+        start = offset + _BLOOM_HEADER.size
+        return cls(
+            nbits,
+            nhashes,
+            bytearray(buf[start:start + (nbits + 7) // 8]),
+        )
+
+    def tobytes(self):
+        return _BLOOM_HEADER.pack(self.nbits, self.nhashes) + bytes(self.bits)
+
+    def _positions(self, key):
+        # The memo is disabled because it makes equal keys pickle
+        # differently when one repeats an object and the other an equal copy.
+        buf = io.BytesIO()
+        pickler = pickle.Pickler(buf, 2)
+        pickler.fast = True
+        pickler.dump(_normalize(key))
+        data = buf.getvalue()
+        h1 = zlib.crc32(data) & 0xffffffff
+        h2 = zlib.adler32(data) & 0xffffffff | 1
+        for n in range(self.nhashes):
+            yield (h1 + n * h2) % self.nbits
+
+    def add(self, key):
+        bits = self.bits
+        for n in self._positions(key):
+            bits[n >> 3] |= 1 << (n & 7)
+
+    def __contains__(self, key):
+        bits = self.bits
+        return all(bits[n >> 3] & (1 << (n & 7)) for n in self._positions(key))
+
+
+def _write_run(path, records, sortkey, expected, block_size, bits_per_key):
+    """Write sorted ``(key, value, deleted)`` records to a new run file.
+
+    Returns
+    -------
+    written : bool
+        False if there were no records, in which case no file is created.
+    """
+    bloom = _Bloom.for_count(expected, bits_per_key)
+    index = []
+    count = 0
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(_MAGIC)
+        offset = len(_MAGIC)
+        for record in records:
+            if count % block_size == 0:
+                index.append((record[0], offset))
+            data = pickle.dumps(record, _PROTOCOL)
+            f.write(_LENGTH.pack(len(data)))
+            f.write(data)
+            offset += _LENGTH.size + len(data)
+            bloom.add(sortkey(record[0]))
+            count += 1
+        index_offset = offset
+        data = pickle.dumps(index, _PROTOCOL)
+        f.write(data)
+        bloom_offset = index_offset + len(data)
+        f.write(bloom.tobytes())
+        f.write(_FOOTER.pack(index_offset, bloom_offset, count, _MAGIC))
+        f.flush()
+        os.fsync(f.fileno())
+
+    if not count:
+        os.remove(tmp)
+        return False
+    os.rename(tmp, path)
+    return True
+
+
+def _merge_runs(sources, order):
+    """Merge sorted streams of records, ordered from newest to oldest.
+
+    Yields
+    ------
+    okey : any
+        The ordering key of the record.
+    record : tuple[key, value, deleted]
+        The newest record for each key.
+    """
+    heap = [
+        (order(record[0]), priority, record, source)
+        for priority, source in enumerate(sources)
+        for record in itertools.islice(source, 1)
+    ]
+    heapq.heapify(heap)
+    while heap:
+        okey, _, record, _ = heap[0]
+        # advance every source positioned on this key, the first one popped
+        # is the newest
+        while heap and not okey < heap[0][0]:
+            _, priority, _, source = heap[0]
+            for next_record in source:
+                heapq.heapreplace(
+                    heap,
+                    (order(next_record[0]), priority, next_record, source),
+                )
+                break
+            else:
+                heapq.heappop(heap)
+        yield okey, record
+
+
+class _Run(object):
+    """An immutable sorted run read through ``mmap``.
+    """
+    def __init__(self, path, sortkey, order):
+        self.path = path
+        self.name = os.path.basename(path)
+        self._sortkey = sortkey
+        self._order = order
+        with open(path, 'rb') as f:
+            self._buf = buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        index_offset, bloom_offset, self.count, magic = _FOOTER.unpack_from(
+            buf,
+            len(buf) - _FOOTER.size,
+        )
+        if buf[:len(_MAGIC)] != _MAGIC or magic != _MAGIC:
+            buf.close()
+            raise ValueError('%r is not a sortedmap run' % path)
+        self._data_end = index_offset
+        index = pickle.loads(buf[index_offset:bloom_offset])
+        self._index_keys = [order(key) for key, _ in index]
+        self._index_offsets = [offset for _, offset in index]
+        self._bloom = _Bloom.frombuffer(buf, bloom_offset)
+
+    def close(self):
+        self._buf.close()
+
+    def _records(self, offset, end):
+        buf = self._buf
+        size = _LENGTH.size
+        while offset < end:
+            length, = _LENGTH.unpack_from(buf, offset)
+            offset += size
+            yield pickle.loads(buf[offset:offset + length])
+            offset += length
+
+    def _block(self, okey):
+        return max(0, bisect.bisect_right(self._index_keys, okey) - 1)
+
+    def find(self, key):
+        """Look up the record for ``key``.
+
+        Returns
+        -------
+        record : tuple[key, value, deleted] or None
+            The record stored for ``key`` or None if it is not in the run.
+        """
+        if self._sortkey(key) not in self._bloom:
+            return None
+        order = self._order
+        okey = order(key)
+        block = bisect.bisect_right(self._index_keys, okey) - 1
+        if block < 0:
+            return None
+        offsets = self._index_offsets
+        end = (
+            offsets[block + 1] if block + 1 < len(offsets) else self._data_end
+        )
+        for record in self._records(offsets[block], end):
+            orecord = order(record[0])
+            if okey < orecord:
+                return None
+            if not orecord < okey:
+                return record
+        return None
+
+    def scan(self, lo=None):
+        """Iterate over the records with keys greater than or equal to ``lo``.
+        """
+        if lo is None:
+            for record in self._records(len(_MAGIC), self._data_end):
+                yield record
+            return
+
+        order = self._order
+        olo = order(lo)
+        records = self._records(
+            self._index_offsets[self._block(olo)],
+            self._data_end,
+        )
+        for record in records:
+            if not order(record[0]) < olo:
+                yield record
+                break
+        for record in records:
+            yield record
+
+
+class diskmap(MutableMapping):
+    """A sorted mapping backed by a directory of sorted runs.
+
+    Parameters
+    ----------
+    path : str
+        The directory holding the runs. This is created if it does not exist
+        and reopened if it does.
+    memtable_size : int, optional
+        The number of entries, including deletions, buffered in memory before
+        they are written out as a run.
+    max_runs : int, optional
+        The number of runs allowed before they are compacted into one.
+    background : bool, optional
+        Compact on a background thread instead of the writing thread.
+    block_size : int, optional
+        The number of records between entries of a run's sparse index. A point
+        lookup which passes the bloom filter reads at most this many records.
+    bits_per_key : int, optional
+        The size of each run's bloom filter. 10 bits per key gives about a 1%
+        false positive rate.
+    cls : callable, optional
+        The ``sortedmap`` class used for the memtable, for example
+        ``sortedmap[keyfunc]`` or ``sortedmap.configure(reverse=True)``. This
+        must be the same each time a directory is opened.
+
+    Notes
+    -----
+    Entries in the memtable are not durable until ``flush`` or ``close`` is
+    called.
+    """
+    def __init__(self,
+                 path,
+                 memtable_size=65536,
+                 max_runs=8,
+                 background=True,
+                 block_size=64,
+                 bits_per_key=10,
+                 cls=sortedmap):
+        if memtable_size < 1:
+            raise ValueError('memtable_size must be positive')
+        if max_runs < 1:
+            raise ValueError('max_runs must be positive')
+        if block_size < 1:
+            raise ValueError('block_size must be positive')
+
+        self.path = path
+        self.memtable_size = memtable_size
+        self.max_runs = max_runs
+        self.background = background
+        self.block_size = block_size
+        self.bits_per_key = bits_per_key
+        self._cls = cls
+
+        self._memtable = memtable = cls()
+        self._frozen = None
+        self._sortkey = sortkey = memtable.keyfunc or _identity
+        if memtable.reverse:
+            self._order = lambda key: _Reversed(sortkey(key))
+        else:
+            self._order = sortkey
+
+        self._lock = threading.RLock()
+        self._flush_lock = threading.Lock()
+        self._compact_lock = threading.Lock()
+        self._compactor = None
+        self._error = None
+        self._closed = False
+
+        if not os.path.isdir(path):
+            os.makedirs(path)
+        self._runs = self._load()
+
+    def _load(self):
+        try:
+            with open(os.path.join(self.path, _MANIFEST)) as f:
+                names = f.read().split()
+        except IOError:
+            names = []
+
+        live = set(names)
+        self._next_seq = 0
+        for name in os.listdir(self.path):
+            if not name.startswith('run-'):
+                continue
+            self._next_seq = max(
+                self._next_seq,
+                int(name[4:].split('.')[0]) + 1,
+            )
+            if name not in live:
+                # left over from an interrupted flush or compaction
+                os.remove(os.path.join(self.path, name))
+
+        return [
+            _Run(os.path.join(self.path, name), self._sortkey, self._order)
+            for name in names
+        ]
+
+    def _write_manifest(self, runs):
+        path = os.path.join(self.path, _MANIFEST)
+        tmp = path + '.tmp'
+        with open(tmp, 'w') as f:
+            f.write(''.join(run.name + '\n' for run in runs))
+            f.flush()
+            os.fsync(f.fileno())
+        os.rename(tmp, path)
+
+    def _new_run_path(self):
+        with self._lock:
+            seq = self._next_seq
+            self._next_seq += 1
+        return os.path.join(self.path, 'run-%010d.sst' % seq)
+
+    def _check_open(self):
+        if self._closed:
+            raise ValueError('I/O operation on closed diskmap')
+
+    # reads
+
+    def _snapshot(self):
+        with self._lock:
+            self._check_open()
+            return self._memtable, self._frozen, list(self._runs)
+
+    def _lookup(self, key):
+        memtable, frozen, runs = self._snapshot()
+        for table in (memtable, frozen):
+            if table is not None:
+                value = table.get(key, _missing)
+                if value is not _missing:
+                    return _missing if value is _deleted else value
+        for run in reversed(runs):
+            record = run.find(key)
+            if record is not None:
+                return _missing if record[2] else record[1]
+        return _missing
+
+    def _table_scan(self, table, lo):
+        # Each step is a lookup in the live table, so the scan starts at
+        # ``lo`` without walking the keys before it and writes made while it
+        # runs cannot invalidate its position.
+        if lo is None:
+            try:
+                pair = table.first_item()
+            except KeyError:
+                return
+        else:
+            pair = table.ceiling_item(lo, None)
+        while pair is not None:
+            key, value = pair
+            yield key, value, value is _deleted
+            pair = table.higher_item(key, None)
+
+    def _merge(self, lo, hi):
+        """Merge every source into one ordered stream of records. Where a
+        key is in more than one source the newest record wins.
+        """
+        memtable, frozen, runs = self._snapshot()
+        sources = [self._table_scan(memtable, lo)]
+        if frozen is not None:
+            sources.append(self._table_scan(frozen, lo))
+        sources.extend(run.scan(lo) for run in reversed(runs))
+
+        ohi = None if hi is None else self._order(hi)
+        for okey, record in _merge_runs(sources, self._order):
+            if ohi is not None and not okey < ohi:
+                return
+            if not record[2]:
+                yield record
+
+    def __getitem__(self, key):
+        value = self._lookup(key)
+        if value is _missing:
+            raise KeyError(key)
+        return value
+
+    def get(self, key, default=None):
+        value = self._lookup(key)
+        return default if value is _missing else value
+
+    def __contains__(self, key):
+        return self._lookup(key) is not _missing
+
+    def __iter__(self):
+        return self.keys()
+
+    def __len__(self):
+        """The number of live keys. This scans every run.
+        """
+        return sum(1 for _ in self._merge(None, None))
+
+    def keys(self, lo=None, hi=None):
+        """Iterate over the keys in the range [lo, hi) in sorted order.
+        """
+        return (record[0] for record in self._merge(lo, hi))
+
+    def values(self, lo=None, hi=None):
+        """Iterate over the values for the keys in the range [lo, hi).
+        """
+        return (record[1] for record in self._merge(lo, hi))
+
+    def items(self, lo=None, hi=None):
+        """Iterate over the (key, value) pairs in the range [lo, hi).
+        """
+        return (record[:2] for record in self._merge(lo, hi))
+
+    def count_range(self, lo=None, hi=None):
+        """Count the keys in the range [lo, hi).
+        """
+        return sum(1 for _ in self._merge(lo, hi))
+
+    def _first(self, records, default, key):
+        for record in records:
+            return record[:2]
+        if default is _missing:
+            raise KeyError(key)
+        return default
+
+    def first_item(self):
+        """Look at the smallest (key, value) pair.
+
+        Raises
+        ------
+        KeyError
+            Raised when the diskmap is empty.
+        """
+        for record in self._merge(None, None):
+            return record[:2]
+        raise KeyError('first_item(): diskmap is empty')
+
+    def ceiling_item(self, key, default=_missing):
+        """Find the pair with the smallest key greater than or equal to
+        ``key``.
+        """
+        return self._first(self._merge(key, None), default, key)
+
+    def higher_item(self, key, default=_missing):
+        """Find the pair with the smallest key greater than ``key``.
+        """
+        order = self._order
+        okey = order(key)
+        return self._first(
+            (r for r in self._merge(key, None) if okey < order(r[0])),
+            default,
+            key,
+        )
+
+    # writes
+
+    def _write(self, key, value):
+        with self._lock:
+            self._check_open()
+            memtable = self._memtable
+            memtable[key] = value
+            full = len(memtable) >= self.memtable_size
+        if full:
+            self.flush()
+
+    def __setitem__(self, key, value):
+        self._write(key, value)
+
+    def __delitem__(self, key):
+        if key not in self:
+            raise KeyError(key)
+        self._write(key, _deleted)
+
+    def pop(self, key, default=_missing):
+        value = self._lookup(key)
+        if value is _missing:
+            if default is _missing:
+                raise KeyError(key)
+            return default
+        self._write(key, _deleted)
+        return value
+
+    def flush(self):
+        """Write the memtable out as a new run.
+        """
+        with self._flush_lock:
+            with self._lock:
+                self._check_open()
+                frozen = self._memtable
+                if not frozen:
+                    return
+                self._frozen = frozen
+                self._memtable = self._cls()
+
+            path = self._new_run_path()
+            records = (
+                (key, None, True) if value is _deleted else (key, value, False)
+                for key, value in frozen.items()
+            )
+            try:
+                written = _write_run(
+                    path,
+                    records,
+                    self._sortkey,
+                    len(frozen),
+                    self.block_size,
+                    self.bits_per_key,
+                )
+                with self._lock:
+                    if written:
+                        runs = self._runs + [
+                            _Run(path, self._sortkey, self._order),
+                        ]
+                        self._write_manifest(runs)
+                        self._runs = runs
+                    self._frozen = None
+            except BaseException:
+                with self._lock:
+                    # put the entries back under any newer writes
+                    frozen.update(self._memtable)
+                    self._memtable = frozen
+                    self._frozen = None
+                raise
+
+            compact = len(self._runs) > self.max_runs
+
+        if compact:
+            self._schedule_compaction()
+
+    def _schedule_compaction(self):
+        if not self.background:
+            self.compact()
+            return
+        with self._lock:
+            if self._compactor is not None and self._compactor.is_alive():
+                return
+            self._compactor = thread = threading.Thread(
+                target=self._background_compact,
+                name='diskmap-compact',
+            )
+            thread.daemon = True
+            thread.start()
+
+    def _background_compact(self):
+        try:
+            self.compact()
+        except BaseException as e:
+            self._error = e
+
+    def compact(self):
+        """Merge every run into one, dropping deleted keys and the values
+        they shadow.
+        """
+        with self._compact_lock:
+            with self._lock:
+                self._check_open()
+                runs = list(self._runs)
+            if not runs:
+                return
+
+            sources = [run.scan() for run in reversed(runs)]
+            # the runs being merged include the oldest one so there is
+            # nothing left for a deletion to shadow
+            records = (
+                record
+                for _, record in _merge_runs(sources, self._order)
+                if not record[2]
+            )
+
+            path = self._new_run_path()
+            written = _write_run(
+                path,
+                records,
+                self._sortkey,
+                sum(run.count for run in runs),
+                self.block_size,
+                self.bits_per_key,
+            )
+            with self._lock:
+                # runs flushed while compacting were appended after ours
+                merged = [_Run(path, self._sortkey, self._order)] \
+                    if written else []
+                new_runs = merged + self._runs[len(runs):]
+                self._write_manifest(new_runs)
+                self._runs = new_runs
+
+            # readers may still hold the old runs, their maps are released
+            # when the last reference goes away
+            for run in runs:
+                os.remove(run.path)
+
+    def wait(self):
+        """Wait for a background compaction to finish.
+        """
+        thread = self._compactor
+        if thread is not None:
+            thread.join()
+        error, self._error = self._error, None
+        if error is not None:
+            raise error
+
+    def close(self):
+        """Flush the memtable, wait for compaction and release the runs.
+        """
+        if self._closed:
+            return
+        self.flush()
+        self.wait()
+        with self._lock:
+            self._closed = True
+            for run in self._runs:
+                run.close()
+            self._runs = []
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def __repr__(self):
+        return '%s(%r)' % (type(self).__name__, self.path)
@@ -0,0 +1,399 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+#include "sortedmap.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SORTEDMAP_HAVE_SHM 1
+#else
+#define SORTEDMAP_HAVE_SHM 0
+#endif
+
+#if SORTEDMAP_HAVE_SHM
+// A sorted map of fixed width keys and values laid out in a POSIX shared
+// memory segment so that many processes can read one copy in place. The keys
+// and values are kept in two sorted arrays after a small header.
+//
+// One process writes. Readers run without locks using the sequence in the
+// header: the writer makes it odd while it changes the segment and even
+// again when it is done, and a reader retries any read that overlapped a
+// write.
+namespace sharedmap {
+    // Each key and value is stored in 8 bytes as one of these, chosen by the
+    // ``array`` module style type codes ``'q'`` and ``'d'``.
+    union slot {
+        std::int64_t q;
+        double d;
+    };
+
+    struct header {
+        char magic[8];
+        std::atomic<std::uint64_t> sequence;
+        std::uint64_t capacity;
+        std::uint64_t size;
+        char keytype;
+        char valuetype;
+    };
+
+    // the keys start at a cache line after the header, then the values
+    const std::size_t data_offset = 64;
+    static_assert(sizeof(header) <= data_offset, "header too large");
+
+    struct object {
+        PyObject_HEAD
+        // NULL once closed.
+        header *segment;
+        std::size_t length;
+        PyObject *name;
+        bool writable;
+        // Seconds a read waits for a write to finish, or -1 to wait until
+        // interrupted.
+        double timeout;
+    };
+
+    bool check(PyObject*);
+
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    PyObject *create(PyTypeObject*, PyObject*, PyObject*);
+    PyObject *unlink(PyObject*, PyObject*);
+    void dealloc(object*);
+    PyObject *close(object*);
+    Py_ssize_t len(object*);
+    PyObject *getitem(object*, PyObject*);
+    int setitem(object*, PyObject*, PyObject*);
+    int contains(object*, PyObject*);
+    PyObject *get(object*, PyObject*);
+    PyObject *floor_item(object*, PyObject*);
+    PyObject *ceiling_item(object*, PyObject*);
+    PyObject *keys(object*, PyObject*, PyObject*);
+    PyObject *values(object*, PyObject*, PyObject*);
+    PyObject *items(object*, PyObject*, PyObject*);
+    PyObject *update(object*, PyObject*);
+    PyObject *pyclear(object*);
+    PyObject *iter(object*);
+    PyObject *repr(object*);
+    PyObject *enter(object*);
+    PyObject *exit(object*, PyObject*);
+    PyObject *get_name(object*);
+    PyObject *get_capacity(object*);
+    PyObject *get_keytype(object*);
+    PyObject *get_valuetype(object*);
+    PyObject *get_writable(object*);
+    PyObject *get_version(object*);
+
+    namespace keyiter {
+        struct object {
+            PyObject_HEAD
+            OwnedRef<sharedmap::object> map;
+            std::size_t pos;
+            std::uint64_t sequence;
+        };
+
+        void dealloc(object*);
+        PyObject *next(object*);
+
+        PyTypeObject type = {
+            PyVarObject_HEAD_INIT(&PyType_Type, 0)
+            "sortedmap.sharedmap_keyiter",              // tp_name
+            sizeof(object),                             // tp_basicsize
+            0,                                          // tp_itemsize
+            (destructor) dealloc,                       // tp_dealloc
+            0,                                          // tp_print
+            0,                                          // tp_getattr
+            0,                                          // tp_setattr
+            0,                                          // tp_reserved
+            0,                                          // tp_repr
+            0,                                          // tp_as_number
+            0,                                          // tp_as_sequence
+            0,                                          // tp_as_mapping
+            0,                                          // tp_hash
+            0,                                          // tp_call
+            0,                                          // tp_str
+            0,                                          // tp_getattro
+            0,                                          // tp_setattro
+            0,                                          // tp_as_buffer
+            Py_TPFLAGS_DEFAULT,                         // tp_flags
+            0,                                          // tp_doc
+            0,                                          // tp_traverse
+            0,                                          // tp_clear
+            0,                                          // tp_richcompare
+            0,                                          // tp_weaklistoffset
+            PyObject_SelfIter,                          // tp_iter
+            (iternextfunc) next,                        // tp_iternext
+        };
+    }
+
+    PySequenceMethods as_sequence = {
+        (lenfunc) len,                              // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyMappingMethods as_mapping = {
+        (lenfunc) len,                              // mp_length
+        (binaryfunc) getitem,                       // mp_subscript
+        (objobjargproc) setitem,                    // mp_ass_subscript
+    };
+
+    PyDoc_STRVAR(create_doc,
+                 "Create a new shared memory segment holding a map.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "name : str\n"
+                 "    The name of the segment, for example\n"
+                 "    ``'/reference-prices'``. This must not exist yet.\n"
+                 "capacity : int\n"
+                 "    The most pairs the segment can hold.\n"
+                 "keytype : {'q', 'd'}, optional\n"
+                 "    Store the keys as 64 bit ints or doubles.\n"
+                 "valuetype : {'q', 'd'}, optional\n"
+                 "    Store the values as 64 bit ints or doubles.\n"
+                 "data : mapping or iterable[key, value], optional\n"
+                 "    The initial pairs.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "m : sharedmap\n"
+                 "    The map, open for writing.\n");
+    PyDoc_STRVAR(unlink_doc,
+                 "Remove a shared memory segment.\n"
+                 "\n"
+                 "Processes which have it open keep their mapping until\n"
+                 "they close it.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "name : str\n"
+                 "    The name of the segment.\n");
+    PyDoc_STRVAR(close_doc,
+                 "Unmap the segment. The map may not be used after this.");
+    PyDoc_STRVAR(get_doc,
+                 "Look up a key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : int or float\n"
+                 "    The key to look up.\n"
+                 "default : any, optional\n"
+                 "    The value to return if ``key`` is not in the map.\n");
+    PyDoc_STRVAR(floor_item_doc,
+                 "Find the pair with the greatest key less than or equal\n"
+                 "to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : int or float\n"
+                 "    The key to search from.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(ceiling_item_doc,
+                 "Find the pair with the smallest key greater than or equal\n"
+                 "to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : int or float\n"
+                 "    The key to search from.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(keys_doc,
+                 "The keys in the half-open range ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : int or float, optional\n"
+                 "    The first key to include.\n"
+                 "hi : int or float, optional\n"
+                 "    The key to stop before.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "keys : list\n"
+                 "    The keys as of a single version of the map.\n");
+    PyDoc_STRVAR(values_doc,
+                 "The values for the keys in the half-open range\n"
+                 "``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : int or float, optional\n"
+                 "    The first key to include.\n"
+                 "hi : int or float, optional\n"
+                 "    The key to stop before.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "values : list\n"
+                 "    The values as of a single version of the map.\n");
+    PyDoc_STRVAR(items_doc,
+                 "The pairs with keys in the half-open range ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : int or float, optional\n"
+                 "    The first key to include.\n"
+                 "hi : int or float, optional\n"
+                 "    The key to stop before.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "items : list[(key, value)]\n"
+                 "    The pairs as of a single version of the map.\n");
+    PyDoc_STRVAR(update_doc,
+                 "Set every pair from a mapping or iterable.\n"
+                 "\n"
+                 "Readers see either none or all of the new pairs.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : mapping or iterable[key, value]\n"
+                 "    The pairs to set.\n");
+    PyDoc_STRVAR(clear_doc,
+                 "Remove all items from the map.\n"
+                 "\n"
+                 "This also recovers a segment whose writer died during a\n"
+                 "write, which readers otherwise wait on forever or until\n"
+                 "their timeout. Open the segment with ``writable=True``,\n"
+                 "clear it and load the pairs again.\n");
+
+    PyMethodDef methods[] = {
+        {"create", (PyCFunction) create,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, create_doc},
+        {"unlink", (PyCFunction) unlink, METH_STATIC | METH_O, unlink_doc},
+        {"close", (PyCFunction) close, METH_NOARGS, close_doc},
+        {"get", (PyCFunction) get, METH_VARARGS, get_doc},
+        {"floor_item", (PyCFunction) floor_item, METH_VARARGS,
+         floor_item_doc},
+        {"ceiling_item", (PyCFunction) ceiling_item, METH_VARARGS,
+         ceiling_item_doc},
+        {"keys", (PyCFunction) keys, METH_VARARGS | METH_KEYWORDS, keys_doc},
+        {"values", (PyCFunction) values,
+         METH_VARARGS | METH_KEYWORDS, values_doc},
+        {"items", (PyCFunction) items,
+         METH_VARARGS | METH_KEYWORDS, items_doc},
+        {"update", (PyCFunction) update, METH_O, update_doc},
+        {"clear", (PyCFunction) pyclear, METH_NOARGS, clear_doc},
+        {"__enter__", (PyCFunction) enter, METH_NOARGS, NULL},
+        {"__exit__", (PyCFunction) exit, METH_VARARGS, NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(name_doc,
+                 "The name of the shared memory segment.\n");
+    PyDoc_STRVAR(capacity_doc,
+                 "The most pairs the segment can hold.\n");
+    PyDoc_STRVAR(keytype_doc,
+                 "The type code of the keys, ``'q'`` or ``'d'``.\n");
+    PyDoc_STRVAR(valuetype_doc,
+                 "The type code of the values, ``'q'`` or ``'d'``.\n");
+    PyDoc_STRVAR(writable_doc,
+                 "Was the segment opened for writing?\n");
+    PyDoc_STRVAR(version_doc,
+                 "The number of writes made to the segment. Readers may\n"
+                 "compare this to tell if the map changed.\n");
+
+    PyGetSetDef getsets[] = {
+        {(char*) "name", (getter) get_name, NULL, name_doc, NULL},
+        {(char*) "capacity",
+         (getter) get_capacity,
+         NULL,
+         capacity_doc,
+         NULL},
+        {(char*) "keytype", (getter) get_keytype, NULL, keytype_doc, NULL},
+        {(char*) "valuetype",
+         (getter) get_valuetype,
+         NULL,
+         valuetype_doc,
+         NULL},
+        {(char*) "writable",
+         (getter) get_writable,
+         NULL,
+         writable_doc,
+         NULL},
+        {(char*) "version", (getter) get_version, NULL, version_doc, NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(sharedmap_doc,
+                 "A sorted map of ints or floats in shared memory.\n"
+                 "\n"
+                 "Every process which opens the same segment reads the\n"
+                 "same pages, so a large map is held once no matter how\n"
+                 "many workers use it. Use ``sharedmap.create`` to make a\n"
+                 "segment. One process may write to a segment at a time.\n"
+                 "Readers never block the writer. They retry a read which\n"
+                 "overlapped a write, and an iterator raises RuntimeError\n"
+                 "if the map is written while it is in use.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "name : str\n"
+                 "    The name of an existing segment.\n"
+                 "writable : bool, optional\n"
+                 "    Open the segment for writing.\n"
+                 "timeout : float, optional\n"
+                 "    The most seconds a read waits for a write to finish\n"
+                 "    before raising TimeoutError. By default reads wait\n"
+                 "    until the write finishes or a signal interrupts them.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&PyType_Type, 0)
+        "sortedmap.sharedmap",                      // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        0,                                          // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        &as_mapping,                                // tp_as_mapping
+        0,                                          // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT,                         // tp_flags
+        sharedmap_doc,                              // tp_doc
+        0,                                          // tp_traverse
+        0,                                          // tp_clear
+        0,                                          // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) iter,                         // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        0,                                          // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
+#endif  // SORTEDMAP_HAVE_SHM
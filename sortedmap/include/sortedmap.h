@@ -1,11 +1,20 @@
 #pragma once
 #include <array>
+#include <cmath>
 #include <exception>
 #include <map>
+#include <unordered_map>
+#include <vector>
 
 #include <Python.h>
 #include <structmember.h>
 
+// after Python.h which must come before any system header
+#ifdef __GLIBCXX__
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#endif  // __GLIBCXX__
+
 #define COMPILING_IN_PY2 (PY_VERSION_HEX <= 0x03000000)
 
 #ifndef Py_RETURN_NOTIMPLEMENTED
@@ -18,9 +27,38 @@
 #define Py_TPFLAGS_CHECKTYPES 0  // ignore this in py3
 #endif  / Py_TPFLAGS_CHECKTYPES
 
+#if COMPILING_IN_PY2
+typedef long Py_hash_t;  // spelled ``long`` before 3.2
+#endif  // COMPILING_IN_PY2
+
+// ``METH_FASTCALL | METH_KEYWORDS`` is public from 3.7 and the vectorcall
+// protocol from 3.9.
+#define HAVE_FASTCALL (PY_VERSION_HEX >= 0x03070000)
+#define HAVE_VECTORCALL (PY_VERSION_HEX >= 0x03090000)
+
+// Calling objects through vectorcall is possible from 3.8 where the function
+// is still spelled ``_PyObject_Vectorcall``.
+#define HAVE_VECTORCALL_CALL (PY_VERSION_HEX >= 0x03080000)
+#if HAVE_VECTORCALL_CALL && !HAVE_VECTORCALL
+#define PyObject_Vectorcall _PyObject_Vectorcall
+#endif
+
 #define likely(condition) __builtin_expect(!!(condition), 1)
 #define unlikely(condition) __builtin_expect(!!(condition), 0)
 
+// Operation counters are compiled in only when building with
+// ``SORTEDMAP_STATS`` defined so that the default build pays nothing for them.
+#ifdef SORTEDMAP_STATS
+#define STAT_INC(counters, field)               \
+    do {                                        \
+        if (counters) {                         \
+            ++(counters)->field;                \
+        }                                       \
+    } while (0)
+#else
+#define STAT_INC(counters, field)
+#endif  // SORTEDMAP_STATS
+
 class PythonError : std::exception {};
 
 template<typename T>
@@ -56,7 +94,10 @@ public:
     OwnedRef<T>(const OwnedRef<T> &ref) : OwnedRef<T>(ref.ob) {}
 
     OwnedRef<T> &operator=(OwnedRef<T> &&ref) {
+        T *old = ob;
+
         construct(ref.ob);
+        Py_XDECREF(old);
         return *this;
     }
 
@@ -102,20 +143,85 @@ public:
 
 PyObject *py_identity(PyObject*);
 
+// A fixed capacity stack of released objects of type ``T`` which are reused
+// by ``alloc`` before falling back to ``PyObject_New``. ``T`` must not be
+// garbage collected and callers must still run the destructors of any
+// members before calling ``release``.
+template<typename T, std::size_t capacity>
+class FreeList final {
+private:
+    std::array<T*, capacity> obs;
+    std::size_t size = 0;
+
+public:
+    T *alloc(PyTypeObject *cls) {
+        if (likely(size)) {
+            T *ob = obs[--size];
+            return (T*) PyObject_Init((PyObject*) ob, cls);
+        }
+        return PyObject_New(T, cls);
+    }
+
+    void release(T *ob) {
+        if (likely(size < capacity)) {
+            obs[size++] = ob;
+            return;
+        }
+        PyObject_Del(ob);
+    }
+};
+
 namespace sortedmap {
+    struct counters {
+        unsigned long comparisons;
+        unsigned long keyfunc_calls;
+        unsigned long emplaces;
+        unsigned long erases;
+        unsigned long failed_lookups;
+        unsigned long revision_bumps;
+        unsigned long iterator_invalidations;
+    };
+
     class Comparator {
     private:
+        // How a key is turned into the object that is compared.
+        enum class extractor {
+            identity,  // compare the keys themselves
+            call,      // call ``keyfunc``
+            item,      // ``keyfunc`` is ``operator.itemgetter(keyarg)``
+            attr,      // ``keyfunc`` is an ``operator.attrgetter`` and
+                       // ``keyarg`` is the tuple of names along its path
+        };
+
+        extractor kind;
+        PyObject *keyarg;  // not using ownedref for copying issues
+#if !HAVE_VECTORCALL_CALL
         PyObject *argtuple;  // not using ownedref for copying issues
+#endif  // !HAVE_VECTORCALL_CALL
 
+        void classify();
         PyObject *call(PyObject*);
+        PyObject *extract(PyObject*);
 
     public:
         PyObject* keyfunc;  // not using ownedref for copying issues
+        // Sort in descending order?
+        bool reverse;
+        // Where to count comparisons, this is owned by the map object.
+        counters *stats;
+
+        // Look up the ``operator`` types which are extracted natively.
+        static bool import_extractors();
 
         Comparator();
-        Comparator(PyObject*);
+        Comparator(PyObject*, bool = false, counters* = NULL);
+        Comparator(const Comparator&);
         ~Comparator();
+        // Assignment copies the ordering but keeps the destination's
+        // counters so that copying a map does not share its stats.
         Comparator &operator=(const Comparator&);
+        // Do both comparators put keys in the same order?
+        bool operator==(const Comparator&) const;
         bool operator()(const OwnedRef<PyObject>&,
                         const OwnedRef<PyObject>&);
     };
@@ -124,20 +230,294 @@ namespace sortedmap {
                              OwnedRef<PyObject>,
                              Comparator>;
 
+    // Settings of a map beyond its ordering, chosen through ``configure``.
+    // The zero value is an unbounded map.
+    struct options {
+        // The most pairs to hold, 0 for no limit.
+        std::size_t maxsize;
+        // Evict the last key instead of the first when over ``maxsize``.
+        bool evict_last;
+        // Keep a hash index of the keys next to the tree.
+        bool indexed;
+        // Keep a tree which summarizes each subtree next to the map.
+        bool aggregate;
+    };
+
+    // A key in the hash index. The object is owned by its node in the tree.
+    struct indexkey {
+        PyObject *ob;
+        Py_hash_t hash;
+    };
+
+    struct indexhash {
+        std::size_t operator()(const indexkey &key) const noexcept {
+            return key.hash;
+        }
+    };
+
+    struct indexequal {
+        // Compares the hashes before calling ``__eq__`` and throws
+        // ``PythonError`` if that fails.
+        bool operator()(const indexkey&, const indexkey&) const;
+    };
+
+    // Point lookups of hashable keys go through this instead of the tree,
+    // ordered operations still walk the tree.
+    using indextype = std::unordered_map<indexkey,
+                                         maptype::iterator,
+                                         indexhash,
+                                         indexequal>;
+
+    // What the aggregate tree knows about the entries under each node. Only
+    // exact ints within 2 ** 53 of 0 and floats other than nan are reduced
+    // here, which compare exactly as doubles; a range holding any ``others``
+    // is reduced by walking it instead.
+    struct summary {
+        std::size_t count;
+        std::size_t others;
+        std::size_t floats;
+        // The ints are added exactly until that overflows.
+        long long isum;
+        bool overflow;
+        double fsum;
+        // The first smallest and largest number, NULL if there are none.
+        // These are owned by the map.
+        PyObject *min;
+        PyObject *max;
+        double minv;
+        double maxv;
+
+        // The summary of one entry. This is called while rebalancing so it
+        // must not fail.
+        static summary of(PyObject *value) {
+            const long long limit = 1LL << 53;
+            summary s = summary();
+            long long ivalue = 0;
+            bool isint = false;
+            double v;
+
+            s.count = 1;
+#if COMPILING_IN_PY2
+            if (PyInt_CheckExact(value)) {
+                ivalue = PyInt_AS_LONG(value);
+                isint = true;
+            }
+#endif  // COMPILING_IN_PY2
+            if (PyLong_CheckExact(value)) {
+                int overflow;
+                ivalue = PyLong_AsLongLongAndOverflow(value, &overflow);
+                isint = !overflow;
+            }
+            if (isint && -limit <= ivalue && ivalue <= limit) {
+                s.isum = ivalue;
+                v = ivalue;
+            }
+            else if (PyFloat_CheckExact(value) &&
+                     !std::isnan(PyFloat_AS_DOUBLE(value))) {
+                s.floats = 1;
+                s.fsum = v = PyFloat_AS_DOUBLE(value);
+            }
+            else {
+                s.others = 1;
+                return s;
+            }
+            s.min = s.max = value;
+            s.minv = s.maxv = v;
+            return s;
+        }
+
+        // Fold in the summary of entries which sort after these.
+        void append(const summary &next) {
+            count += next.count;
+            others += next.others;
+            floats += next.floats;
+            overflow = (overflow ||
+                        next.overflow ||
+                        __builtin_add_overflow(isum, next.isum, &isum));
+            fsum += next.fsum;
+            if (next.min && (!min || next.minv < minv)) {
+                min = next.min;
+                minv = next.minv;
+            }
+            if (next.max && (!max || next.maxv > maxv)) {
+                max = next.max;
+                maxv = next.maxv;
+            }
+        }
+    };
+
+#ifdef __GLIBCXX__
+    // Recompute the summary of ``node`` from the summaries of its children.
+    template<typename node_iterator, typename node_const_iterator>
+    void
+    resummarize(node_iterator node, node_const_iterator end) {
+        summary s = summary();
+
+        if (node.get_l_child() != end) {
+            s.append(node.get_l_child().get_metadata());
+        }
+        s.append(summary::of((*node)->second));
+        if (node.get_r_child() != end) {
+            s.append(node.get_r_child().get_metadata());
+        }
+        const_cast<summary&>(node.get_metadata()) = s;
+    }
+
+    // The ``__gnu_pbds`` node update policy which keeps the summaries up to
+    // date as the aggregate tree is rebalanced.
+    template<typename node_const_iterator,
+             typename node_iterator,
+             typename cmp_fn,
+             typename allocator>
+    struct summarize {
+        using metadata_type = summary;
+
+        void operator()(node_iterator node, node_const_iterator end) const {
+            resummarize(node, end);
+        }
+
+        virtual node_const_iterator node_begin() const = 0;
+        virtual node_const_iterator node_end() const = 0;
+        virtual ~summarize() {}
+    };
+
+    // Orders the keys of the aggregate tree like the map.
+    struct aggregateless {
+        mutable Comparator comp;
+
+        bool operator()(PyObject *a, PyObject *b) const {
+            return comp(a, b);
+        }
+    };
+
+    // A second tree over the pairs of a map, which are owned by the map,
+    // holding the summary of each subtree so that a range is summarized by
+    // visiting O(log(n)) nodes.
+    using aggregatetype = __gnu_pbds::tree<PyObject*,
+                                           PyObject*,
+                                           aggregateless,
+                                           __gnu_pbds::rb_tree_tag,
+                                           summarize>;
+#else
+    // The aggregate tree needs libstdc++. Elsewhere ``aggregate=True`` is
+    // accepted but ranges are summarized by walking them.
+    struct aggregatetype;
+#endif  // __GLIBCXX__
+
     struct object {
+        using container = maptype;
+
         PyObject_HEAD
         maptype map;
         // Keep track of operations that may invalidate any iterators.
         unsigned long iter_revision;
+        counters stats;
+        options opts;
+        // NULL unless configured with ``index=True``.
+        indextype *index;
+        // NULL unless configured with ``aggregate=True``.
+        aggregatetype *aggregate;
+        // NULL unless a journal is attached with ``m.journal = j``. This
+        // holds the journal's bound ``record`` method.
+        PyObject *journal;
+        // The journal's bound ``record_many`` method, or NULL if it has
+        // none.
+        PyObject *journal_many;
+
+        static const char *kind() {
+            return "sortedmap";
+        }
+    };
+
+    inline void
+    bump_revision(object *self) {
+        ++self->iter_revision;
+        STAT_INC(&self->stats, revision_bumps);
+    }
+
+    // The changes passed to ``journal.record(op, key, value)``. These match
+    // the codes in ``sortedmap/journal.py``.
+    enum class journal_op : long {
+        set = 0,
+        erase = 1,
+        clear = 2,
     };
 
     bool check(PyObject*);
     bool check_exact(PyObject*);
 
+    // Methods which take their arguments like vectorcall: the positional
+    // arguments followed by the values for the names in ``kwnames``.
+    typedef PyObject *fastcallfunc(object*,
+                                   PyObject *const*,
+                                   Py_ssize_t,
+                                   PyObject*);
+
+    // Unpack the arguments of a ``fastcallfunc`` into ``out`` which has one
+    // slot, initialized to NULL, for each name in ``keywords``. The first
+    // ``required`` arguments must be passed.
+    bool parse_fastcall(const char *fname,
+                        const char *const *keywords,
+                        Py_ssize_t required,
+                        PyObject *const *args,
+                        Py_ssize_t nargs,
+                        PyObject *kwnames,
+                        PyObject **out);
+
+#if HAVE_FASTCALL
+#define FASTCALL(f) ((PyCFunction) (f))
+#define FASTCALL_FLAGS (METH_FASTCALL | METH_KEYWORDS)
+#else
+    // Call a ``fastcallfunc`` with METH_VARARGS | METH_KEYWORDS arguments on
+    // interpreters without METH_FASTCALL.
+    template<fastcallfunc f>
+    PyObject*
+    varargs(object *self, PyObject *args, PyObject *kwargs) {
+        Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+        Py_ssize_t nkwargs = (kwargs) ? PyDict_Size(kwargs) : 0;
+        std::vector<PyObject*> stack(nargs + nkwargs);
+        PyObject *kwnames = NULL;
+        PyObject *key;
+        PyObject *value;
+        Py_ssize_t pos = 0;
+        PyObject *ret;
+
+        for (Py_ssize_t ix = 0; ix < nargs; ++ix) {
+            stack[ix] = PyTuple_GET_ITEM(args, ix);
+        }
+        if (nkwargs) {
+            if (!(kwnames = PyTuple_New(nkwargs))) {
+                return NULL;
+            }
+            for (Py_ssize_t ix = 0; PyDict_Next(kwargs, &pos, &key, &value);
+                 ++ix) {
+                Py_INCREF(key);
+                PyTuple_SET_ITEM(kwnames, ix, key);
+                stack[nargs + ix] = value;
+            }
+        }
+        ret = f(self, stack.data(), nargs, kwnames);
+        Py_XDECREF(kwnames);
+        return ret;
+    }
+
+#define FASTCALL(f) ((PyCFunction) varargs<f>)
+#define FASTCALL_FLAGS (METH_VARARGS | METH_KEYWORDS)
+#endif  // HAVE_FASTCALL
+
     typedef PyObject *iterfunc(object*);
     typedef PyObject *viewfunc(object*);
     object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    PyObject *construct(PyTypeObject*,
+                        PyObject*,
+                        bool,
+                        const options&,
+                        PyObject*,
+                        PyObject*);
     int init(object*, PyObject*, PyObject*);
+#if HAVE_VECTORCALL
+    PyObject *vectorcall(PyObject*, PyObject *const*, size_t, PyObject*);
+#endif  // HAVE_VECTORCALL
     void dealloc(object*);
     int traverse(object*, visitproc, void*);
     void clear(object*);
@@ -146,49 +526,144 @@ namespace sortedmap {
     Py_ssize_t len(object*);
     PyObject *getitem(object*, PyObject*);
     PyObject *get(object*, PyObject*, PyObject*);
-    PyObject *pyget(object*, PyObject*, PyObject*);
+    fastcallfunc pyget;
     PyObject *pop(object*, PyObject*, PyObject*);
-    PyObject *pypop(object*, PyObject*, PyObject*);
+    fastcallfunc pypop;
     PyObject *popitem(object*, bool);
-    PyObject *pypopitem(object*, PyObject*, PyObject*);
+    fastcallfunc pypopitem;
+    PyObject *popitems(object*, Py_ssize_t, bool);
+    PyObject *pypopitems(object*, PyObject*, PyObject*);
+    PyObject *iter_chunks(object*, PyObject*, PyObject*);
     int setitem(object*, PyObject*, PyObject*);
+    PyObject *append(object*, PyObject*);
     PyObject *setdefault(object*, PyObject*, PyObject*);
-    PyObject *pysetdefault(object*, PyObject *, PyObject*);
+    fastcallfunc pysetdefault;
     int contains(object*, PyObject*);
     PyObject *repr(object*);
     object *copy(object*);
     bool update(object*, PyObject*, PyObject*);
-    PyObject *pyupdate(object*, PyObject*, PyObject*);
+    bool update_fastcall(object*, PyObject *const*, Py_ssize_t, PyObject*);
+    fastcallfunc pyupdate;
+    PyObject *absorb(object*, PyObject*);
     object *fromkeys(PyTypeObject*, PyObject*, PyObject*);
     object *pyfromkeys(PyObject*, PyObject*, PyObject*);
+    PyObject *configure(PyObject*, PyObject*, PyObject*);
+    PyObject *sizeof_(object*);
+    PyObject *memory_usage(object*, PyObject*, PyObject*);
+    fastcallfunc floor_item;
+    fastcallfunc floor_key;
+    fastcallfunc ceiling_item;
+    fastcallfunc ceiling_key;
+    fastcallfunc lower_item;
+    fastcallfunc lower_key;
+    fastcallfunc higher_item;
+    fastcallfunc higher_key;
+    PyObject *first_item(object*);
+    PyObject *first_key(object*);
+    PyObject *last_item(object*);
+    PyObject *last_key(object*);
+    fastcallfunc count_range;
+    fastcallfunc aggregate;
+    fastcallfunc remove_if;
+    fastcallfunc retain_if;
+    fastcallfunc map_values;
+    fastcallfunc pyfinger;
+    fastcallfunc asof;
+#ifdef SORTEDMAP_STATS
+    PyObject *pystats(object*, PyObject*, PyObject*);
+#endif  // SORTEDMAP_STATS
 
     PyDoc_STRVAR(iter_revision_doc,
                  "An internal counter used to invalidate iterators after\n"
                  " the map changes size.\n");
 
+    // The iterators and views are templated on the ``owner`` object type so
+    // that they may be shared by every container in this module. ``owner``
+    // must have a ``container`` type, ``iter_revision`` and ``stats``
+    // members and a static ``kind`` function naming it for error messages.
     namespace abstractiter {
-        using itertype = maptype::const_iterator;
-        typedef PyObject *extract_element(itertype);
+        template<typename owner>
+        using itertype = typename owner::container::const_iterator;
 
+        template<typename owner>
+        using extract_element = PyObject *(itertype<owner>);
+
+        template<typename owner>
         struct object {
             PyObject_HEAD
-            itertype iter;
-            itertype end;
-            OwnedRef<sortedmap::object> map;
+            itertype<owner> iter;
+            itertype<owner> end;
+            OwnedRef<owner> map;
             // the revision of the map when this iter was created.
             unsigned long iter_revision;
+            // the last tuple returned by an item iterator, this is reused if
+            // nobody else holds a reference to it
+            PyObject *result;
         };
 
-        void dealloc(object*);
+        template<typename owner>
+        using nextfunc = PyObject *(object<owner>*);
+
+        template<typename owner>
+        FreeList<object<owner>, 16> freelist;
 
-        template<extract_element f>
+        template<typename owner>
+        void
+        dealloc(object<owner> *self) {
+            using ownedtype = OwnedRef<owner>;
+
+            self->iter.~itertype<owner>();
+            self->end.~itertype<owner>();
+            self->map.~ownedtype();
+            Py_XDECREF(self->result);
+            freelist<owner>.release(self);
+        }
+
+        template<typename owner>
+        inline bool
+        check_revision(object<owner> *self) {
+            if (unlikely(self->iter_revision != self->map.ob->iter_revision)) {
+                STAT_INC(&self->map.ob->stats, iterator_invalidations);
+                PyErr_Format(PyExc_RuntimeError,
+                             "%s changed size during iteration",
+                             owner::kind());
+                return false;
+            }
+            return true;
+        }
+
+        // Element extractors for containers of (key, value) pairs.
+        template<typename iterator>
         PyObject*
-        next(object *self) {
+        pair_key(iterator it) {
+            return std::get<0>(*it).incref();
+        }
+
+        template<typename iterator>
+        PyObject*
+        pair_value(iterator it) {
+            return std::get<1>(*it).incref();
+        }
+
+        template<typename iterator>
+        PyObject*
+        pair_item(iterator it) {
+            return PyTuple_Pack(2, std::get<0>(*it).ob, std::get<1>(*it).ob);
+        }
+
+        // Element extractor for containers of keys alone.
+        template<typename iterator>
+        PyObject*
+        set_key(iterator it) {
+            return it->incref();
+        }
+
+        template<typename owner, extract_element<owner> f>
+        PyObject*
+        next(object<owner> *self) {
             PyObject *ret;
 
-            if (unlikely(self->iter_revision != self->map.ob->iter_revision)) {
-                PyErr_SetString(PyExc_RuntimeError,
-                                "sortedmap changed size during iteration");
+            if (unlikely(!check_revision(self))) {
                 return NULL;
             }
             if (unlikely(self->iter == self->end)) {
@@ -200,37 +675,164 @@ namespace sortedmap {
             return ret;
         }
 
-        template<typename iterobject, PyTypeObject &cls>
+        // Like ``next<owner, pair_item>`` but reuses the result tuple when
+        // nobody else holds a reference to it.
+        template<typename owner>
+        PyObject*
+        next_item(object<owner> *self) {
+            PyObject *result = self->result;
+
+            if (!result || Py_REFCNT(result) != 1) {
+                // the caller kept the last pair, hand out a new tuple and
+                // remember that one instead
+                if (!(result = next<owner, pair_item>(self))) {
+                    return NULL;
+                }
+                Py_XDECREF(self->result);
+                self->result = result;
+                Py_INCREF(result);
+                return result;
+            }
+
+            if (unlikely(!check_revision(self))) {
+                return NULL;
+            }
+            if (unlikely(self->iter == self->end)) {
+                return NULL;
+            }
+
+            // we hold the only reference so nothing can observe the tuple
+            // changing
+            PyObject *oldkey = PyTuple_GET_ITEM(result, 0);
+            PyObject *oldvalue = PyTuple_GET_ITEM(result, 1);
+            PyTuple_SET_ITEM(result, 0, std::get<0>(*self->iter).incref());
+            PyTuple_SET_ITEM(result, 1, std::get<1>(*self->iter).incref());
+            self->iter = std::move(std::next(self->iter, 1));
+            Py_INCREF(result);
+            Py_DECREF(oldkey);
+            Py_DECREF(oldvalue);
+
+            // the collector untracks tuples which only hold atomic objects,
+            // the new contents may not be atomic
+#if PY_VERSION_HEX >= 0x03090000
+            if (!PyObject_GC_IsTracked(result))
+#else
+            if (!_PyObject_GC_IS_TRACKED(result))
+#endif
+            {
+                PyObject_GC_Track(result);
+            }
+            return result;
+        }
+
+        // Pull up to ``n`` elements into a new list. The list is empty once
+        // the iterator is exhausted.
+        template<typename owner, extract_element<owner> f>
+        PyObject*
+        next_n(object<owner> *self, Py_ssize_t n) {
+            PyObject *ret;
+            PyObject *ob;
+
+            if (!(ret = PyList_New(0))) {
+                return NULL;
+            }
+
+            for (Py_ssize_t ix = 0; ix < n; ++ix) {
+                // ``f`` may allocate and run arbitrary code through the gc
+                // so this is checked for every element, not once per chunk
+                if (unlikely(!check_revision(self))) {
+                    Py_DECREF(ret);
+                    return NULL;
+                }
+                if (self->iter == self->end) {
+                    break;
+                }
+
+                if (!(ob = f(self->iter))) {
+                    Py_DECREF(ret);
+                    return NULL;
+                }
+                self->iter = std::move(std::next(self->iter, 1));
+                if (PyList_Append(ret, ob)) {
+                    Py_DECREF(ob);
+                    Py_DECREF(ret);
+                    return NULL;
+                }
+                Py_DECREF(ob);
+            }
+            return ret;
+        }
+
+        bool check_chunksize(Py_ssize_t);
+
+        template<typename owner, extract_element<owner> f>
         PyObject*
-        iter(sortedmap::object *self) {
-            iterobject *ret = PyObject_New(iterobject, &cls);
+        pynext_n(object<owner> *self, PyObject *pyn) {
+            Py_ssize_t n = PyNumber_AsSsize_t(pyn, PyExc_OverflowError);
+
+            if ((n == -1 && PyErr_Occurred()) || !check_chunksize(n)) {
+                return NULL;
+            }
+            return next_n<owner, f>(self, n);
+        }
+
+        PyDoc_STRVAR(next_n_doc,
+                     "Advance the iterator by up to ``n`` elements.\n"
+                     "\n"
+                     "Parameters\n"
+                     "----------\n"
+                     "n : int\n"
+                     "    The maximum number of elements to return.\n"
+                     "\n"
+                     "Returns\n"
+                     "-------\n"
+                     "elements : list\n"
+                     "    The next elements in order. This has fewer than\n"
+                     "    ``n`` elements at the end of the map and is empty\n"
+                     "    when the iterator is exhausted.\n");
+
+        template<typename owner, extract_element<owner> f>
+        PyMethodDef methods[] = {
+            {"next_n", (PyCFunction) pynext_n<owner, f>, METH_O, next_n_doc},
+            {NULL},
+        };
+
+        template<typename owner, PyTypeObject &cls>
+        PyObject*
+        iter(owner *self) {
+            object<owner> *ret = freelist<owner>.alloc(&cls);
             if (!ret) {
                 return NULL;
             }
 
-            ret->iter = std::move(self->map.cbegin());
-            ret->end = std::move(self->map.cend());
-            new(&ret->map) OwnedRef<sortedmap::object>(self);
+            new(&ret->iter) itertype<owner>(self->map.cbegin());
+            new(&ret->end) itertype<owner>(self->map.cend());
+            new(&ret->map) OwnedRef<owner>(self);
             ret->iter_revision = self->iter_revision;
+            ret->result = NULL;
             return (PyObject*) ret;
         }
 
+        template<typename owner>
         PyMemberDef members[] = {
             {(char*) "_iter_revision",
              T_ULONG,
-             offsetof(object, iter_revision),
+             offsetof(object<owner>, iter_revision),
              READONLY,
              iter_revision_doc},
             {NULL},
         };
 
-        template<const char *&name, extract_element elem>
+        template<typename owner,
+                 const char *&name,
+                 extract_element<owner> elem,
+                 nextfunc<owner> next = abstractiter::next<owner, elem>>
         PyTypeObject type = {
             PyVarObject_HEAD_INIT(&PyType_Type, 0)
             name,                                       // tp_name
-            sizeof(object),                             // tp_basicsize
+            sizeof(object<owner>),                      // tp_basicsize
             0,                                          // tp_itemsize
-            (destructor) dealloc,                       // tp_dealloc
+            (destructor) dealloc<owner>,                // tp_dealloc
             0,                                          // tp_print
             0,                                          // tp_getattr
             0,                                          // tp_setattr
@@ -252,59 +854,236 @@ namespace sortedmap {
             0,                                          // tp_richcompare
             0,                                          // tp_weaklistoffset
             (getiterfunc) py_identity,                  // tp_iter
-            (iternextfunc) next<elem>,                  // tp_iternext
-            0,                                          // tp_methods
-            members,                                    // tp_members
+            (iternextfunc) next,                        // tp_iternext
+            methods<owner, elem>,                       // tp_methods
+            members<owner>,                             // tp_members
         };
     }
 
     namespace keyiter {
-        using object = abstractiter::object;
+        using object = abstractiter::object<sortedmap::object>;
+        using itertype = abstractiter::itertype<sortedmap::object>;
 
-        abstractiter::extract_element elem;
+        abstractiter::extract_element<sortedmap::object> elem;
         iterfunc iter;
         extern const char *name;
-        PyTypeObject type = abstractiter::type<name, elem>;
+        PyTypeObject type = abstractiter::type<sortedmap::object, name, elem>;
     }
 
     namespace valiter {
-        using object = abstractiter::object;
+        using object = abstractiter::object<sortedmap::object>;
+        using itertype = abstractiter::itertype<sortedmap::object>;
 
-        abstractiter::extract_element elem;
+        abstractiter::extract_element<sortedmap::object> elem;
         iterfunc iter;
         extern const char *name;
-        PyTypeObject type = abstractiter::type<name, elem>;
+        PyTypeObject type = abstractiter::type<sortedmap::object, name, elem>;
     }
 
     namespace itemiter {
-        using object = abstractiter::object;
+        using object = abstractiter::object<sortedmap::object>;
+        using itertype = abstractiter::itertype<sortedmap::object>;
 
-        abstractiter::extract_element elem;
+        abstractiter::extract_element<sortedmap::object> elem;
         iterfunc iter;
         extern const char *name;
-        PyTypeObject type = abstractiter::type<name, elem>;
+        PyTypeObject type = abstractiter::type<
+            sortedmap::object,
+            name,
+            elem,
+            abstractiter::next_item<sortedmap::object>>;
     }
 
-    namespace abstractview {
-        typedef PyObject *strict_func(PyObject*);
+    namespace chunkiter {
+        using iterobject = abstractiter::object<sortedmap::object>;
+        typedef PyObject *chunkfunc(iterobject*, Py_ssize_t);
+
+        struct object {
+            PyObject_HEAD
+            OwnedRef<iterobject> iter;
+            Py_ssize_t n;
+            chunkfunc *chunk;
+        };
+
+        void dealloc(object*);
+        PyObject *next(object*);
+        extern const char *name;
 
+        PyTypeObject type = {
+            PyVarObject_HEAD_INIT(&PyType_Type, 0)
+            name,                                       // tp_name
+            sizeof(object),                             // tp_basicsize
+            0,                                          // tp_itemsize
+            (destructor) dealloc,                       // tp_dealloc
+            0,                                          // tp_print
+            0,                                          // tp_getattr
+            0,                                          // tp_setattr
+            0,                                          // tp_reserved
+            0,                                          // tp_repr
+            0,                                          // tp_as_number
+            0,                                          // tp_as_sequence
+            0,                                          // tp_as_mapping
+            0,                                          // tp_hash
+            0,                                          // tp_call
+            0,                                          // tp_str
+            0,                                          // tp_getattro
+            0,                                          // tp_setattro
+            0,                                          // tp_as_buffer
+            Py_TPFLAGS_DEFAULT,                         // tp_flags
+            0,                                          // tp_doc
+            0,                                          // tp_traverse
+            0,                                          // tp_clear
+            0,                                          // tp_richcompare
+            0,                                          // tp_weaklistoffset
+            (getiterfunc) py_identity,                  // tp_iter
+            (iternextfunc) next,                        // tp_iternext
+        };
+    }
+
+    // A remembered position in a map. Lookups through a finger search
+    // outwards from the last position so nearby keys are found in O(log d)
+    // comparisons for a distance of d keys.
+    namespace finger {
         struct object {
             PyObject_HEAD
             OwnedRef<sortedmap::object> map;
+            maptype::iterator pos;
+            // the revision of the map when ``pos`` was found
+            unsigned long iter_revision;
         };
 
+        object *newfinger(sortedmap::object*, PyObject*);
         void dealloc(object*);
-        PyObject *repr(object*);
+        PyObject *seek(object*, PyObject*);
+        PyObject *get(object*, PyObject*);
+        PyObject *getitem(object*, PyObject*);
+        int contains(object*, PyObject*);
+        extern const char *name;
+
+        PyDoc_STRVAR(seek_doc,
+                     "Move to the first key which is not less than a key.\n"
+                     "\n"
+                     "Parameters\n"
+                     "----------\n"
+                     "key : any\n"
+                     "    The key to move to.\n"
+                     "\n"
+                     "Returns\n"
+                     "-------\n"
+                     "item : (key, value) or None\n"
+                     "    The pair at the new position or None if every key\n"
+                     "    is less than ``key``.\n");
+        PyDoc_STRVAR(get_doc,
+                     "Lookup a key starting from the finger's position.\n"
+                     "\n"
+                     "Parameters\n"
+                     "----------\n"
+                     "key : any\n"
+                     "    The key to lookup.\n"
+                     "default, optional\n"
+                     "    The value to return if ``key`` is not in the map.\n"
+                     "    This defaults to None.\n"
+                     "\n"
+                     "Returns\n"
+                     "-------\n"
+                     "val : any\n"
+                     "    map[key] if key in map else default\n");
+
+        PyMethodDef methods[] = {
+            {"seek", (PyCFunction) seek, METH_O, seek_doc},
+            {"get", (PyCFunction) get, METH_VARARGS, get_doc},
+            {NULL},
+        };
+
+        PySequenceMethods as_sequence = {
+            0,                                          // sq_length
+            0,                                          // sq_concat
+            0,                                          // sq_repeat
+            0,                                          // sq_item
+            0,                                          // placeholder
+            0,                                          // sq_ass_item
+            0,                                          // placeholder
+            (objobjproc) contains,                      // sq_contains
+        };
+
+        PyMappingMethods as_mapping = {
+            0,                                          // mp_length
+            (binaryfunc) getitem,                       // mp_subscript
+            0,                                          // mp_ass_subscript
+        };
 
-        template<typename viewobject, PyTypeObject &cls>
+        PyDoc_STRVAR(finger_doc,
+                     "A position in a sortedmap which makes lookups of\n"
+                     "nearby keys cheap. Create one with\n"
+                     "``sortedmap.finger``.\n");
+
+        PyTypeObject type = {
+            PyVarObject_HEAD_INIT(&PyType_Type, 0)
+            name,                                       // tp_name
+            sizeof(object),                             // tp_basicsize
+            0,                                          // tp_itemsize
+            (destructor) dealloc,                       // tp_dealloc
+            0,                                          // tp_print
+            0,                                          // tp_getattr
+            0,                                          // tp_setattr
+            0,                                          // tp_reserved
+            0,                                          // tp_repr
+            0,                                          // tp_as_number
+            &as_sequence,                               // tp_as_sequence
+            &as_mapping,                                // tp_as_mapping
+            0,                                          // tp_hash
+            0,                                          // tp_call
+            0,                                          // tp_str
+            0,                                          // tp_getattro
+            0,                                          // tp_setattro
+            0,                                          // tp_as_buffer
+            Py_TPFLAGS_DEFAULT,                         // tp_flags
+            finger_doc,                                 // tp_doc
+            0,                                          // tp_traverse
+            0,                                          // tp_clear
+            0,                                          // tp_richcompare
+            0,                                          // tp_weaklistoffset
+            0,                                          // tp_iter
+            0,                                          // tp_iternext
+            methods,                                    // tp_methods
+        };
+    }
+
+    namespace abstractview {
+        typedef PyObject *strict_func(PyObject*);
+
+        template<typename owner>
+        using iterfunc = PyObject *(owner*);
+
+        template<typename owner>
+        struct object {
+            PyObject_HEAD
+            OwnedRef<owner> map;
+        };
+
+        template<typename owner>
+        FreeList<object<owner>, 16> freelist;
+
+        template<typename owner>
+        void
+        dealloc(object<owner> *self) {
+            using ownedtype = OwnedRef<owner>;
+
+            self->map.~ownedtype();
+            freelist<owner>.release(self);
+        }
+
+        PyObject *repr(PyObject*);
+
+        template<typename owner, PyTypeObject &cls>
         PyObject*
-        view(sortedmap::object *self) {
-            viewobject *ret = PyObject_New(viewobject, &cls);
+        view(owner *self) {
+            object<owner> *ret = freelist<owner>.alloc(&cls);
             if (!ret) {
                 return NULL;
             }
 
-            new(&ret->map) OwnedRef<sortedmap::object>(self);
+            new(&ret->map) OwnedRef<owner>(self);
             return (PyObject*) ret;
         }
 
@@ -317,9 +1096,12 @@ namespace sortedmap {
         // are valid.
         // The default case pulls the lhs and rhs into the strict container
         // and returns the result of the operation on those.
-        template<strict_func strict, binaryfunc op, iterfunc iter>
+        template<typename owner,
+                 strict_func strict,
+                 binaryfunc op,
+                 iterfunc<owner> iter>
         struct binop {
-            static inline PyObject *g(object *self, PyObject *other) {
+            static inline PyObject *g(object<owner> *self, PyObject *other) {
                 PyObject *it;
                 PyObject *lhs;
                 PyObject *rhs;
@@ -346,27 +1128,27 @@ namespace sortedmap {
             }
 
             static PyObject *f(PyObject *self, PyObject *other) {
-                return g((object*) self, other);
+                return g((object<owner>*) self, other);
             }
         };
 
         // we cannot add sets
-        template<iterfunc iter>
-        struct binop<PySet_New, PyNumber_Add, iter> {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySet_New, PyNumber_Add, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot multiply sets
-        template<iterfunc iter>
-        struct binop<PySet_New, PyNumber_Multiply, iter> {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySet_New, PyNumber_Multiply, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we can multiply lists; however, we do not pull the rhs into
         // the strict container because multiply for lists is list repeat
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Multiply, iter> {
-            static inline PyObject *g(object *self, PyObject *rhs) {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySequence_List, PyNumber_Multiply, iter> {
+            static inline PyObject *g(object<owner> *self, PyObject *rhs) {
                 PyObject *it;
                 PyObject *lhs;
                 PyObject *res;
@@ -383,42 +1165,41 @@ namespace sortedmap {
 
                 res = PyNumber_Multiply(lhs, rhs);
                 Py_DECREF(lhs);
-                Py_DECREF(rhs);
                 return res;
             }
 
             static PyObject *f(PyObject *self, PyObject *lhs) {
-                return g((object*) self, lhs);
+                return g((object<owner>*) self, lhs);
             }
         };
 
         // we cannot subtract lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Subtract, iter> {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySequence_List, PyNumber_Subtract, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot intersect lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_And, iter> {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySequence_List, PyNumber_And, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot symmetric difference lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Xor, iter> {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySequence_List, PyNumber_Xor, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot union lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Or, iter> {
+        template<typename owner, iterfunc<owner> iter>
+        struct binop<owner, PySequence_List, PyNumber_Or, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
-        template<strict_func strict, iterfunc iter>
+        template<typename owner, strict_func strict, iterfunc<owner> iter>
         PyObject*
-        richcompare(object *self, PyObject *other, int opid) {
+        richcompare(object<owner> *self, PyObject *other, int opid) {
             PyObject *it;
             PyObject *lhs;
             PyObject *rhs;
@@ -431,7 +1212,6 @@ namespace sortedmap {
             lhs = strict(it);
             Py_DECREF(it);
             if (!lhs) {
-                Py_DECREF(lhs);
                 return NULL;
             }
 
@@ -445,11 +1225,12 @@ namespace sortedmap {
             return res;
         }
 
-        template<strict_func strict, iterfunc iter>
+        template<typename owner, strict_func strict, iterfunc<owner> iter>
         int
-        pybool(object *self) {
+        pybool(object<owner> *self) {
             PyObject *it;
             PyObject *st;
+            int res;
 
             if (!(it = iter(self->map))) {
                 return -1;
@@ -459,20 +1240,22 @@ namespace sortedmap {
             if (!st) {
                 return -1;
             }
-            return PyObject_IsTrue(st);
+            res = PyObject_IsTrue(st);
+            Py_DECREF(st);
+            return res;
         }
 
-        template<iterfunc iterf>
+        template<typename owner, iterfunc<owner> iterf>
         PyObject*
-        iter(object *self) {
+        iter(object<owner> *self) {
             return iterf(self->map);
         }
 
-        template<strict_func strict, iterfunc iter>
+        template<typename owner, strict_func strict, iterfunc<owner> iter>
         PyNumberMethods as_number = {
-            binop<strict, PyNumber_Add, iter>::f,       // nb_add
-            binop<strict, PyNumber_Subtract, iter>::f,  // nb_subtract
-            binop<strict, PyNumber_Multiply, iter>::f,  // nb_multiply
+            binop<owner, strict, PyNumber_Add, iter>::f,       // nb_add
+            binop<owner, strict, PyNumber_Subtract, iter>::f,  // nb_subtract
+            binop<owner, strict, PyNumber_Multiply, iter>::f,  // nb_multiply
 #if COMPILING_IN_PY2
             0,                                          // nb_divide
 #endif  // COMPILING_IN_PY2
@@ -482,28 +1265,31 @@ namespace sortedmap {
             0,                                          // nb_negative
             0,                                          // nb_positive
             0,                                          // nb_absolute
-            (inquiry) pybool<strict, iter>,             // nb_bool
+            (inquiry) pybool<owner, strict, iter>,      // nb_bool
             0,                                          // nb_invert
             0,                                          // nb_lshift
             0,                                          // nb_rshift
-            binop<strict, PyNumber_And, iter>::f,       // nb_and
-            binop<strict, PyNumber_Xor, iter>::f,       // nb_xor
-            binop<strict, PyNumber_Or, iter>::f,        // nb_or
+            binop<owner, strict, PyNumber_And, iter>::f,       // nb_and
+            binop<owner, strict, PyNumber_Xor, iter>::f,       // nb_xor
+            binop<owner, strict, PyNumber_Or, iter>::f,        // nb_or
         };
 
-        template<const char *&name, strict_func strict, iterfunc iterf>
+        template<typename owner,
+                 const char *&name,
+                 strict_func strict,
+                 iterfunc<owner> iterf>
         PyTypeObject type = {
             PyVarObject_HEAD_INIT(&PyType_Type, 0)
             name,                                       // tp_name
-            sizeof(object),                             // tp_basicsize
+            sizeof(object<owner>),                      // tp_basicsize
             0,                                          // tp_itemsize
-            (destructor) dealloc,                       // tp_dealloc
+            (destructor) dealloc<owner>,                // tp_dealloc
             0,                                          // tp_print
             0,                                          // tp_getattr
             0,                                          // tp_setattr
             0,                                          // tp_reserved
             (reprfunc) repr,                            // tp_repr
-            &as_number<strict, iterf>,                  // tp_as_number
+            &as_number<owner, strict, iterf>,           // tp_as_number
             0,                                          // tp_as_sequence
             0,                                          // tp_as_mapping
             0,                                          // tp_hash
@@ -517,37 +1303,42 @@ namespace sortedmap {
             0,                                          // tp_doc
             0,                                          // tp_traverse
             0,                                          // tp_clear
-            (richcmpfunc) richcompare<strict, iterf>,   // tp_richcompare
+            (richcmpfunc) richcompare<owner, strict, iterf>,
+                                                        // tp_richcompare
             0,                                          // tp_weaklistoffset
-            (getiterfunc) iter<iterf>,                  // tp_iter
+            (getiterfunc) iter<owner, iterf>,           // tp_iter
         };
     }
 
     namespace keyview {
-        using object = abstractview::object;
+        using object = abstractview::object<sortedmap::object>;
+
         viewfunc view;
         extern const char *name;
-        PyTypeObject type = abstractview::type<name,
+        PyTypeObject type = abstractview::type<sortedmap::object,
+                                               name,
                                                PySet_New,
                                                keyiter::iter>;
     }
 
     namespace valview {
-        using object = abstractview::object;
+        using object = abstractview::object<sortedmap::object>;
 
         viewfunc view;
         extern const char *name;
-        PyTypeObject type = abstractview::type<name,
+        PyTypeObject type = abstractview::type<sortedmap::object,
+                                               name,
                                                PySequence_List,
                                                valiter::iter>;
     }
 
     namespace itemview {
-        using object = abstractview::object;
+        using object = abstractview::object<sortedmap::object>;
 
         viewfunc view;
         extern const char *name;
-        PyTypeObject type = abstractview::type<name,
+        PyTypeObject type = abstractview::type<sortedmap::object,
+                                               name,
                                                PySet_New,
                                                itemiter::iter>;
     }
@@ -571,21 +1362,43 @@ namespace sortedmap {
 
     namespace meta {
         namespace partial {
+            // Build an instance of ``cls`` with the given ordering from the
+            // arguments to the partial. Each class using the metaclass
+            // provides one of these.
+            typedef PyObject *constructor(PyTypeObject *cls,
+                                          PyObject *keyfunc,
+                                          bool reverse,
+                                          const options &opts,
+                                          PyObject *args,
+                                          PyObject *kwargs);
+
             struct object {
                 PyObject_HEAD
                 OwnedRef<PyTypeObject> cls;
                 OwnedRef<PyObject> keyfunc;
+                bool reverse;
+                options opts;
+                constructor *construct;
+#if HAVE_VECTORCALL
+                vectorcallfunc vectorcall;
+#endif  // HAVE_VECTORCALL
             };
 
             void dealloc(object*);
-            sortedmap::object *call(object*, PyObject *args, PyObject *kwargs);
+            PyObject *call(object*, PyObject *args, PyObject *kwargs);
+#if HAVE_VECTORCALL
+            PyObject *vectorcall(PyObject*,
+                                 PyObject *const*,
+                                 size_t,
+                                 PyObject*);
+#endif  // HAVE_VECTORCALL
             PyObject *repr(object*);
             int traverse(object*, visitproc, void*);
-            void clear(object*);
+            int clear(object*);
 
             PyDoc_STRVAR(sortedmapmeta_partial_doc,
                          "Partial for the sortedmap class that applies\n"
-                         "a key function to new instances.\n");
+                         "a key function and ordering to new instances.\n");
 
             PyTypeObject type = {
                 PyVarObject_HEAD_INIT(&PyType_Type, 0)
@@ -593,7 +1406,11 @@ namespace sortedmap {
                 sizeof(object),                             // tp_basicsize
                 0,                                          // tp_itemsize
                 (destructor) dealloc,                       // tp_dealloc
+#if HAVE_VECTORCALL
+                offsetof(object, vectorcall),       // tp_vectorcall_offset
+#else
                 0,                                          // tp_print
+#endif  // HAVE_VECTORCALL
                 0,                                          // tp_getattr
                 0,                                          // tp_setattr
                 0,                                          // tp_reserved
@@ -607,13 +1424,21 @@ namespace sortedmap {
                 0,                                          // tp_getattro
                 0,                                          // tp_setattro
                 0,                                          // tp_as_buffer
-                Py_TPFLAGS_DEFAULT,                         // tp_flags
+                Py_TPFLAGS_DEFAULT |
+#if HAVE_VECTORCALL
+                Py_TPFLAGS_HAVE_VECTORCALL |
+#endif  // HAVE_VECTORCALL
+                Py_TPFLAGS_HAVE_GC,                         // tp_flags
                 sortedmapmeta_partial_doc,                  // tp_doc
                 (traverseproc) traverse,                    // tp_traverse
                 (inquiry) clear,                            // tp_clear
             };
         }
 
+        partial::object *newpartial(PyObject*,
+                                    PyObject*,
+                                    bool,
+                                    const options&);
         partial::object *getitem(PyObject*, PyObject*);
 
         PyMappingMethods as_mapping = {
@@ -690,6 +1515,18 @@ namespace sortedmap {
                  "it : iterable[key, value]\n"
                  "**kwargs\n"
                  "    The mappings to update this sortedmap with.\n");
+    PyDoc_STRVAR(absorb_doc,
+                 "Move every pair out of another sortedmap into this one.\n"
+                 "\n"
+                 "This is like ``self.update(other); other.clear()`` but\n"
+                 "frees each node of ``other`` as soon as its pair has\n"
+                 "been moved so the combined maps never hold both copies.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : sortedmap\n"
+                 "    The map to consume. Keys in ``other`` replace equal\n"
+                 "    keys in this map.\n");
     PyDoc_STRVAR(fromkeys_doc,
                  "Create a new sortedmap with keys from ``seq`` all mapping\n"
                  "to ``value``.\n"
@@ -704,6 +1541,54 @@ namespace sortedmap {
                  "-------\n"
                  "m : sortedmap\n"
                  "    The new sorted map object.\n");
+    PyDoc_STRVAR(configure_doc,
+                 "Specialize the sortedmap class.\n"
+                 "\n"
+                 "``sortedmap[keyfunc]`` is shorthand for\n"
+                 "``sortedmap.configure(keyfunc)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "keyfunc : callable, optional\n"
+                 "    The function applied to keys before comparing them.\n"
+                 "    ``operator.itemgetter`` and ``operator.attrgetter``\n"
+                 "    of a single item or attribute are applied without\n"
+                 "    calling back into Python.\n"
+                 "reverse : bool, optional\n"
+                 "    Store the keys in descending order. This defaults to\n"
+                 "    False.\n"
+                 "maxsize : int, optional\n"
+                 "    The most pairs to hold. Inserting past this evicts\n"
+                 "    a pair from the end chosen by ``evict`` and a new\n"
+                 "    key which would be evicted right away is dropped\n"
+                 "    after one comparison. None, the default, is no\n"
+                 "    limit.\n"
+                 "evict : {'first', 'last'}, optional\n"
+                 "    Which end to evict from when over ``maxsize``.\n"
+                 "    'first' keeps the largest keys and 'last' keeps\n"
+                 "    the smallest. This defaults to 'first'.\n"
+                 "index : bool, optional\n"
+                 "    Keep a hash index of the keys next to the tree so\n"
+                 "    that point lookups, assigning to an existing key and\n"
+                 "    ``pop`` cost one hash probe. The keys must be\n"
+                 "    hashable and compare equal exactly when neither\n"
+                 "    sorts before the other. This cannot be combined\n"
+                 "    with a ``keyfunc`` and defaults to False.\n"
+                 "aggregate : bool, optional\n"
+                 "    Keep a second tree next to the map which counts the\n"
+                 "    keys and sums the numbers under each node so that\n"
+                 "    ``count_range`` and ``aggregate`` make O(log(n))\n"
+                 "    comparisons and visit O(log(n)) nodes.\n"
+                 "    Each insert and erase also makes O(log(n))\n"
+                 "    comparisons in this tree, even when appending in\n"
+                 "    order. This needs libstdc++ and defaults to False.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "cls : callable\n"
+                 "    A callable which accepts the same arguments as the\n"
+                 "    class and returns new instances which use the given\n"
+                 "    ordering.\n");
     PyDoc_STRVAR(get_doc,
                  "Lookup a key in the sortedmap. If the key is not present\n"
                  "return ``default`` instead.\n"
@@ -760,6 +1645,45 @@ namespace sortedmap {
                  "------\n"
                  "KeyError\n"
                  "    Raised when the sortedmap is empty\n");
+    PyDoc_STRVAR(popitems_doc,
+                 "Remove up to ``n`` pairs from the front or back.\n"
+                 "\n"
+                 "This is equivalent to calling ``popitem(first)`` ``n``\n"
+                 "times but erases all of the pairs at once.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "n : int\n"
+                 "    The maximum number of pairs to remove.\n"
+                 "first : bool, optional\n"
+                 "    Should this remove the first pairs?\n"
+                 "    This defaults to True.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pairs : list[tuple[key, value]]\n"
+                 "    The removed pairs in the order they were popped. This\n"
+                 "    is ascending when ``first`` is True and descending\n"
+                 "    otherwise. There are fewer than ``n`` pairs when the\n"
+                 "    map was smaller than ``n``.\n");
+    PyDoc_STRVAR(iter_chunks_doc,
+                 "Iterate over the map in lists of up to ``n`` elements.\n"
+                 "\n"
+                 "This is equivalent to repeatedly calling ``next_n(n)`` on\n"
+                 "an iterator of the given kind until it is exhausted.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "n : int\n"
+                 "    The maximum number of elements in each chunk.\n"
+                 "kind : {'keys', 'values', 'items'}, optional\n"
+                 "    What to put in the chunks. This defaults to 'items'.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "chunks : iterator[list]\n"
+                 "    The elements in sorted order. Only the last chunk may\n"
+                 "    have fewer than ``n`` elements.\n");
     PyDoc_STRVAR(setdefault_doc,
                  "Set a default value for a key.\n"
                  "\n"
@@ -777,6 +1701,476 @@ namespace sortedmap {
                  "value : any\n"
                  "    The value for ``key``. This might not be ``default`` if\n"
                  "    ``key`` was already in the map.\n");
+    PyDoc_STRVAR(append_doc,
+                 "Insert a key which sorts after every key in the map.\n"
+                 "\n"
+                 "This only compares ``key`` against the last key so\n"
+                 "building a map from ascending keys costs one comparison\n"
+                 "per insert.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The new key.\n"
+                 "value : any\n"
+                 "    The value to store for ``key``.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised when ``key`` does not sort strictly after the\n"
+                 "    last key in the map. The map is not changed.\n");
+    PyDoc_STRVAR(floor_item_doc,
+                 "Find the pair with the greatest key less than or equal to\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The (key, value) pair found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(floor_key_doc,
+                 "Find the greatest key less than or equal to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The key found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(ceiling_item_doc,
+                 "Find the pair with the smallest key greater than or equal\n"
+                 "to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The (key, value) pair found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(ceiling_key_doc,
+                 "Find the smallest key greater than or equal to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The key found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(lower_item_doc,
+                 "Find the pair with the greatest key strictly less than\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The (key, value) pair found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(lower_key_doc,
+                 "Find the greatest key strictly less than ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The key found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(higher_item_doc,
+                 "Find the pair with the smallest key strictly greater than\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The (key, value) pair found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(higher_key_doc,
+                 "Find the smallest key strictly greater than ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "default : any, optional\n"
+                 "    The value to return if there is no such key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The key found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no ``default``\n"
+                 "    was given.\n");
+    PyDoc_STRVAR(first_item_doc,
+                 "Look at the first pair without removing it.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The smallest (key, value) pair.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the sortedmap is empty.\n");
+    PyDoc_STRVAR(first_key_doc,
+                 "Look at the first key without removing it.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The smallest key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the sortedmap is empty.\n");
+    PyDoc_STRVAR(last_item_doc,
+                 "Look at the last pair without removing it.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The largest (key, value) pair.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the sortedmap is empty.\n");
+    PyDoc_STRVAR(last_key_doc,
+                 "Look at the last key without removing it.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The largest key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the sortedmap is empty.\n");
+    PyDoc_STRVAR(count_range_doc,
+                 "Count the keys in the half-open range ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : any, optional\n"
+                 "    The first key to count. None starts at the\n"
+                 "    beginning of the map.\n"
+                 "hi : any, optional\n"
+                 "    The key to stop before. None runs to the end of\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "count : int\n"
+                 "    The number of keys in the range.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Finding the ends of the range makes O(log(n))\n"
+                 "comparisons and no comparisons are made inside the\n"
+                 "range; counting steps through the k nodes in it\n"
+                 "unless the map was configured with ``aggregate=True``,\n"
+                 "which counts the range in O(log(n)).\n");
+    PyDoc_STRVAR(remove_if_doc,
+                 "Remove the pairs in ``[lo, hi)`` matching a predicate.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "pred : callable[any, any] -> bool\n"
+                 "    Called with each key and value in the range. Pairs\n"
+                 "    for which this is true are removed.\n"
+                 "lo : any, optional\n"
+                 "    The first key to consider. None starts at the\n"
+                 "    beginning of the map.\n"
+                 "hi : any, optional\n"
+                 "    The key to stop before. None runs to the end of\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "removed : int\n"
+                 "    The number of pairs removed.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "``pred`` is called for the whole range before anything\n"
+                 "is removed, so if it raises the map is left unchanged.\n"
+                 "``pred`` may not change the size of the map.\n");
+    PyDoc_STRVAR(retain_if_doc,
+                 "Keep only the pairs in ``[lo, hi)`` matching a\n"
+                 "predicate, pairs outside of the range are untouched.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "pred : callable[any, any] -> bool\n"
+                 "    Called with each key and value in the range. Pairs\n"
+                 "    for which this is false are removed.\n"
+                 "lo : any, optional\n"
+                 "    The first key to consider. None starts at the\n"
+                 "    beginning of the map.\n"
+                 "hi : any, optional\n"
+                 "    The key to stop before. None runs to the end of\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "removed : int\n"
+                 "    The number of pairs removed.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "See ``remove_if``.\n");
+    PyDoc_STRVAR(map_values_doc,
+                 "Replace the values in ``[lo, hi)`` in place.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "func : callable[any] -> any, optional\n"
+                 "    Called with each value in the range, the value is\n"
+                 "    replaced with the result.\n"
+                 "lo : any, optional\n"
+                 "    The first key to consider. None starts at the\n"
+                 "    beginning of the map.\n"
+                 "hi : any, optional\n"
+                 "    The key to stop before. None runs to the end of\n"
+                 "    the map.\n"
+                 "mul : number, optional\n"
+                 "    Multiply each value by this instead of calling\n"
+                 "    ``func``.\n"
+                 "add : number, optional\n"
+                 "    Add this to each value, after multiplying by\n"
+                 "    ``mul``, instead of calling ``func``.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "This is ``for k in keys: m[k] = func(m[k])`` in one\n"
+                 "walk over the range. The keys are not touched so\n"
+                 "iterators over the map stay valid. ``mul`` and ``add``\n"
+                 "work on ints and floats without calling into Python.\n"
+                 "Every new value is computed before any are stored, so\n"
+                 "if ``func`` raises the map is left unchanged. ``func``\n"
+                 "may not change the size of the map.\n");
+    PyDoc_STRVAR(asof_doc,
+                 "Look up the value at or before each of many keys.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "keys : iterable[any]\n"
+                 "    The keys to look up, ideally in sorted order.\n"
+                 "default : any, optional\n"
+                 "    The value for keys before the first key in the\n"
+                 "    map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "values : list[any]\n"
+                 "    The value at the greatest key which is not\n"
+                 "    greater than each of ``keys``.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "This is ``[m.floor_item(k, (None, default))[1] for k\n"
+                 "in keys]`` in one walk over the map. Each search\n"
+                 "starts from the answer to the last one, so sorted\n"
+                 "keys make O(log(d)) comparisons for a distance of d\n"
+                 "entries. Unsorted keys give the same results but may\n"
+                 "search farther.\n");
+    PyDoc_STRVAR(finger_doc,
+                 "Create a finger for lookups near a position.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any, optional\n"
+                 "    Start at the first key which is not less than this.\n"
+                 "    None starts at the beginning of the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "finger : finger\n"
+                 "    An object with ``get``, ``seek``, ``[]`` and ``in``\n"
+                 "    which search outwards from the last key it found.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "A lookup d keys away from the finger makes O(log(d))\n"
+                 "comparisons, falling back to a search from the root\n"
+                 "when d is large. Changing the size of the map moves the\n"
+                 "finger back to the root for its next lookup.\n");
+    PyDoc_STRVAR(aggregate_doc,
+                 "Reduce the values of the keys in ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : any, optional\n"
+                 "    The first key to include. None starts at the\n"
+                 "    beginning of the map.\n"
+                 "hi : any, optional\n"
+                 "    The key to stop before. None runs to the end of\n"
+                 "    the map.\n"
+                 "op : {'sum', 'min', 'max', 'count'}, optional\n"
+                 "    The reduction to apply. ``sum`` adds the values\n"
+                 "    from left to right starting at 0, ``min`` and\n"
+                 "    ``max`` return the first smallest or largest value.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "result : any\n"
+                 "    The reduced value.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised for ``min`` or ``max`` of an empty range.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "This walks the k pairs in the range unless the map was\n"
+                 "configured with ``aggregate=True``. Then a range of\n"
+                 "ints and floats is reduced in O(log(n)) from the sums\n"
+                 "kept in that tree, and a sum holding floats is added in\n"
+                 "the tree's order, which may round differently from\n"
+                 "adding left to right. Ranges holding ints beyond\n"
+                 "2 ** 53 or other values are still walked.\n");
+    PyDoc_STRVAR(sizeof_doc,
+                 "Size of the sortedmap in memory in bytes, including the\n"
+                 "tree nodes but not the keys and values they refer to.\n");
+    PyDoc_STRVAR(memory_usage_doc,
+                 "Break down the memory held by this sortedmap.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "deep : bool, optional\n"
+                 "    Also count the size of the keys and values referenced\n"
+                 "    by the map. Each distinct object is counted once.\n"
+                 "    This defaults to False.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "usage : dict[str, int]\n"
+                 "    The bytes used by the ``object`` header, the tree\n"
+                 "    ``nodes``, the allocator ``slack`` rounding each node\n"
+                 "    up to its allocation size and the ``total``. Maps\n"
+                 "    with a hash index also include its buckets and\n"
+                 "    entries as ``index`` and maps configured with\n"
+                 "    ``aggregate=True`` include the nodes of that tree as\n"
+                 "    ``aggregate``. When ``deep`` is True this also\n"
+                 "    includes the ``keys`` and ``values``.\n");
+#ifdef SORTEDMAP_STATS
+    PyDoc_STRVAR(stats_doc,
+                 "Operation counters for this sortedmap.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "reset : bool, optional\n"
+                 "    Zero the counters after reading them.\n"
+                 "    This defaults to False.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "stats : dict[str, int]\n"
+                 "    The number of comparisons, keyfunc calls, emplaces,\n"
+                 "    erases, failed lookups, revision bumps and iterator\n"
+                 "    invalidations since the last reset along with the\n"
+                 "    current size and tree height.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "This method only exists when sortedmap is compiled with\n"
+                 "``SORTEDMAP_STATS`` defined.\n");
+#endif  // SORTEDMAP_STATS
 
     PyMethodDef methods[] = {
         {"keys", (PyCFunction) keyview::view, METH_NOARGS, keys_doc},
@@ -784,25 +2178,87 @@ namespace sortedmap {
         {"items", (PyCFunction) itemview::view, METH_NOARGS, items_doc},
         {"clear", (PyCFunction) pyclear, METH_NOARGS, clear_doc},
         {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
-        {"update", (PyCFunction) pyupdate,
-         METH_VARARGS | METH_KEYWORDS, update_doc},
+        {"update", FASTCALL(pyupdate), FASTCALL_FLAGS, update_doc},
+        {"absorb", (PyCFunction) absorb, METH_O, absorb_doc},
         {"fromkeys", (PyCFunction) pyfromkeys,
          METH_CLASS | METH_VARARGS | METH_KEYWORDS, fromkeys_doc},
-        {"get", (PyCFunction) pyget, METH_VARARGS | METH_KEYWORDS, get_doc},
-        {"pop", (PyCFunction) pypop, METH_VARARGS | METH_KEYWORDS, pop_doc},
-        {"popitem", (PyCFunction) pypopitem,
-         METH_VARARGS | METH_KEYWORDS, popitem_doc},
-        {"setdefault", (PyCFunction) pysetdefault,
-         METH_VARARGS | METH_KEYWORDS, setdefault_doc},
+        {"configure", (PyCFunction) configure,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, configure_doc},
+        {"get", FASTCALL(pyget), FASTCALL_FLAGS, get_doc},
+        {"pop", FASTCALL(pypop), FASTCALL_FLAGS, pop_doc},
+        {"popitem", FASTCALL(pypopitem), FASTCALL_FLAGS, popitem_doc},
+        {"popitems", (PyCFunction) pypopitems,
+         METH_VARARGS | METH_KEYWORDS, popitems_doc},
+        {"iter_chunks", (PyCFunction) iter_chunks,
+         METH_VARARGS | METH_KEYWORDS, iter_chunks_doc},
+        {"setdefault", FASTCALL(pysetdefault), FASTCALL_FLAGS,
+         setdefault_doc},
+        {"append", (PyCFunction) append, METH_VARARGS, append_doc},
+        {"floor_item", FASTCALL(floor_item), FASTCALL_FLAGS, floor_item_doc},
+        {"floor_key", FASTCALL(floor_key), FASTCALL_FLAGS, floor_key_doc},
+        {"ceiling_item", FASTCALL(ceiling_item), FASTCALL_FLAGS,
+         ceiling_item_doc},
+        {"ceiling_key", FASTCALL(ceiling_key), FASTCALL_FLAGS, ceiling_key_doc},
+        {"lower_item", FASTCALL(lower_item), FASTCALL_FLAGS, lower_item_doc},
+        {"lower_key", FASTCALL(lower_key), FASTCALL_FLAGS, lower_key_doc},
+        {"higher_item", FASTCALL(higher_item), FASTCALL_FLAGS, higher_item_doc},
+        {"higher_key", FASTCALL(higher_key), FASTCALL_FLAGS, higher_key_doc},
+        {"first_item", (PyCFunction) first_item, METH_NOARGS, first_item_doc},
+        {"first_key", (PyCFunction) first_key, METH_NOARGS, first_key_doc},
+        {"last_item", (PyCFunction) last_item, METH_NOARGS, last_item_doc},
+        {"last_key", (PyCFunction) last_key, METH_NOARGS, last_key_doc},
+        {"count_range", FASTCALL(count_range), FASTCALL_FLAGS,
+         count_range_doc},
+        {"aggregate", FASTCALL(aggregate), FASTCALL_FLAGS, aggregate_doc},
+        {"remove_if", FASTCALL(remove_if), FASTCALL_FLAGS, remove_if_doc},
+        {"retain_if", FASTCALL(retain_if), FASTCALL_FLAGS, retain_if_doc},
+        {"map_values", FASTCALL(map_values), FASTCALL_FLAGS, map_values_doc},
+        {"finger", FASTCALL(pyfinger), FASTCALL_FLAGS, finger_doc},
+        {"asof", FASTCALL(asof), FASTCALL_FLAGS, asof_doc},
+        {"__sizeof__", (PyCFunction) sizeof_, METH_NOARGS, sizeof_doc},
+        {"memory_usage", (PyCFunction) memory_usage,
+         METH_VARARGS | METH_KEYWORDS, memory_usage_doc},
+#ifdef SORTEDMAP_STATS
+        {"stats", (PyCFunction) pystats,
+         METH_VARARGS | METH_KEYWORDS, stats_doc},
+#endif  // SORTEDMAP_STATS
         {NULL},
     };
 
     PyObject *get_iter_revision(object*);
     PyObject *get_keyfunc(object*);
+    PyObject *get_reverse(object*);
+    PyObject *get_maxsize(object*);
+    PyObject *get_evict(object*);
+    PyObject *get_index(object*);
+    PyObject *get_journal(object*);
+    int set_journal(object*, PyObject*);
 
     PyDoc_STRVAR(keyfunc_doc,
                  "The key function used for comparing keys.\n"
                  "If no function was provided this returns None.\n");
+    PyDoc_STRVAR(reverse_doc,
+                 "Are the keys stored in descending order?\n");
+    PyDoc_STRVAR(maxsize_doc,
+                 "The most pairs this map holds, or None if unbounded.\n");
+    PyDoc_STRVAR(evict_doc,
+                 "The end evicted from when over ``maxsize``.\n");
+    PyDoc_STRVAR(index_doc,
+                 "Does this map keep a hash index of its keys?\n");
+    PyDoc_STRVAR(journal_doc,
+                 "The journal recording changes to this map, or None.\n"
+                 "\n"
+                 "Assigning an object with a ``record(op, key, value)``\n"
+                 "method attaches it. Every ``setitem``, ``del``, ``pop``,\n"
+                 "``popitem``, ``clear`` and the methods built on them\n"
+                 "call ``record`` before the map changes, and the change\n"
+                 "is not made if it raises. Methods which change many\n"
+                 "pairs at once pass a list of ``(op, key, value)``\n"
+                 "records to ``record_many`` when the journal has it, so\n"
+                 "that all of the records are taken or none are. Pairs\n"
+                 "evicted by ``maxsize`` are not recorded because\n"
+                 "replaying the journal into a map with the same options\n"
+                 "evicts them again. Assign None to detach the journal.\n");
 
     // not using a member because object has a non standard layout
     PyGetSetDef getsets[] = {
@@ -811,6 +2267,31 @@ namespace sortedmap {
          NULL,
          keyfunc_doc,
          NULL},
+        {(char*) "reverse",
+         (getter) get_reverse,
+         NULL,
+         reverse_doc,
+         NULL},
+        {(char*) "maxsize",
+         (getter) get_maxsize,
+         NULL,
+         maxsize_doc,
+         NULL},
+        {(char*) "evict",
+         (getter) get_evict,
+         NULL,
+         evict_doc,
+         NULL},
+        {(char*) "index",
+         (getter) get_index,
+         NULL,
+         index_doc,
+         NULL},
+        {(char*) "journal",
+         (getter) get_journal,
+         (setter) set_journal,
+         journal_doc,
+         NULL},
         {(char*) "_iter_revision",
          (getter) get_iter_revision,
          NULL,
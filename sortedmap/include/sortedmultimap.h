@@ -0,0 +1,357 @@
+#pragma once
+#include <map>
+
+#include "sortedmap.h"
+
+// A sorted map which may hold many values for the same key. This shares the
+// comparator, iterators, views and metaclass with ``sortedmap``.
+namespace sortedmultimap {
+    using sortedmap::Comparator;
+    using sortedmap::counters;
+
+    using maptype = std::multimap<OwnedRef<PyObject>,
+                                  OwnedRef<PyObject>,
+                                  Comparator>;
+
+    struct object {
+        using container = maptype;
+
+        PyObject_HEAD
+        maptype map;
+        // Keep track of operations that may invalidate any iterators.
+        unsigned long iter_revision;
+        counters stats;
+
+        static const char *kind() {
+            return "sortedmultimap";
+        }
+    };
+
+    inline void
+    bump_revision(object *self) {
+        ++self->iter_revision;
+        STAT_INC(&self->stats, revision_bumps);
+    }
+
+    bool check(PyObject*);
+
+    typedef PyObject *iterfunc(object*);
+    typedef PyObject *viewfunc(object*);
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    PyObject *construct(PyTypeObject*,
+                        PyObject*,
+                        bool,
+                        const sortedmap::options&,
+                        PyObject*,
+                        PyObject*);
+    int init(object*, PyObject*, PyObject*);
+    void dealloc(object*);
+    int traverse(object*, visitproc, void*);
+    int clear(object*);
+    PyObject *pyclear(object*);
+    PyObject *richcompare(object*, PyObject*, int);
+    Py_ssize_t len(object*);
+    PyObject *getitem(object*, PyObject*);
+    int setitem(object*, PyObject*, PyObject*);
+    int contains(object*, PyObject*);
+    PyObject *add(object*, PyObject*);
+    PyObject *count(object*, PyObject*);
+    PyObject *equal_range(object*, PyObject*);
+    PyObject *popitem(object*, PyObject*, PyObject*);
+    PyObject *repr(object*);
+    object *copy(object*);
+    bool update(object*, PyObject*, PyObject*);
+    PyObject *pyupdate(object*, PyObject*, PyObject*);
+    PyObject *get_iter_revision(object*);
+    PyObject *get_keyfunc(object*);
+    PyObject *get_reverse(object*);
+
+    namespace keyiter {
+        using object = sortedmap::abstractiter::object<sortedmultimap::object>;
+        using itertype =
+            sortedmap::abstractiter::itertype<sortedmultimap::object>;
+
+        sortedmap::abstractiter::extract_element<sortedmultimap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type =
+            sortedmap::abstractiter::type<sortedmultimap::object, name, elem>;
+    }
+
+    namespace valiter {
+        using object = sortedmap::abstractiter::object<sortedmultimap::object>;
+        using itertype =
+            sortedmap::abstractiter::itertype<sortedmultimap::object>;
+
+        sortedmap::abstractiter::extract_element<sortedmultimap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type =
+            sortedmap::abstractiter::type<sortedmultimap::object, name, elem>;
+    }
+
+    namespace itemiter {
+        using object = sortedmap::abstractiter::object<sortedmultimap::object>;
+        using itertype =
+            sortedmap::abstractiter::itertype<sortedmultimap::object>;
+
+        sortedmap::abstractiter::extract_element<sortedmultimap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            sortedmultimap::object,
+            name,
+            elem,
+            sortedmap::abstractiter::next_item<sortedmultimap::object>>;
+    }
+
+    // Keys repeat so all of the views are list-like.
+    namespace keyview {
+        using object = sortedmap::abstractview::object<sortedmultimap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            sortedmultimap::object,
+            name,
+            PySequence_List,
+            keyiter::iter>;
+    }
+
+    namespace valview {
+        using object = sortedmap::abstractview::object<sortedmultimap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            sortedmultimap::object,
+            name,
+            PySequence_List,
+            valiter::iter>;
+    }
+
+    namespace itemview {
+        using object = sortedmap::abstractview::object<sortedmultimap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            sortedmultimap::object,
+            name,
+            PySequence_List,
+            itemiter::iter>;
+    }
+
+    PySequenceMethods as_sequence = {
+        0,                                          // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyMappingMethods as_mapping = {
+        (lenfunc) len,                              // mp_length
+        (binaryfunc) getitem,                       // mp_subscript
+        (objobjargproc) setitem,                    // mp_ass_subscript
+    };
+
+    PyDoc_STRVAR(keys_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "v : key_view\n"
+                 "    A list-like object providing a view on the map's\n"
+                 "    keys. A key appears once for each of its values.\n");
+    PyDoc_STRVAR(values_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "v : value_view\n"
+                 "    A list-like object providing a view on the map's\n"
+                 "    values.\n");
+    PyDoc_STRVAR(items_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "v : item_view\n"
+                 "    A list-like object providing a view on the map's\n"
+                 "    items.\n");
+    PyDoc_STRVAR(clear_doc,
+                 "Remove all items from the map.");
+    PyDoc_STRVAR(copy_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "copy : sortedmultimap\n"
+                 "    A shallow copy of this sortedmultimap.\n");
+    PyDoc_STRVAR(update_doc,
+                 "Add every pair from a mapping or iterable.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "it : iterable[key, value]\n"
+                 "**kwargs\n"
+                 "    The pairs to add. Existing values are kept, pairs\n"
+                 "    with a key already in the map are added after the\n"
+                 "    values already stored for that key.\n");
+    PyDoc_STRVAR(add_doc,
+                 "Add a value for a key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to add the value under.\n"
+                 "value : any\n"
+                 "    The value to add. This is placed after any values\n"
+                 "    already stored for ``key``.\n");
+    PyDoc_STRVAR(count_doc,
+                 "Count the values stored for a key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to look up.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "count : int\n"
+                 "    The number of values stored for ``key``.\n");
+    PyDoc_STRVAR(equal_range_doc,
+                 "Look up every pair with a key equal to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to look up.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "items : list[(key, value)]\n"
+                 "    The pairs in the order they were added. This is\n"
+                 "    empty if ``key`` is not in the map.\n");
+    PyDoc_STRVAR(popitem_doc,
+                 "Remove and return the first or last pair.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "first : bool, optional\n"
+                 "    Pop the first pair instead of the last one.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "item : (key, value)\n"
+                 "    The removed pair.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the map is empty.\n");
+    PyDoc_STRVAR(configure_doc,
+                 "Specialize the sortedmultimap class.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "keyfunc : callable, optional\n"
+                 "    The key function used for comparing keys.\n"
+                 "reverse : bool, optional\n"
+                 "    Store the keys in descending order.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "cls : callable\n"
+                 "    A callable which constructs sortedmultimaps with the\n"
+                 "    given ordering.\n");
+
+    PyMethodDef methods[] = {
+        {"keys", (PyCFunction) keyview::view, METH_NOARGS, keys_doc},
+        {"values", (PyCFunction) valview::view, METH_NOARGS, values_doc},
+        {"items", (PyCFunction) itemview::view, METH_NOARGS, items_doc},
+        {"clear", (PyCFunction) pyclear, METH_NOARGS, clear_doc},
+        {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"update", (PyCFunction) pyupdate,
+         METH_VARARGS | METH_KEYWORDS, update_doc},
+        {"add", (PyCFunction) add, METH_VARARGS, add_doc},
+        {"count", (PyCFunction) count, METH_O, count_doc},
+        {"equal_range", (PyCFunction) equal_range, METH_O, equal_range_doc},
+        {"popitem", (PyCFunction) popitem,
+         METH_VARARGS | METH_KEYWORDS, popitem_doc},
+        {"configure", (PyCFunction) sortedmap::configure,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, configure_doc},
+        {NULL},
+    };
+
+    // not using a member because object has a non standard layout
+    PyGetSetDef getsets[] = {
+        {(char*) "keyfunc",
+         (getter) get_keyfunc,
+         NULL,
+         sortedmap::keyfunc_doc,
+         NULL},
+        {(char*) "reverse",
+         (getter) get_reverse,
+         NULL,
+         sortedmap::reverse_doc,
+         NULL},
+        {(char*) "_iter_revision",
+         (getter) get_iter_revision,
+         NULL,
+         sortedmap::iter_revision_doc,
+         NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(sortedmultimap_doc,
+                 "A sorted mapping which may hold many values per key.\n"
+                 "\n"
+                 "Values for equal keys are kept in the order they were\n"
+                 "added.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "mapping : mapping or iterable[key, value]\n"
+                 "**kwargs\n"
+                 "    The initial pairs.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&sortedmap::meta::type, 0)
+        "sortedmap.sortedmultimap",                 // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        0,                                          // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        &as_mapping,                                // tp_as_mapping
+        0,                                          // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                         // tp_flags
+        sortedmultimap_doc,                         // tp_doc
+        (traverseproc) traverse,                    // tp_traverse
+        (inquiry) clear,                            // tp_clear
+        (richcmpfunc) richcompare,                  // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) keyiter::iter,                // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        (initproc) init,                            // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
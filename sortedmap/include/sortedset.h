@@ -0,0 +1,469 @@
+#pragma once
+#include <set>
+
+#include "sortedmap.h"
+
+// A sorted set of keys. The nodes hold only the key so this is smaller than
+// a sortedmap with ``None`` values. This shares the comparator, iterators
+// and metaclass with ``sortedmap``.
+namespace sortedset {
+    using sortedmap::Comparator;
+    using sortedmap::counters;
+
+    using settype = std::set<OwnedRef<PyObject>, Comparator>;
+
+    struct object {
+        using container = settype;
+
+        PyObject_HEAD
+        // named ``map`` to share the iterator templates with sortedmap
+        settype map;
+        // Keep track of operations that may invalidate any iterators.
+        unsigned long iter_revision;
+        counters stats;
+
+        static const char *kind() {
+            return "sortedset";
+        }
+    };
+
+    inline void
+    bump_revision(object *self) {
+        ++self->iter_revision;
+        STAT_INC(&self->stats, revision_bumps);
+    }
+
+    bool check(PyObject*);
+
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    PyObject *construct(PyTypeObject*,
+                        PyObject*,
+                        bool,
+                        const sortedmap::options&,
+                        PyObject*,
+                        PyObject*);
+    int init(object*, PyObject*, PyObject*);
+    void dealloc(object*);
+    int traverse(object*, visitproc, void*);
+    int clear(object*);
+    PyObject *pyclear(object*);
+    PyObject *richcompare(object*, PyObject*, int);
+    Py_ssize_t len(object*);
+    int contains(object*, PyObject*);
+    PyObject *add(object*, PyObject*);
+    PyObject *discard(object*, PyObject*);
+    PyObject *remove(object*, PyObject*);
+    PyObject *pop(object*, PyObject*, PyObject*);
+    PyObject *update(object*, PyObject*);
+    PyObject *repr(object*);
+    object *copy(object*);
+    PyObject *floor(object*, PyObject*);
+    PyObject *ceiling(object*, PyObject*);
+    PyObject *lower(object*, PyObject*);
+    PyObject *higher(object*, PyObject*);
+    PyObject *first(object*);
+    PyObject *last(object*);
+    PyObject *range(object*, PyObject*, PyObject*);
+    PyObject *union_(object*, PyObject*);
+    PyObject *intersection(object*, PyObject*);
+    PyObject *difference(object*, PyObject*);
+    PyObject *symmetric_difference(object*, PyObject*);
+    PyObject *issubset(object*, PyObject*);
+    PyObject *issuperset(object*, PyObject*);
+    PyObject *isdisjoint(object*, PyObject*);
+    PyObject *or_(PyObject*, PyObject*);
+    PyObject *and_(PyObject*, PyObject*);
+    PyObject *sub(PyObject*, PyObject*);
+    PyObject *xor_(PyObject*, PyObject*);
+    PyObject *sizeof_(object*);
+    PyObject *memory_usage(object*, PyObject*, PyObject*);
+    PyObject *get_iter_revision(object*);
+    PyObject *get_keyfunc(object*);
+    PyObject *get_reverse(object*);
+
+    namespace iter {
+        using object = sortedmap::abstractiter::object<sortedset::object>;
+        using itertype = sortedmap::abstractiter::itertype<sortedset::object>;
+
+        sortedmap::abstractiter::extract_element<sortedset::object> elem;
+        PyObject *iter(sortedset::object*);
+        extern const char *name;
+        PyTypeObject type =
+            sortedmap::abstractiter::type<sortedset::object, name, elem>;
+    }
+
+    PySequenceMethods as_sequence = {
+        (lenfunc) len,                              // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyNumberMethods as_number = {
+        0,                                          // nb_add
+        sub,                                        // nb_subtract
+        0,                                          // nb_multiply
+#if COMPILING_IN_PY2
+        0,                                          // nb_divide
+#endif  // COMPILING_IN_PY2
+        0,                                          // nb_remainder
+        0,                                          // nb_divmod
+        0,                                          // nb_power
+        0,                                          // nb_negative
+        0,                                          // nb_positive
+        0,                                          // nb_absolute
+        0,                                          // nb_bool
+        0,                                          // nb_invert
+        0,                                          // nb_lshift
+        0,                                          // nb_rshift
+        and_,                                       // nb_and
+        xor_,                                       // nb_xor
+        or_,                                        // nb_or
+    };
+
+    PyDoc_STRVAR(clear_doc,
+                 "Remove all keys from the set.");
+    PyDoc_STRVAR(copy_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "copy : sortedset\n"
+                 "    A shallow copy of this sortedset.\n");
+    PyDoc_STRVAR(add_doc,
+                 "Add a key to the set.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to add. This does nothing if an equal key is\n"
+                 "    already in the set.\n");
+    PyDoc_STRVAR(discard_doc,
+                 "Remove a key from the set if it is present.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to remove.\n");
+    PyDoc_STRVAR(remove_doc,
+                 "Remove a key from the set.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to remove.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when ``key`` is not in the set.\n");
+    PyDoc_STRVAR(pop_doc,
+                 "Remove and return the first or last key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "first : bool, optional\n"
+                 "    Pop the first key instead of the last one.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "key : any\n"
+                 "    The removed key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the set is empty.\n");
+    PyDoc_STRVAR(update_doc,
+                 "Add every key of an iterable.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "it : iterable\n"
+                 "    The keys to add.\n");
+    PyDoc_STRVAR(floor_doc,
+                 "Find the greatest key less than or equal to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search around.\n"
+                 "default : any, optional\n"
+                 "    The value to return when there is no such key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no default.\n");
+    PyDoc_STRVAR(ceiling_doc,
+                 "Find the smallest key greater than or equal to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search around.\n"
+                 "default : any, optional\n"
+                 "    The value to return when there is no such key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no default.\n");
+    PyDoc_STRVAR(lower_doc,
+                 "Find the greatest key strictly less than ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search around.\n"
+                 "default : any, optional\n"
+                 "    The value to return when there is no such key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no default.\n");
+    PyDoc_STRVAR(higher_doc,
+                 "Find the smallest key strictly greater than ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search around.\n"
+                 "default : any, optional\n"
+                 "    The value to return when there is no such key.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key and no default.\n");
+    PyDoc_STRVAR(first_doc,
+                 "Return the first key without removing it.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the set is empty.\n");
+    PyDoc_STRVAR(last_doc,
+                 "Return the last key without removing it.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the set is empty.\n");
+    PyDoc_STRVAR(range_doc,
+                 "Return the keys in the half-open range ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : any, optional\n"
+                 "    The first key to include. None starts at the\n"
+                 "    beginning of the set.\n"
+                 "hi : any, optional\n"
+                 "    The key to stop before. None runs to the end of\n"
+                 "    the set.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "keys : list\n"
+                 "    The keys in the range, in order.\n");
+    PyDoc_STRVAR(union_doc,
+                 "Return the keys in this set or ``other``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : iterable\n"
+                 "    The keys to combine with.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "result : sortedset\n"
+                 "    A new set with the ordering of this set.\n");
+    PyDoc_STRVAR(intersection_doc,
+                 "Return the keys in both this set and ``other``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : iterable\n"
+                 "    The keys to intersect with.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "result : sortedset\n"
+                 "    A new set with the ordering of this set.\n");
+    PyDoc_STRVAR(difference_doc,
+                 "Return the keys in this set but not in ``other``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : iterable\n"
+                 "    The keys to leave out.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "result : sortedset\n"
+                 "    A new set with the ordering of this set.\n");
+    PyDoc_STRVAR(symmetric_difference_doc,
+                 "Return the keys in exactly one of this set and ``other``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : iterable\n"
+                 "    The keys to compare with.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "result : sortedset\n"
+                 "    A new set with the ordering of this set.\n");
+    PyDoc_STRVAR(issubset_doc,
+                 "Is every key of this set in ``other``?\n");
+    PyDoc_STRVAR(issuperset_doc,
+                 "Is every key of ``other`` in this set?\n");
+    PyDoc_STRVAR(isdisjoint_doc,
+                 "Do this set and ``other`` have no keys in common?\n");
+    PyDoc_STRVAR(sizeof_doc,
+                 "Size of the sortedset in memory in bytes, including the\n"
+                 "tree nodes but not the keys they refer to.\n");
+    PyDoc_STRVAR(memory_usage_doc,
+                 "Break down the memory held by this sortedset.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "deep : bool, optional\n"
+                 "    Also count the size of the keys referenced by the\n"
+                 "    set. Each distinct object is counted once.\n"
+                 "    This defaults to False.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "usage : dict[str, int]\n"
+                 "    The bytes used by the ``object`` header, the tree\n"
+                 "    ``nodes``, the allocator ``slack`` rounding each node\n"
+                 "    up to its allocation size and the ``total``. When\n"
+                 "    ``deep`` is True this also includes the ``keys``.\n");
+    PyDoc_STRVAR(configure_doc,
+                 "Specialize the sortedset class.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "keyfunc : callable, optional\n"
+                 "    The key function used for comparing keys.\n"
+                 "reverse : bool, optional\n"
+                 "    Store the keys in descending order.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "cls : callable\n"
+                 "    A callable which constructs sortedsets with the\n"
+                 "    given ordering.\n");
+
+    PyMethodDef methods[] = {
+        {"clear", (PyCFunction) pyclear, METH_NOARGS, clear_doc},
+        {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"add", (PyCFunction) add, METH_O, add_doc},
+        {"discard", (PyCFunction) discard, METH_O, discard_doc},
+        {"remove", (PyCFunction) remove, METH_O, remove_doc},
+        {"pop", (PyCFunction) pop, METH_VARARGS | METH_KEYWORDS, pop_doc},
+        {"update", (PyCFunction) update, METH_O, update_doc},
+        {"floor", (PyCFunction) floor, METH_VARARGS, floor_doc},
+        {"ceiling", (PyCFunction) ceiling, METH_VARARGS, ceiling_doc},
+        {"lower", (PyCFunction) lower, METH_VARARGS, lower_doc},
+        {"higher", (PyCFunction) higher, METH_VARARGS, higher_doc},
+        {"first", (PyCFunction) first, METH_NOARGS, first_doc},
+        {"last", (PyCFunction) last, METH_NOARGS, last_doc},
+        {"range", (PyCFunction) range,
+         METH_VARARGS | METH_KEYWORDS, range_doc},
+        {"union", (PyCFunction) union_, METH_O, union_doc},
+        {"intersection", (PyCFunction) intersection, METH_O,
+         intersection_doc},
+        {"difference", (PyCFunction) difference, METH_O, difference_doc},
+        {"symmetric_difference", (PyCFunction) symmetric_difference, METH_O,
+         symmetric_difference_doc},
+        {"issubset", (PyCFunction) issubset, METH_O, issubset_doc},
+        {"issuperset", (PyCFunction) issuperset, METH_O, issuperset_doc},
+        {"isdisjoint", (PyCFunction) isdisjoint, METH_O, isdisjoint_doc},
+        {"__sizeof__", (PyCFunction) sizeof_, METH_NOARGS, sizeof_doc},
+        {"memory_usage", (PyCFunction) memory_usage,
+         METH_VARARGS | METH_KEYWORDS, memory_usage_doc},
+        {"configure", (PyCFunction) sortedmap::configure,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, configure_doc},
+        {NULL},
+    };
+
+    // not using a member because object has a non standard layout
+    PyGetSetDef getsets[] = {
+        {(char*) "keyfunc",
+         (getter) get_keyfunc,
+         NULL,
+         sortedmap::keyfunc_doc,
+         NULL},
+        {(char*) "reverse",
+         (getter) get_reverse,
+         NULL,
+         sortedmap::reverse_doc,
+         NULL},
+        {(char*) "_iter_revision",
+         (getter) get_iter_revision,
+         NULL,
+         sortedmap::iter_revision_doc,
+         NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(sortedset_doc,
+                 "A sorted set that does not use hashing.\n"
+                 "\n"
+                 "Set operations between sortedsets with the same ordering\n"
+                 "merge the two sets in linear time.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "it : iterable, optional\n"
+                 "    The initial keys.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&sortedmap::meta::type, 0)
+        "sortedmap.sortedset",                      // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        &as_number,                                 // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        0,                                          // tp_as_mapping
+        0,                                          // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_CHECKTYPES |
+        Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                         // tp_flags
+        sortedset_doc,                              // tp_doc
+        (traverseproc) traverse,                    // tp_traverse
+        (inquiry) clear,                            // tp_clear
+        (richcmpfunc) richcompare,                  // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) iter::iter,                   // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        (initproc) init,                            // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
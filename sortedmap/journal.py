@@ -0,0 +1,244 @@
+"""Incremental persistence for sortedmaps.
+
+A ``journal`` attached to a map with ``m.journal = j`` appends a record to a
+log file for every change made to the map. ``snapshot`` writes out a whole
+map and ``recover`` rebuilds one by loading the last snapshot and replaying
+the journal written after it. A checkpoint only has to write the changes
+since the last one instead of the whole map.
+
+Each record is a small header holding the operation, the payload length and
+a CRC32 of the payload, followed by the pickled key and value. A record torn
+by a crash fails its check and ends the replay.
+"""
+import os
+import pickle
+import struct
+import threading
+import zlib
+
+from ._sortedmap import sortedmap
+
+
+# These match ``sortedmap::journal_op``.
+SET = 0
+ERASE = 1
+CLEAR = 2
+
+_HEADER = struct.Struct('<BII')  # op, payload length, crc32 of payload
+_PROTOCOL = pickle.HIGHEST_PROTOCOL
+
+
+def _encode(op, key, value):
+    if op == SET:
+        payload = pickle.dumps((key, value), _PROTOCOL)
+    elif op == ERASE:
+        payload = pickle.dumps(key, _PROTOCOL)
+    else:
+        payload = b''
+    return _HEADER.pack(op, len(payload), zlib.crc32(payload) & 0xffffffff) \
+        + payload
+
+
+def _records(f):
+    """Read the intact records from a file.
+
+    Yields
+    ------
+    op : int
+        The operation.
+    payload : bytes
+        The pickled key, or key and value.
+    end : int
+        The offset just past this record.
+    """
+    end = 0
+    while True:
+        header = f.read(_HEADER.size)
+        if len(header) < _HEADER.size:
+            return
+        op, length, crc = _HEADER.unpack(header)
+        payload = f.read(length)
+        if (op > CLEAR or
+                len(payload) < length or
+                zlib.crc32(payload) & 0xffffffff != crc):
+            return
+        end += _HEADER.size + length
+        yield op, payload, end
+
+
+def _replay(m, path):
+    try:
+        f = open(path, 'rb')
+    except IOError:
+        return
+    with f:
+        for op, payload, _ in _records(f):
+            if op == SET:
+                key, value = pickle.loads(payload)
+                m[key] = value
+            elif op == ERASE:
+                m.pop(pickle.loads(payload), None)
+            else:
+                m.clear()
+
+
+def snapshot(m, path):
+    """Write every pair in a map to a snapshot file.
+
+    Parameters
+    ----------
+    m : sortedmap
+        The map to write.
+    path : str
+        The file to write. This is replaced atomically so an interrupted
+        snapshot leaves the previous one in place.
+    """
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        for chunk in m.iter_chunks(1024):
+            f.write(b''.join(_encode(SET, key, value) for key, value in chunk))
+        f.flush()
+        os.fsync(f.fileno())
+    os.rename(tmp, path)
+
+
+def recover(snapshot, journal, cls=sortedmap):
+    """Rebuild a map from its last snapshot and the journal written since.
+
+    Parameters
+    ----------
+    snapshot : str or None
+        The snapshot file. If this is None or does not exist the replay
+        starts from an empty map.
+    journal : str
+        The journal file. Replay stops at the first incomplete record.
+    cls : callable, optional
+        The ``sortedmap`` class to rebuild, for example
+        ``sortedmap.configure(maxsize=n)``. This should match the options of
+        the journaled map.
+
+    Returns
+    -------
+    m : sortedmap
+        The recovered map.
+
+    Notes
+    -----
+    Replaying a journal over a snapshot which already includes some of its
+    changes gives the same map, so a crash between writing a snapshot and
+    truncating the journal is safe.
+    """
+    m = cls()
+    if snapshot is not None:
+        _replay(m, snapshot)
+    _replay(m, journal)
+    return m
+
+
+class journal(object):
+    """An append only log of changes to sortedmaps.
+
+    Parameters
+    ----------
+    path : str
+        The log file. An existing journal is appended to after dropping any
+        incomplete record at its end.
+    batch_size : int, optional
+        The number of records buffered in memory before they are written to
+        the file together.
+    sync : bool, optional
+        Call ``fsync`` once per written batch so that a group of records is
+        durable for the cost of a single sync.
+
+    Notes
+    -----
+    Records still buffered are lost in a crash. Call ``commit`` to write them
+    out at a point which must survive one.
+    """
+    def __init__(self, path, batch_size=1024, sync=True):
+        if batch_size < 1:
+            raise ValueError('batch_size must be positive')
+
+        self.path = path
+        self.batch_size = batch_size
+        self.sync = sync
+        self._buffer = []
+        self._lock = threading.RLock()
+
+        end = 0
+        try:
+            with open(path, 'rb') as f:
+                for _, _, end in _records(f):
+                    pass
+        except IOError:
+            pass
+        self._file = open(path, 'ab')
+        if self._file.tell() != end:
+            # a crash tore the last record, new records must follow the last
+            # complete one to be replayed
+            self._file.truncate(end)
+
+    def record(self, op, key, value):
+        """Append a change. This is called by the journaled maps.
+        """
+        data = _encode(op, key, value)
+        with self._lock:
+            self._buffer.append(data)
+            if len(self._buffer) >= self.batch_size:
+                self.commit()
+
+    def record_many(self, records):
+        """Append a batch of ``(op, key, value)`` changes. Every record is
+        encoded before any is buffered so either all of them are appended or
+        none are.
+        """
+        data = [_encode(op, key, value) for op, key, value in records]
+        with self._lock:
+            self._buffer.extend(data)
+            if len(self._buffer) >= self.batch_size:
+                self.commit()
+
+    def commit(self):
+        """Write out the buffered records and sync them to disk.
+        """
+        with self._lock:
+            buffer, self._buffer = self._buffer, []
+            if buffer:
+                self._file.write(b''.join(buffer))
+                self._file.flush()
+                if self.sync:
+                    os.fsync(self._file.fileno())
+
+    def checkpoint(self, m, path):
+        """Snapshot a map and empty the journal.
+
+        Parameters
+        ----------
+        m : sortedmap
+            The journaled map.
+        path : str
+            The snapshot file to write.
+        """
+        with self._lock:
+            self.commit()
+            snapshot(m, path)
+            self._file.truncate(0)
+            self._file.flush()
+            if self.sync:
+                os.fsync(self._file.fileno())
+
+    def close(self):
+        """Commit the buffered records and close the file.
+        """
+        if not self._file.closed:
+            self.commit()
+            self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def __repr__(self):
+        return '%s(%r)' % (type(self).__name__, self.path)
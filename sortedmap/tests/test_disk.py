@@ -0,0 +1,196 @@
+import os
+import random
+
+import pytest
+
+from sortedmap import sortedmap
+from sortedmap.disk import diskmap
+
+
+def runs(path):
+    return sorted(n for n in os.listdir(str(path)) if n.startswith('run-'))
+
+
+def test_memtable_only(tmpdir):
+    m = diskmap(str(tmpdir))
+    m['b'] = 1
+    m['a'] = 2
+    assert m['a'] == 2
+    assert m.get('c') is None
+    assert 'b' in m
+    assert list(m) == ['a', 'b']
+    assert len(m) == 2
+    del m['a']
+    assert 'a' not in m
+    with pytest.raises(KeyError):
+        m['a']
+    with pytest.raises(KeyError):
+        del m['a']
+    assert runs(tmpdir) == []
+
+
+def test_flush_and_merge(tmpdir):
+    m = diskmap(str(tmpdir), memtable_size=4, max_runs=100)
+    expected = {}
+    for n in range(20):
+        m[n] = n * 10
+        expected[n] = n * 10
+    assert len(runs(tmpdir)) == 5
+
+    # newer writes and deletes shadow the flushed runs
+    m[3] = 'new'
+    expected[3] = 'new'
+    for n in (0, 5, 6, 19):
+        del m[n]
+        del expected[n]
+    assert m.pop(7) == 70
+    del expected[7]
+    assert m.pop(7, 'default') == 'default'
+
+    assert list(m.items()) == sorted(expected.items())
+    assert len(m) == len(expected)
+    for n in range(25):
+        assert m.get(n, 'missing') == expected.get(n, 'missing')
+        assert (n in m) == (n in expected)
+
+
+def test_range_queries(tmpdir):
+    m = diskmap(str(tmpdir), memtable_size=3, max_runs=100, block_size=2)
+    for n in range(0, 40, 2):
+        m[n] = -n
+    del m[10]
+
+    assert list(m.keys(5, 15)) == [6, 8, 12, 14]
+    assert list(m.values(30)) == [-30, -32, -34, -36, -38]
+    assert list(m.items(hi=5)) == [(0, 0), (2, -2), (4, -4)]
+    assert m.count_range(9, 13) == 1
+    assert m.first_item() == (0, 0)
+    assert m.ceiling_item(9) == (12, -12)
+    assert m.ceiling_item(12) == (12, -12)
+    assert m.higher_item(12) == (14, -14)
+    assert m.higher_item(38, None) is None
+    with pytest.raises(KeyError):
+        m.ceiling_item(39)
+
+
+def test_reopen(tmpdir):
+    with diskmap(str(tmpdir), memtable_size=5) as m:
+        for n in range(12):
+            m[n] = str(n)
+        del m[4]
+
+    with diskmap(str(tmpdir)) as m:
+        assert list(m.keys()) == [n for n in range(12) if n != 4]
+        assert m[11] == '11'
+
+
+def test_compact(tmpdir):
+    m = diskmap(str(tmpdir), memtable_size=4, max_runs=100)
+    for n in range(16):
+        m[n] = n
+    for n in range(0, 16, 2):
+        del m[n]
+    m.flush()
+    assert len(runs(tmpdir)) == 6
+
+    m.compact()
+    assert len(runs(tmpdir)) == 1
+    assert list(m) == list(range(1, 16, 2))
+
+    for n in range(1, 16, 2):
+        del m[n]
+    m.flush()
+    m.compact()
+    assert runs(tmpdir) == []
+    assert list(m) == []
+    m.close()
+
+
+@pytest.mark.parametrize('background', [True, False])
+def test_automatic_compaction(tmpdir, background):
+    m = diskmap(
+        str(tmpdir),
+        memtable_size=8,
+        max_runs=3,
+        background=background,
+    )
+    expected = sortedmap()
+    rand = random.Random(0)
+    for _ in range(500):
+        key = rand.randrange(100)
+        if key in expected and rand.random() < 0.3:
+            del m[key]
+            del expected[key]
+        else:
+            m[key] = expected[key] = rand.random()
+        assert m.get(key) == expected.get(key)
+    m.wait()
+    assert len(runs(tmpdir)) <= 4
+    assert list(m.items()) == list(expected.items())
+    m.close()
+
+    with pytest.raises(ValueError):
+        m[1]
+
+
+def test_ordering(tmpdir):
+    cls = sortedmap.configure(reverse=True)
+    m = diskmap(str(tmpdir), memtable_size=2, cls=cls)
+    for n in range(6):
+        m[n] = n
+    assert list(m) == [5, 4, 3, 2, 1, 0]
+    assert list(m.keys(4, 1)) == [4, 3, 2]
+    assert m.ceiling_item(10) == (5, 5)
+    m.close()
+
+    path = tmpdir.join('len')
+    m = diskmap(str(path), memtable_size=2, cls=sortedmap[len])
+    for key in 'a', 'abc', 'ab':
+        m[key] = key
+    assert list(m) == ['a', 'ab', 'abc']
+    assert m['xy'] == 'ab'
+    m.close()
+
+
+def test_equal_keys_across_types(tmpdir):
+    m = diskmap(str(tmpdir), memtable_size=1)
+    m[1] = 'a'
+    m[2.0] = 'b'
+    m.flush()
+    assert m[1.0] == 'a'
+    assert m[True] == 'a'
+    assert m[2] == 'b'
+
+
+
+def test_equal_keys_which_pickle_differently(tmpdir):
+    m = diskmap(str(tmpdir))
+    a = 'x' * 5
+    m[(a, a)] = 1
+    m.flush()
+    # the stored key repeats one string object, this key holds two
+    key = ('x' * 5, ''.join(['x'] * 5))
+    assert key in m
+    assert m[key] == 1
+
+
+def test_scan_during_writes(tmpdir):
+    m = diskmap(str(tmpdir))
+    for n in range(0, 20, 2):
+        m[n] = n
+    keys = m.keys(5)
+    assert next(keys) == 6
+    # Writes which change the memtable's size do not break the scan. The
+    # merge has already read 8 so 7 is behind the scan.
+    m[7] = 7
+    del m[10]
+    m[100] = 100
+    assert list(keys) == [8, 12, 14, 16, 18, 100]
+    assert m.ceiling_item(9) == (12, 12)
+    assert m.higher_item(12) == (14, 14)
+
+
+def test_invalid_arguments(tmpdir):
+    for kwargs in {'memtable_size': 0}, {'max_runs': 0}, {'block_size': 0}:
+        with pytest.raises(ValueError):
+            diskmap(str(tmpdir), **kwargs)
@@ -0,0 +1,217 @@
+import os
+
+import pytest
+
+from sortedmap import recover, sortedmap
+from sortedmap.journal import journal
+
+
+@pytest.fixture
+def paths(tmpdir):
+    return str(tmpdir.join('snapshot')), str(tmpdir.join('journal'))
+
+
+def test_every_change_is_recorded(paths):
+    snap, path = paths
+    m = sortedmap({-1: 'z'})
+    with journal(path) as j:
+        m.journal = j
+        assert m.journal is j
+        for n in range(10):
+            m[n] = n
+        m[3] = 'three'
+        del m[4]
+        assert m.pop(5) == 5
+        assert m.popitem() == (-1, 'z')
+        assert m.popitem(first=False) == (9, 9)
+        assert m.popitems(2) == [(0, 0), (1, 1)]
+        m.setdefault(20, 'twenty')
+        m.setdefault(20, 'ignored')
+        m.append(30, 'thirty')
+        m.update({6: 'six'})
+        m.update([(10, 'ten')])
+        m.update(sortedmap({7: 'seven', 40: 'forty'}))
+        m.map_values(str, lo=7)
+        assert m.remove_if(lambda k, v: k == 8) == 1
+        other = sortedmap({50: 'fifty'})
+        with journal(path + '.other') as other_journal:
+            other.journal = other_journal
+            m.absorb(other)
+            assert not other
+    assert recover(None, path) == m
+    assert recover(None, path + '.other') == other
+
+    m.clear()
+    m.journal = None
+    assert m.journal is None
+    m[1] = 'not recorded'
+    with journal(path) as j:
+        m.journal = j
+        m.clear()
+    assert recover(None, path) == sortedmap()
+
+
+def test_checkpoint(paths):
+    snap, path = paths
+    m = sortedmap.configure(reverse=True)()
+    j = journal(path)
+    m.journal = j
+    for n in range(100):
+        m[n] = -n
+    j.checkpoint(m, snap)
+    assert os.path.getsize(path) == 0
+
+    del m[50]
+    m[200] = 'new'
+    j.close()
+    cls = sortedmap.configure(reverse=True)
+    assert recover(snap, path, cls=cls) == m
+
+    j = journal(path)
+    m.journal = j
+    m[201] = 'newer'
+    j.commit()
+    with open(path, 'rb') as f:
+        written = f.read()
+    j.checkpoint(m, snap)
+    j.close()
+    # a crash after the snapshot but before the journal is emptied replays
+    # changes the snapshot already holds, which gives the same map
+    with open(path, 'wb') as f:
+        f.write(written)
+    assert recover(snap, path, cls=cls) == m
+
+
+def test_batching(paths):
+    _, path = paths
+    m = sortedmap()
+    j = journal(path, batch_size=3, sync=False)
+    m.journal = j
+    m[1] = 1
+    m[2] = 2
+    assert os.path.getsize(path) == 0
+    m[3] = 3
+    size = os.path.getsize(path)
+    assert size > 0
+    m[4] = 4
+    assert os.path.getsize(path) == size
+    j.commit()
+    assert os.path.getsize(path) > size
+    j.close()
+    assert recover(None, path) == m
+
+
+def test_torn_record(paths):
+    _, path = paths
+    m = sortedmap()
+    with journal(path) as j:
+        m.journal = j
+        m[1] = 'a'
+        m[2] = 'b'
+    with open(path, 'r+b') as f:
+        f.truncate(os.path.getsize(path) - 1)
+
+    assert recover(None, path) == sortedmap({1: 'a'})
+    with journal(path) as j:
+        m = recover(None, path)
+        m.journal = j
+        m[3] = 'c'
+    assert recover(None, path) == sortedmap({1: 'a', 3: 'c'})
+
+
+def test_maxsize(paths):
+    _, path = paths
+    cls = sortedmap.configure(maxsize=3)
+    m = cls()
+    with journal(path) as j:
+        m.journal = j
+        for n in [5, 1, 7, 3, 9, 0]:
+            m[n] = n
+    assert recover(None, path, cls=cls) == m
+
+
+def test_failing_journal():
+    class failing(object):
+        def record(self, op, key, value):
+            raise ValueError(op)
+
+    m = sortedmap({1: 'a', 2: 'b'})
+    m.journal = failing()
+    with pytest.raises(ValueError):
+        m[3] = 'c'
+    with pytest.raises(ValueError):
+        del m[1]
+    with pytest.raises(ValueError):
+        m.pop(1)
+    with pytest.raises(ValueError):
+        m.popitem()
+    with pytest.raises(ValueError):
+        m.setdefault(3)
+    with pytest.raises(ValueError):
+        m.append(3, 'c')
+    with pytest.raises(ValueError):
+        m.clear()
+    assert m.items() == [(1, 'a'), (2, 'b')]
+
+    with pytest.raises(TypeError):
+        m.journal = object()
+
+
+@pytest.mark.parametrize('index', [False, True])
+def test_failed_insert_is_not_recorded(paths, index):
+    _, path = paths
+    m = sortedmap.configure(index=index)()
+    with journal(path) as j:
+        m.journal = j
+        m[1] = 1
+        with pytest.raises(TypeError):
+            m['a'] = 3
+        m[1] = 2
+    assert recover(None, path) == sortedmap({1: 2})
+
+
+@pytest.mark.parametrize('index', [False, True])
+def test_unrecorded_insert_is_undone(paths, index):
+    _, path = paths
+
+    class unpicklable(int):
+        pass
+
+    m = sortedmap.configure(index=index)()
+    with journal(path) as j:
+        m.journal = j
+        m[1] = 1
+        for insert in [m.append, m.setdefault]:
+            with pytest.raises(Exception):
+                insert(2, unpicklable(2))
+            assert 2 not in m
+            assert m.get(2) is None
+        m.append(2, 2)
+    assert m == sortedmap({1: 1, 2: 2})
+    assert recover(None, path) == m
+
+
+def test_batches_are_all_or_nothing(paths):
+    _, path = paths
+
+    class unpicklable(int):
+        # a local class cannot be pickled by reference
+        pass
+
+    def fresh():
+        return sortedmap((k, k) for k in [0, 1, 2, unpicklable(3), 4])
+
+    for change in [lambda m: m.remove_if(lambda k, v: True),
+                   lambda m: m.popitems(5),
+                   lambda m: m.map_values(
+                       lambda v: unpicklable(v) if v == 3 else -v),
+                   lambda m: sortedmap().absorb(m)]:
+        m = fresh()
+        with journal(path) as j:
+            m.journal = j
+            with pytest.raises(Exception):
+                change(m)
+            m.journal = None
+        assert list(m) == [0, 1, 2, 3, 4]
+        assert recover(None, path) == sortedmap()
+        os.remove(path)
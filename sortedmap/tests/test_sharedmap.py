@@ -0,0 +1,225 @@
+import multiprocessing
+import os
+import struct
+import sys
+import uuid
+
+import pytest
+
+from sortedmap import sortedmap
+
+try:
+    from sortedmap import sharedmap
+except ImportError:
+    sharedmap = None
+
+pytestmark = pytest.mark.skipif(
+    sharedmap is None,
+    reason='shared memory is not supported on this platform',
+)
+
+
+@pytest.yield_fixture
+def name():
+    name = '/sortedmap-test-%d-%s' % (os.getpid(), uuid.uuid4().hex[:8])
+    yield name
+    try:
+        sharedmap.unlink(name)
+    except OSError:
+        pass
+
+
+def test_create_and_open(name):
+    m = sharedmap.create(name, 10, data={3: 1.5, 1: 2.5})
+    assert m.writable
+    assert m.name == name
+    assert m.capacity == 10
+    assert (m.keytype, m.valuetype) == ('q', 'd')
+    m[2] = 4
+    assert list(m) == [1, 2, 3]
+    assert m.items() == [(1, 2.5), (2, 4.0), (3, 1.5)]
+
+    with sharedmap(name) as r:
+        assert not r.writable
+        assert r[2] == 4.0
+        assert r.get(5) is None
+        assert r.get(5, 'default') == 'default'
+        assert 3 in r
+        assert 4 not in r
+        assert len(r) == 3
+        with pytest.raises(KeyError):
+            r[4]
+        with pytest.raises(TypeError):
+            r[4] = 1
+        with pytest.raises(TypeError):
+            r.clear()
+
+        # writes are visible to every open map immediately
+        m[0] = 0
+        assert r.keys() == [0, 1, 2, 3]
+    with pytest.raises(ValueError):
+        len(r)
+
+    with pytest.raises(OSError):
+        sharedmap.create(name, 10)
+    with pytest.raises(OSError):
+        sharedmap(name + '-missing')
+
+
+def test_setitem_delitem(name):
+    m = sharedmap.create(name, 4, keytype='d', valuetype='q')
+    for key in [2.5, -1.0, 7.0, 0.0]:
+        m[key] = int(key * 2)
+    m[7.0] = 100
+    assert m.items() == [(-1.0, -2), (0.0, 0), (2.5, 5), (7.0, 100)]
+    with pytest.raises(ValueError):
+        m[8.0] = 1
+    del m[0.0]
+    with pytest.raises(KeyError):
+        del m[0.0]
+    m[8.0] = 1
+    assert m.keys() == [-1.0, 2.5, 7.0, 8.0]
+    with pytest.raises(ValueError):
+        m[float('nan')] = 1
+    with pytest.raises(TypeError):
+        m[1.0] = 'a'
+    m.clear()
+    assert len(m) == 0
+
+
+def test_types(name):
+    m = sharedmap.create(name, 4, keytype='q', valuetype='q')
+    m[2 ** 62] = -2 ** 62
+    assert m[2 ** 62] == -2 ** 62
+    with pytest.raises(TypeError):
+        m[1.5]
+    with pytest.raises(OverflowError):
+        m[2 ** 64] = 1
+    for kwargs in {'keytype': 'f'}, {'valuetype': 'qq'}, {'capacity': 0}:
+        args = dict({'capacity': 4}, **kwargs)
+        with pytest.raises(ValueError):
+            sharedmap.create(name + '-bad', **args)
+
+
+def test_nan_lookups(name):
+    nan = float('nan')
+    m = sharedmap.create(name, 4, keytype='d', valuetype='q')
+    for key in [-1.0, 0.0, 1.0]:
+        m[key] = int(key)
+    assert m.get(nan) is None
+    assert m.get(nan, 5) == 5
+    assert nan not in m
+    with pytest.raises(KeyError):
+        m[nan]
+    with pytest.raises(KeyError):
+        del m[nan]
+    assert m.floor_item(nan, None) is None
+    with pytest.raises(KeyError):
+        m.ceiling_item(nan)
+    for kwargs in {'lo': nan}, {'hi': nan}:
+        with pytest.raises(ValueError):
+            m.keys(**kwargs)
+    assert len(m) == 3
+
+
+def test_range_queries(name):
+    m = sharedmap.create(
+        name,
+        100,
+        data=[(k, k / 2.0) for k in range(0, 20, 2)],
+    )
+    assert m.keys(5, 11) == [6, 8, 10]
+    assert m.values(hi=4) == [0.0, 1.0]
+    assert m.items(lo=15) == [(16, 8.0), (18, 9.0)]
+    assert m.keys(11, 5) == []
+    assert m.floor_item(7) == (6, 3.0)
+    assert m.floor_item(6) == (6, 3.0)
+    assert m.ceiling_item(7) == (8, 4.0)
+    assert m.floor_item(-1, None) is None
+    with pytest.raises(KeyError):
+        m.ceiling_item(19)
+
+
+def test_items_do_not_leak(name):
+    # small ints are shared, so a leaked key or value shows up in their
+    # reference counts
+    m = sharedmap.create(name, 10, keytype='q', valuetype='q')
+    m[1] = 2
+    start = sys.getrefcount(1), sys.getrefcount(2)
+    for _ in range(100):
+        m.items()
+        m.floor_item(1)
+        m.ceiling_item(0)
+    assert (sys.getrefcount(1), sys.getrefcount(2)) == start
+
+
+def test_update_from_sortedmap(name):
+    s = sortedmap((k, float(k * k)) for k in range(1000))
+    m = sharedmap.create(name, 2000, data=s)
+    assert m.items() == list(s.items())
+    m.update({5: 0.0, 2000: 1.0})
+    assert m[5] == 0.0
+    assert len(m) == 1001
+
+
+def test_iterator_invalidation(name):
+    m = sharedmap.create(name, 10, data={1: 1.0, 2: 2.0})
+    version = m.version
+    it = iter(m)
+    assert next(it) == 1
+    m[3] = 3.0
+    assert m.version == version + 1
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+def _reader(name, rounds, queue):
+    # every write keeps all of the values equal so a torn read would show
+    # up as a mix of values
+    with sharedmap(name) as m:
+        seen = set()
+        for _ in range(rounds):
+            values = m.values()
+            if len(set(values)) != 1:
+                queue.put('torn read: %r' % sorted(set(values))[:4])
+                return
+            seen.add(values[0])
+        queue.put(len(seen))
+
+
+def test_concurrent_reader(name):
+    m = sharedmap.create(name, 1000, data=dict.fromkeys(range(1000), 0.0))
+    queue = multiprocessing.Queue()
+    reader = multiprocessing.Process(target=_reader, args=(name, 2000, queue))
+    reader.start()
+    n = 0
+    while reader.is_alive() and n < 100000:
+        n += 1
+        m.update(dict.fromkeys(range(1000), float(n)))
+    result = queue.get(timeout=60)
+    reader.join()
+    assert isinstance(result, int), result
+
+
+@pytest.mark.skipif(
+    not os.path.isdir('/dev/shm'),
+    reason='the segments are not visible as files',
+)
+def test_dead_writer(name):
+    m = sharedmap.create(name, 10, data={1: 1.0})
+    # leave the sequence odd like a writer which died inside of a write
+    with open('/dev/shm' + name, 'r+b') as f:
+        f.seek(8)
+        f.write(struct.pack('=Q', 1))
+
+    reader = sharedmap(name, timeout=0.01)
+    with pytest.raises(OSError):
+        reader[1]
+    with pytest.raises(OSError):
+        iter(reader)
+    with pytest.raises(ValueError):
+        sharedmap(name, timeout=-1)
+
+    m.clear()
+    m[2] = 2.0
+    assert reader.items() == [(2, 2.0)]
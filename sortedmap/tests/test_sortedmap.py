@@ -1,4 +1,9 @@
+import bisect
 from collections import MutableMapping
+import gc
+from operator import attrgetter, itemgetter
+import random
+import sys
 
 import pytest
 
@@ -340,3 +345,1163 @@ def test_values_listlike(m):
     assert values * 2 == [1, 2, 3, 1, 2, 3]
     assert values  # bool
     assert not sortedmap().values()
+
+
+def test_keyfunc_refcount():
+    def keyfunc(k):
+        return k
+
+    m = sortedmap[keyfunc](a=1)
+    start = sys.getrefcount(keyfunc)
+    for _ in range(10):
+        repr(m)
+        m.keyfunc
+        m == m
+    assert sys.getrefcount(keyfunc) == start
+
+
+@pytest.mark.skipif(
+    not hasattr(sortedmap, 'stats'),
+    reason='sortedmap was not compiled with SORTEDMAP_STATS',
+)
+def test_stats():
+    m = sortedmap[len]()
+    assert m.stats() == {
+        'comparisons': 0,
+        'keyfunc_calls': 0,
+        'emplaces': 0,
+        'erases': 0,
+        'failed_lookups': 0,
+        'revision_bumps': 0,
+        'iterator_invalidations': 0,
+        'size': 0,
+        'height': 0,
+    }
+
+    m['a'] = 1
+    m['bc'] = 2
+    m['def'] = 3
+    assert m.get('ghij') is None
+    it = iter(m)
+    del m['a']
+    with pytest.raises(RuntimeError):
+        next(it)
+
+    stats = m.stats(reset=True)
+    assert stats['comparisons'] > 0
+    assert stats['keyfunc_calls'] == 2 * stats['comparisons']
+    assert stats['emplaces'] == 3
+    assert stats['erases'] == 1
+    assert stats['failed_lookups'] == 1
+    assert stats['revision_bumps'] == 4
+    assert stats['iterator_invalidations'] == 1
+    assert stats['size'] == 2
+    assert stats['height'] == 2
+
+    stats = m.stats()
+    assert stats['comparisons'] == 0
+    assert stats['size'] == 2
+
+    # copies do not share counters
+    n = m.copy()
+    n['z'] = 26
+    assert m.stats()['emplaces'] == 0
+
+
+def test_sizeof():
+    m = sortedmap()
+    empty = sys.getsizeof(m)
+    m.update((n, n) for n in range(100))
+    per_node = (sys.getsizeof(m) - empty) // 100
+    # at least the two object pointers and the tree links
+    assert per_node >= 6 * tuple.__itemsize__
+    m.clear()
+    assert sys.getsizeof(m) == empty
+
+
+def test_memory_usage():
+    m = sortedmap((n, None) for n in range(1000, 1100))
+    usage = m.memory_usage()
+    assert set(usage) == {'object', 'nodes', 'slack', 'total'}
+    assert usage['total'] == usage['object'] + usage['nodes'] + usage['slack']
+    assert usage['total'] == m.__sizeof__()
+
+    deep = m.memory_usage(deep=True)
+    assert set(deep) == set(usage) | {'keys', 'values'}
+    assert deep['keys'] == sum(sys.getsizeof(k) for k in m)
+    # ``None`` is only counted once
+    assert deep['values'] == sys.getsizeof(None)
+    assert deep['total'] == usage['total'] + deep['keys'] + deep['values']
+
+
+def test_memory_usage_index():
+    plain = sortedmap((n, None) for n in range(1000))
+    indexed = sortedmap.configure(index=True)(plain)
+    usage = indexed.memory_usage()
+    assert 'index' not in plain.memory_usage()
+    # one entry per key and at least one bucket pointer per key
+    assert usage['index'] >= 1000 * 4 * tuple.__itemsize__
+    assert usage['total'] == (
+        usage['object'] + usage['nodes'] + usage['slack'] + usage['index']
+    )
+    assert sys.getsizeof(indexed) > sys.getsizeof(plain)
+    assert indexed.__sizeof__() == usage['total']
+
+
+def test_neighbors():
+    m = sortedmap({1: 'a', 3: 'b', 5: 'c'})
+
+    assert m.floor_item(3) == (3, 'b')
+    assert m.floor_item(4) == (3, 'b')
+    assert m.floor_key(6) == 5
+    assert m.ceiling_item(3) == (3, 'b')
+    assert m.ceiling_item(2) == (3, 'b')
+    assert m.ceiling_key(0) == 1
+    assert m.lower_item(3) == (1, 'a')
+    assert m.lower_key(4) == 3
+    assert m.higher_item(3) == (5, 'c')
+    assert m.higher_key(2) == 3
+
+    ob = object()
+    for method, key in (('floor', 0),
+                        ('ceiling', 6),
+                        ('lower', 1),
+                        ('higher', 5)):
+        for kind in ('item', 'key'):
+            f = getattr(m, '%s_%s' % (method, kind))
+            with pytest.raises(KeyError) as e:
+                f(key)
+            assert e.value.args[0] == key
+            assert f(key, ob) is ob
+            assert f(key, default=None) is None
+
+
+def test_neighbors_keyfunc(keyfunc_m):
+    assert keyfunc_m.floor_item('xx') == ('bc', 2)
+    assert keyfunc_m.higher_key('xx') == 'abc'
+
+
+def test_first_last(m):
+    assert m.first_item() == ('a', 1)
+    assert m.first_key() == 'a'
+    assert m.last_item() == ('c', 3)
+    assert m.last_key() == 'c'
+    assert len(m) == 3
+
+    for f in ('first_item', 'first_key', 'last_item', 'last_key'):
+        with pytest.raises(KeyError):
+            getattr(sortedmap(), f)()
+
+
+def test_items_refcount():
+    key = object()
+    value = object()
+    m = sortedmap({key: value})
+    start = sys.getrefcount(key), sys.getrefcount(value)
+    for _ in range(10):
+        list(m.items())
+        m.first_item()
+    assert (sys.getrefcount(key), sys.getrefcount(value)) == start
+
+
+def test_append():
+    m = sortedmap()
+    m.append(1, 'a')
+    m.append(2, 'b')
+    it = iter(m)
+    m.append(3, 'c')
+    with pytest.raises(RuntimeError):
+        next(it)
+    assert list(m.items()) == [(1, 'a'), (2, 'b'), (3, 'c')]
+
+    for key in (0, 2, 3, 2.5):
+        with pytest.raises(ValueError):
+            m.append(key, 'z')
+        assert list(m.items()) == [(1, 'a'), (2, 'b'), (3, 'c')]
+
+
+def test_append_keyfunc():
+    m = sortedmap[len]()
+    m.append('a', 1)
+    m.append('aa', 2)
+    with pytest.raises(ValueError):
+        m.append('b', 3)
+    assert list(m.items()) == [('a', 1), ('aa', 2)]
+
+
+def test_setitem_ascending_and_descending():
+    m = sortedmap()
+    for n in range(100):
+        m[n] = n
+    for n in range(-1, -100, -1):
+        m[n] = n
+    for n in range(-99, 100, 3):
+        m[n] = -n
+    assert list(m.keys()) == list(range(-99, 100))
+    assert [m[n] for n in range(-99, 100, 3)] == list(range(99, -100, -3))
+
+
+def test_popitems():
+    m = sortedmap((n, str(n)) for n in range(10))
+    it = iter(m)
+    assert m.popitems(3) == [(0, '0'), (1, '1'), (2, '2')]
+    with pytest.raises(RuntimeError):
+        next(it)
+    assert m.popitems(2, first=False) == [(9, '9'), (8, '8')]
+    assert m.popitems(0) == []
+    assert list(m) == [3, 4, 5, 6, 7]
+    assert m.popitems(10, False) == [(n, str(n)) for n in range(7, 2, -1)]
+    assert not m
+    assert m.popitems(1) == []
+
+    with pytest.raises(ValueError):
+        m.popitems(-1)
+
+
+def test_setitem_replace_refcount():
+    old = object()
+    new = object()
+    m = sortedmap()
+    m['a'] = old
+    start = sys.getrefcount(old)
+    m['a'] = new
+    assert sys.getrefcount(old) == start - 1
+
+
+@pytest.mark.parametrize('keyfunc', (None, abs))
+def test_update_sortedmap_merge(keyfunc):
+    cls = sortedmap if keyfunc is None else sortedmap[keyfunc]
+    m = cls((n, 'm') for n in range(0, 100, 3))
+    n = cls((n, 'n') for n in range(0, 100, 5))
+    expected = dict(m)
+    expected.update(n)
+
+    it = iter(m)
+    m.update(n)
+    with pytest.raises(RuntimeError):
+        next(it)
+    assert list(m.items()) == sorted(expected.items())
+    assert len(n) == 20
+
+    # only replacing values does not invalidate iterators
+    it = iter(m)
+    m.update(n)
+    next(it)
+    assert list(m.items()) == sorted(expected.items())
+
+
+def test_update_sortedmap_merge_ends():
+    m = sortedmap((n, 'm') for n in range(10, 20))
+    m.update(sortedmap((n, 'n') for n in range(0, 30, 4)))
+    expected = dict((n, 'm') for n in range(10, 20))
+    expected.update((n, 'n') for n in range(0, 30, 4))
+    assert list(m.items()) == sorted(expected.items())
+
+
+def test_update_sortedmap_merge_error():
+    class Key(object):
+        fail = False
+
+        def __init__(self, n):
+            self.n = n
+
+        def __lt__(self, other):
+            if Key.fail and 5 in (self.n, other.n):
+                raise ValueError(self.n)
+            return self.n < other.n
+
+    keys = [Key(n) for n in range(10)]
+    m = sortedmap((key, None) for key in keys[:5:2])
+    n = sortedmap((key, None) for key in keys[1::2])
+    it = iter(m)
+    Key.fail = True
+    with pytest.raises(ValueError):
+        m.update(n)
+    Key.fail = False
+    # the keys merged before the error are kept
+    assert [key.n for key in m] == [0, 1, 2, 3, 4]
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+@pytest.mark.parametrize('keyfunc', (None, abs))
+def test_absorb(keyfunc):
+    cls = sortedmap if keyfunc is None else sortedmap[keyfunc]
+    m = cls((n, 'm') for n in range(0, 100, 3))
+    n = cls((n, 'n') for n in range(0, 100, 5))
+    expected = dict(m)
+    expected.update(n)
+
+    it = iter(n)
+    m.absorb(n)
+    assert list(m.items()) == sorted(expected.items())
+    assert not n
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+def test_absorb_different_order():
+    m = sortedmap({1: 'a', 2: 'b'})
+    n = sortedmap[abs]({-3: 'c', 2: 'd', -1: 'e'})
+    m.absorb(n)
+    assert not n
+    assert list(m.items()) == [(-3, 'c'), (-1, 'e'), (1, 'a'), (2, 'd')]
+
+
+def test_absorb_invalid():
+    m = sortedmap(a=1)
+    with pytest.raises(TypeError):
+        m.absorb({'b': 2})
+    with pytest.raises(ValueError):
+        m.absorb(m)
+    assert m == sortedmap(a=1)
+
+
+def test_method_keywords(m):
+    assert m.get(key='a') == 1
+    assert m.get('z', default=0) == 0
+    assert m.setdefault(key='d', default=4) == 4
+    assert m.floor_key(key='bb') == 'b'
+    assert m.ceiling_item('bb', default=None) == ('c', 3)
+    assert m.pop(key='d') == 4
+    assert m.pop('z', default=None) is None
+    assert m.popitem(first=False) == ('c', 3)
+
+
+@pytest.mark.parametrize('call', (
+    lambda m: m.get(),
+    lambda m: m.get('a', None, None),
+    lambda m: m.get('a', key='a'),
+    lambda m: m.get('a', missing=None),
+    lambda m: m.pop(default=None),
+    lambda m: m.popitem(True, False),
+    lambda m: m.popitem(last=True),
+    lambda m: m.lower_key(),
+    lambda m: m.update({}, {}),
+))
+def test_method_bad_arguments(m, call):
+    with pytest.raises(TypeError):
+        call(m)
+    assert list(m.items()) == [('a', 1), ('b', 2), ('c', 3)]
+
+
+def test_construct_with_keywords():
+    m = sortedmap({'b': 2}, a=1, c=3)
+    assert list(m.items()) == [('a', 1), ('b', 2), ('c', 3)]
+
+    n = sortedmap[len]([('ccc', 3)], a=1, bb=2)
+    assert list(n.items()) == [('a', 1), ('bb', 2), ('ccc', 3)]
+    assert type(n) is sortedmap
+
+    with pytest.raises(TypeError):
+        sortedmap({}, {})
+    with pytest.raises(TypeError):
+        sortedmap[len]({}, {})
+
+
+def test_items_reuse_result():
+    keys = [object() for _ in range(3)]
+    m = sortedmap((n, k) for n, k in enumerate(keys))
+    start = [sys.getrefcount(k) for k in keys]
+
+    held = []
+    for n, pair in enumerate(m.items()):
+        assert pair == (n, keys[n])
+        if n % 2:
+            held.append(pair)
+    assert held == [(1, keys[1])]
+
+    it = iter(m.items())
+    for n, (k, v) in enumerate(it):
+        assert (k, v) == (n, keys[n])
+    del it, held, pair, k, v
+    assert [sys.getrefcount(k) for k in keys] == start
+
+
+def test_items_reuse_result_gc_tracked():
+    m = sortedmap({1: 1, 2: []})
+    it = iter(m.items())
+    next(it)
+    # this may untrack the cached tuple because it only holds ints
+    gc.collect()
+    pair = next(it)
+    assert pair == (2, [])
+    assert gc.is_tracked(pair)
+
+
+@pytest.mark.parametrize('kind', ('keys', 'values', 'items'))
+def test_iter_chunks(kind):
+    m = sortedmap((n, -n) for n in range(10))
+    expected = list(getattr(m, kind)())
+
+    for n in (1, 3, 10, 11):
+        chunks = list(m.iter_chunks(n, kind=kind))
+        assert all(len(chunk) == n for chunk in chunks[:-1])
+        assert 0 < len(chunks[-1]) <= n
+        assert sum(chunks, []) == expected
+
+    assert list(sortedmap().iter_chunks(3, kind)) == []
+
+
+def test_iter_chunks_default_items(m):
+    assert list(m.iter_chunks(2)) == [[('a', 1), ('b', 2)], [('c', 3)]]
+
+
+def test_iter_chunks_invalid(m):
+    with pytest.raises(ValueError):
+        m.iter_chunks(0)
+    with pytest.raises(ValueError):
+        m.iter_chunks(1, kind='pairs')
+
+
+def test_iter_chunks_invalidate(m):
+    chunks = m.iter_chunks(1)
+    assert next(chunks) == [('a', 1)]
+    m['d'] = 4
+    with pytest.raises(RuntimeError):
+        next(chunks)
+
+
+def test_next_n(m):
+    it = iter(m.items())
+    assert next(it) == ('a', 1)
+    assert it.next_n(5) == [('b', 2), ('c', 3)]
+    assert it.next_n(5) == []
+
+    it = iter(m.keys())
+    assert it.next_n(2) == ['a', 'b']
+    assert next(it) == 'c'
+
+    it = iter(m.values())
+    with pytest.raises(ValueError):
+        it.next_n(0)
+    del m['a']
+    with pytest.raises(RuntimeError):
+        it.next_n(1)
+
+
+class _Key(object):
+    def __init__(self, scale):
+        self.scale = scale
+
+    def method(self, key):
+        return key * self.scale
+
+    @staticmethod
+    def static(key):
+        return -key
+
+
+@pytest.mark.parametrize('keyfunc,expected', (
+    (abs, [0, 1, -2, 3]),
+    (_Key(-1).method, [3, 1, 0, -2]),
+    (_Key.static, [3, 1, 0, -2]),
+    (lambda k: -k, [3, 1, 0, -2]),
+    (lambda *args, **kwargs: args[0], [-2, 0, 1, 3]),
+))
+def test_keyfunc_callables(keyfunc, expected):
+    m = sortedmap[keyfunc]((k, None) for k in (3, -2, 1, 0))
+    assert list(m) == expected
+    for k in expected:
+        assert k in m
+
+
+def test_keyfunc_keeps_arguments():
+    seen = []
+
+    def keyfunc(*args):
+        seen.append(args)
+        return args[0]
+
+    m = sortedmap[keyfunc](a=1, b=2, c=3)
+    assert list(m) == ['a', 'b', 'c']
+    assert seen
+    assert all(len(args) == 1 and args[0] in 'abc' for args in seen)
+
+
+def test_keyfunc_raises():
+    def keyfunc(k):
+        if k == 'bad':
+            raise ValueError(k)
+        return k
+
+    m = sortedmap[keyfunc](a=1)
+    with pytest.raises(ValueError):
+        m['bad'] = 2
+    assert m == sortedmap[keyfunc](a=1)
+
+
+def test_keyfunc_result_refcount():
+    results = {k: (k,) for k in range(20)}
+    m = sortedmap[results.__getitem__]()
+    start = [sys.getrefcount(v) for v in results.values()]
+    for k in range(20):
+        m[k] = None
+    for k in range(20):
+        assert k in m
+    del m
+    assert [sys.getrefcount(v) for v in results.values()] == start
+
+
+def test_reverse():
+    m = sortedmap.configure(reverse=True)(a=1, b=2, c=3)
+    assert m.reverse
+    assert not sortedmap().reverse
+    assert list(m) == ['c', 'b', 'a']
+    assert m.first_item() == ('c', 3)
+    assert m.popitem(first=False) == ('a', 1)
+    m.append('0', 0)
+    assert list(m.items()) == [('c', 3), ('b', 2), ('0', 0)]
+
+    n = m.copy()
+    assert n.reverse
+    assert n == m
+    assert m != sortedmap(m)
+    assert repr(m) == (
+        "sortedmap.sortedmap.configure(reverse=True)"
+        "([('c', 3), ('b', 2), ('0', 0)])"
+    )
+
+
+def test_reverse_keyfunc():
+    cls = sortedmap.configure(len, reverse=True)
+    assert repr(cls) == (
+        'sortedmap.sortedmap.configure(keyfunc=%r, reverse=True)' % len
+    )
+    m = cls(abc=1, bc=2, c=3)
+    assert m.keyfunc is len
+    assert list(m) == ['abc', 'bc', 'c']
+    m.update(sortedmap[len](dddd=4))
+    assert list(m) == ['dddd', 'abc', 'bc', 'c']
+
+
+def test_configure_defaults():
+    cls = sortedmap.configure()
+    assert repr(cls) == 'sortedmap.sortedmap.configure()'
+    m = cls(b=2, a=1)
+    assert m.keyfunc is None
+    assert not m.reverse
+    assert m == sortedmap(a=1, b=2)
+    assert repr(sortedmap.configure(len)) == repr(sortedmap[len])
+
+
+def test_maxsize_evict_first():
+    cls = sortedmap.configure(maxsize=3)
+    assert repr(cls) == 'sortedmap.sortedmap.configure(maxsize=3)'
+    m = cls((n, -n) for n in [5, 1, 4, 2, 3])
+    assert m.maxsize == 3
+    assert m.evict == 'first'
+    assert list(m.items()) == [(3, -3), (4, -4), (5, -5)]
+
+    revision = m._iter_revision
+    m[0] = 0
+    assert list(m) == [3, 4, 5]
+    assert m._iter_revision == revision
+
+    m[3] = 'replaced'
+    m[6] = -6
+    assert list(m.items()) == [(4, -4), (5, -5), (6, -6)]
+    m.append(7, -7)
+    assert m.setdefault(1, 'dropped') == 'dropped'
+    m.update(sortedmap((n, n) for n in range(10)))
+    assert list(m.items()) == [(7, 7), (8, 8), (9, 9)]
+    assert repr(m) == (
+        'sortedmap.sortedmap.configure(maxsize=3)([(7, 7), (8, 8), (9, 9)])'
+    )
+
+    c = m.copy()
+    assert c.maxsize == 3
+    c[10] = 10
+    assert list(c) == [8, 9, 10]
+    assert sortedmap().maxsize is None
+
+
+def test_maxsize_evict_last():
+    cls = sortedmap.configure(len, maxsize=2, evict='last')
+    assert repr(cls) == (
+        "sortedmap.sortedmap.configure(keyfunc=%r, maxsize=2, evict='last')"
+        % len
+    )
+    m = cls(aaa=3, a=1, aa=2)
+    assert m.evict == 'last'
+    assert list(m) == ['a', 'aa']
+    m['bbbb'] = 4
+    assert list(m) == ['a', 'aa']
+    m[''] = 0
+    assert list(m) == ['', 'a']
+
+    rev = sortedmap.configure(reverse=True, maxsize=2, evict='last')
+    assert list(rev(a=1, b=2, c=3)) == ['c', 'b']
+
+
+@pytest.mark.parametrize('kwargs,exc', [
+    ({'maxsize': 0}, ValueError),
+    ({'maxsize': -1}, ValueError),
+    ({'maxsize': 'a'}, TypeError),
+    ({'evict': 'middle'}, ValueError),
+])
+def test_maxsize_invalid(kwargs, exc):
+    with pytest.raises(exc):
+        sortedmap.configure(**kwargs)
+
+
+def test_index():
+    cls = sortedmap.configure(index=True)
+    assert repr(cls) == 'sortedmap.sortedmap.configure(index=True)'
+    m = cls((n, str(n)) for n in range(10))
+    assert m.index
+    assert not sortedmap().index
+    assert m[3] == '3'
+    assert m.get(10, 'missing') == 'missing'
+    assert 9 in m
+    assert 10 not in m
+    assert 3.0 in m
+    with pytest.raises(KeyError):
+        m[10]
+
+    revision = m._iter_revision
+    m[3] = 'three'
+    assert m._iter_revision == revision
+    assert m.pop(3) == 'three'
+    assert 3 not in m
+    del m[4]
+    m[-1] = '-1'
+    m.append(10, '10')
+    assert m.setdefault(-1, 'dropped') == '-1'
+    assert m.setdefault(11) is None
+    assert m.popitem() == (-1, '-1')
+    assert m.popitem(first=False) == (11, None)
+    assert m.popitems(2) == [(0, '0'), (1, '1')]
+    assert -1 not in m
+    assert 0 not in m
+    assert list(m) == [2, 5, 6, 7, 8, 9, 10]
+    assert all(m[k] == str(k) for k in m)
+
+    c = m.copy()
+    assert c.index
+    m.clear()
+    assert 2 not in m
+    assert c[2] == '2'
+    m.update(c)
+    m.update(sortedmap({1.5: '1.5'}))
+    assert m[5] == '5'
+    assert m[1.5] == '1.5'
+
+    other = sortedmap.configure(index=True)({12: '12'})
+    m.absorb(other)
+    assert not other
+    assert 12 not in other
+    assert m[12] == '12'
+
+    assert repr(m) == 'sortedmap.sortedmap.configure(index=True)(%r)' % (
+        list(m.items()),
+    )
+
+
+def test_index_with_maxsize_and_reverse():
+    cls = sortedmap.configure(reverse=True, maxsize=2, index=True)
+    assert repr(cls) == (
+        'sortedmap.sortedmap.configure(reverse=True, maxsize=2, index=True)'
+    )
+    m = cls((n, n) for n in range(5))
+    assert list(m) == [1, 0]
+    assert 4 not in m
+    assert m[1] == 1
+    m[-1] = -1
+    assert list(m) == [0, -1]
+    assert 1 not in m
+
+
+def test_finger():
+    m = sortedmap((n, -n) for n in range(0, 1000, 2))
+    f = m.finger()
+    assert f.seek(-1) == (0, 0)
+    assert f.seek(3) == (4, -4)
+    assert f.seek(998) == (998, -998)
+    assert f.seek(999) is None
+    assert f.seek(2) == (2, -2)
+
+    for n in range(1000):
+        assert (n in f) == (n % 2 == 0)
+        assert f.get(n, 'missing') == (-n if n % 2 == 0 else 'missing')
+    for n in range(998, -1, -2):
+        assert f[n] == -n
+    assert f[500] == -500
+    assert f[4] == -4
+    with pytest.raises(KeyError):
+        f[5]
+
+    f = m.finger(501)
+    assert f.seek(501) == (502, -502)
+    assert m.finger(key=None).seek(-1) == (0, 0)
+
+
+def test_finger_matches_bisect():
+    rand = random.Random(0)
+    keys = sorted(rand.sample(range(100000), 5000))
+    m = sortedmap((k, None) for k in keys)
+    f = m.finger()
+    target = 0
+    for n in range(4000):
+        if n % 2:
+            target = rand.randrange(-10, 100010)
+        else:
+            target += rand.randrange(-100, 100)
+        ix = bisect.bisect_left(keys, target)
+        expected = (keys[ix], None) if ix < len(keys) else None
+        assert f.seek(target) == expected
+
+
+def test_finger_after_changes():
+    m = sortedmap((n, n) for n in range(10))
+    f = m.finger(5)
+    del m[5]
+    assert f.get(5) is None
+    assert f[6] == 6
+    m[5] = 'new'
+    assert f[5] == 'new'
+    m.clear()
+    assert f.seek(0) is None
+    assert 5 not in f
+    m.update((n, n) for n in range(3))
+    assert f[2] == 2
+
+    r = sortedmap.configure(reverse=True)((n, n) for n in range(10))
+    f = r.finger()
+    assert f.seek(7) == (7, 7)
+    assert f.seek(100) == (9, 9)
+    assert f[0] == 0
+
+
+
+@pytest.mark.parametrize('sort', [True, False])
+def test_asof_matches_bisect(sort):
+    rand = random.Random(0)
+    keys = sorted(rand.sample(range(0, 100000, 2), 2000))
+    m = sortedmap((k, -k) for k in keys)
+    probes = [rand.randrange(-10, 100010) for _ in range(3000)]
+    probes += keys[:100]
+    if sort:
+        probes.sort()
+
+    expected = []
+    for probe in probes:
+        ix = bisect.bisect_right(keys, probe)
+        expected.append(-keys[ix - 1] if ix else 'missing')
+    assert m.asof(probes, default='missing') == expected
+    assert m.asof(iter(probes), 'missing') == expected
+
+
+def test_asof():
+    m = sortedmap({1: 'a', 3: 'b', 5: 'c'})
+    assert m.asof([0, 1, 2, 3, 4, 5, 6]) == [
+        None, 'a', 'a', 'b', 'b', 'c', 'c',
+    ]
+    assert m.asof([]) == []
+    assert m.asof((9, 9, 0), default=0) == ['c', 'c', 0]
+    assert sortedmap().asof([1, 2], 'x') == ['x', 'x']
+
+    r = sortedmap.configure(reverse=True)(m)
+    assert r.asof([6, 5, 4, 0]) == [None, 'c', 'c', 'a']
+    assert sortedmap[len]({'a': 1, 'ccc': 3}).asof(['bb']) == [1]
+
+    with pytest.raises(TypeError):
+        m.asof(1)
+    with pytest.raises(TypeError):
+        m.asof(['a'])
+    with pytest.raises(TypeError):
+        m.asof()
+
+
+def test_index_errors():
+    m = sortedmap.configure(index=True)()
+    with pytest.raises(TypeError):
+        m[[1]] = 1
+    with pytest.raises(TypeError):
+        [1] in m
+    assert not m
+
+    with pytest.raises(ValueError):
+        sortedmap.configure(len, index=True)
+    with pytest.raises(TypeError):
+        sortedmap.configure(index=True)(sortedmap({(1, [2]): 3}))
+
+
+class _Point(object):
+    def __init__(self, x, y):
+        self.x = x
+        self.pos = self
+        self.y = y
+
+    def __repr__(self):
+        return '_Point(%r, %r)' % (self.x, self.y)
+
+
+@pytest.mark.parametrize('keyfunc,name', (
+    (itemgetter(1), 'y'),
+    (itemgetter(0, 1), None),
+    (attrgetter('y'), 'y'),
+    (attrgetter('pos.y'), 'y'),
+    (attrgetter('x', 'y'), None),
+))
+def test_operator_keyfuncs(keyfunc, name):
+    if isinstance(keyfunc, itemgetter):
+        keys = [(0, 2), (1, 1), (2, 0)]
+    else:
+        keys = [_Point(0, 2), _Point(1, 1), _Point(2, 0)]
+
+    m = sortedmap[keyfunc]((k, None) for k in keys)
+    expected = keys if name is None else keys[::-1]
+    assert list(m) == expected
+    for k in keys:
+        assert k in m
+
+    m = sortedmap.configure(keyfunc, reverse=True)((k, None) for k in keys)
+    assert list(m) == expected[::-1]
+
+
+def test_operator_keyfunc_errors():
+    m = sortedmap[itemgetter('a')]()
+    m[{'a': 1}] = None
+    with pytest.raises(KeyError):
+        m[{'b': 1}] = None
+
+    m = sortedmap[attrgetter('x.y')]()
+    m[_Point(_Point(0, 1), 0)] = None
+    with pytest.raises(AttributeError):
+        m[_Point(1, 0)] = None
+
+
+def test_tuple_keys():
+    keys = [
+        (1, 'b'),
+        (1, 'a'),
+        (0, 'z', 1.5),
+        (0, 'z'),
+        (0, 'z', -1.5),
+        (2 ** 70, 'a'),
+        (-2 ** 70, 'a'),
+        (1.5, 'a'),
+        (1, 'a', (2, 1)),
+        (1, 'a', (1, 2)),
+        (),
+    ]
+    m = sortedmap.fromkeys(keys)
+    assert list(m) == sorted(keys)
+    for k in keys:
+        assert k in m
+    assert (1, 'a', (1, 2)) in m
+    assert (1, 'c') not in m
+    assert m.floor_key((1, 'a', (1, 3))) == (1, 'a', (1, 2))
+    rev = sortedmap.configure(reverse=True)((k, None) for k in keys)
+    assert list(rev) == sorted(keys, reverse=True)
+
+
+def test_tuple_keys_incomparable():
+    m = sortedmap.fromkeys([(1, 'a')])
+    with pytest.raises(TypeError):
+        m[(1, 2)] = None
+    assert list(m) == [(1, 'a')]
+
+
+def test_tuple_subclass_keys():
+    class Rev(tuple):
+        def __lt__(self, other):
+            return tuple.__gt__(self, other)
+
+    keys = [Rev((1, 2)), Rev((2, 1)), Rev((1, 1))]
+    m = sortedmap.fromkeys(keys)
+    assert list(m) == sorted(keys)
+
+
+def test_count_range():
+    m = sortedmap.fromkeys(range(0, 20, 2))
+    assert m.count_range() == 10
+    assert m.count_range(4, 10) == 3
+    assert m.count_range(3, 11) == 4
+    assert m.count_range(lo=15) == 2
+    assert m.count_range(hi=1) == 1
+    assert m.count_range(10, 4) == 0
+    assert m.count_range(4, 4) == 0
+    assert m.count_range(100) == 0
+
+    r = sortedmap.configure(reverse=True)((n, None) for n in range(10))
+    assert r.count_range(8, 3) == 5
+    assert r.count_range(3, 8) == 0
+
+    with pytest.raises(TypeError):
+        m.count_range('a', 'b')
+
+
+def _check_counts(m):
+    keys = list(m)
+    bounds = [None] + keys + [k + 0.5 for k in keys] + [-1, 10 ** 6]
+    for lo in bounds[::3]:
+        for hi in bounds[::2]:
+            expected = sum(
+                1 for k in keys
+                if (lo is None or k >= lo) and (hi is None or k < hi)
+            )
+            assert m.count_range(lo, hi) == expected, (lo, hi)
+            assert m.aggregate(lo, hi, op='count') == expected
+
+
+def test_count_range_aggregate():
+    cls = sortedmap.configure(aggregate=True)
+    assert repr(cls) == 'sortedmap.sortedmap.configure(aggregate=True)'
+    m = cls((n, n) for n in range(0, 200, 3))
+    assert repr(m).startswith(
+        'sortedmap.sortedmap.configure(aggregate=True)([(0, 0), '
+    )
+    _check_counts(m)
+
+    for n in range(0, 200, 7):
+        m[n] = n
+    del m[3]
+    m.pop(6)
+    m.popitem()
+    m.popitems(3, first=False)
+    m.setdefault(-5, -5)
+    m.append(1000, 1000)
+    m.remove_if(lambda k, v: k % 2, 50, 100)
+    _check_counts(m)
+
+    c = m.copy()
+    m.update(sortedmap({0.5: 0.5, 1.5: 1.5}))
+    m.absorb(cls({2.5: 2.5}))
+    other = cls({4.5: 4.5, 5.5: 5.5})
+    m.absorb(other)
+    _check_counts(m)
+    _check_counts(other)
+    _check_counts(c)
+
+    m.clear()
+    assert m.count_range() == 0
+    m.update(c)
+    _check_counts(m)
+    with pytest.raises(TypeError):
+        m.count_range('a', 'b')
+
+    bounded = sortedmap.configure(maxsize=10, aggregate=True)(
+        (n, n) for n in range(100)
+    )
+    _check_counts(bounded)
+    assert bounded.count_range() == 10
+
+    usage = m.memory_usage()
+    assert usage['aggregate'] > 0
+    assert usage['total'] == sum(v for k, v in usage.items() if k != 'total')
+    assert 'aggregate' not in sortedmap(m).memory_usage()
+
+
+@pytest.mark.parametrize('values', [
+    [3, 1, 4, 1, 5, 9, 2, 6],
+    [3.5, 1.25, -4.0, 0.5],
+    [1, 2.5, 3],
+    [sys.maxsize, sys.maxsize, -5],
+    [1, 2, 3.5, 10 ** 30],
+    [2 ** 53, 2 ** 53, 1.5, -2],
+    [1, 1.0, True, 0.5],
+])
+@pytest.mark.parametrize('aggregate', [False, True])
+def test_aggregate(values, aggregate):
+    m = sortedmap.configure(aggregate=aggregate)(enumerate(values))
+    for lo, hi in (None, None), (1, None), (None, 3), (1, 3):
+        start = 0 if lo is None else lo
+        stop = len(values) if hi is None else hi
+        expected = values[start:stop]
+        total = sum(expected)
+        if isinstance(total, float):
+            # the summaries may add the floats in a different order
+            total = pytest.approx(total)
+        assert m.aggregate(lo, hi) == total
+        assert type(m.aggregate(lo, hi)) is type(sum(expected))
+        assert m.aggregate(lo, hi, 'min') is min(expected)
+        assert m.aggregate(lo, hi, 'max') is max(expected)
+        assert m.aggregate(lo, hi, op='count') == len(expected)
+
+
+def test_aggregate_tracks_changes():
+    rand = random.Random(3)
+    plain = sortedmap()
+    m = sortedmap.configure(aggregate=True)()
+
+    def check():
+        assert list(m.items()) == list(plain.items())
+        keys = list(m)
+        bounds = [None] + keys[::5] + [-1]
+        for lo in bounds:
+            hi = rand.choice(bounds)
+            for op in 'min', 'max', 'count':
+                try:
+                    expected = plain.aggregate(lo, hi, op)
+                except ValueError:
+                    with pytest.raises(ValueError):
+                        m.aggregate(lo, hi, op)
+                else:
+                    assert m.aggregate(lo, hi, op) == expected
+            # the values are ints so the sums are exact
+            assert m.aggregate(lo, hi) == plain.aggregate(lo, hi)
+
+    def both(f):
+        f(plain)
+        f(m)
+
+    for _ in range(300):
+        key = rand.randrange(200)
+        value = rand.randrange(-1000, 1000)
+        both(lambda d: d.__setitem__(key, value))
+    check()
+    for key in rand.sample(list(plain), 50):
+        both(lambda d: d.pop(key))
+    both(lambda d: d.popitems(5))
+    both(lambda d: d.setdefault(-3, 7))
+    both(lambda d: d.append(500, -2000))
+    check()
+    both(lambda d: d.map_values(lambda v: v * 3 - 1, 20, 150))
+    both(lambda d: d.map_values(mul=-1, lo=100))
+    both(lambda d: d.remove_if(lambda k, v: v % 4 == 0, hi=80))
+    check()
+    both(lambda d: d.update(sortedmap((k, k) for k in range(0, 300, 9))))
+    both(lambda d: d.update({1: 10 ** 6, 2: -10 ** 6}))
+    both(lambda d: d.absorb(sortedmap({1000.5: 3})))
+    check()
+
+    # values the summary does not reduce are walked
+    both(lambda d: d.__setitem__(50, 2 ** 60))
+    both(lambda d: d.__setitem__(51, 'a'))
+    assert m.aggregate(hi=50, op='max') is plain.aggregate(hi=50, op='max')
+    assert m.aggregate(50, 51) == 2 ** 60
+    with pytest.raises(TypeError):
+        m.aggregate()
+    both(lambda d: d.__delitem__(51))
+    check()
+
+
+@pytest.mark.parametrize('aggregate', [False, True])
+def test_aggregate_objects_and_errors(aggregate):
+    m = sortedmap.configure(aggregate=aggregate)(a=[1], b=[2], c=[3])
+    assert m.aggregate('b', op='max') == [3]
+    with pytest.raises(TypeError):
+        m.aggregate()
+    assert m.aggregate('x') == 0
+    with pytest.raises(ValueError):
+        m.aggregate('x', op='min')
+    with pytest.raises(ValueError):
+        m.aggregate(op='mean')
+
+
+def test_remove_if_and_retain_if():
+    m = sortedmap((n, n * n) for n in range(10))
+    revision = m._iter_revision
+    assert m.remove_if(lambda k, v: k % 3 == 0) == 4
+    assert m._iter_revision == revision + 1
+    assert list(m) == [1, 2, 4, 5, 7, 8]
+    assert m.remove_if(lambda k, v: v > 30, lo=5) == 2
+    assert m.remove_if(lambda k, v: True, 2, 4) == 1
+    assert list(m) == [1, 4, 5]
+
+    revision = m._iter_revision
+    assert m.remove_if(lambda k, v: False) == 0
+    assert m._iter_revision == revision
+
+    m = sortedmap((n, n) for n in range(10))
+    assert m.retain_if(lambda k, v: k % 2, hi=6) == 3
+    assert list(m) == [1, 3, 5, 6, 7, 8, 9]
+    assert m.retain_if(pred=lambda k, v: False, lo=8, hi=7) == 0
+    assert len(m) == 7
+
+
+def test_remove_if_errors():
+    m = sortedmap((n, n) for n in range(5))
+
+    def fail(k, v):
+        if k == 3:
+            raise ValueError(k)
+        return True
+
+    with pytest.raises(ValueError):
+        m.remove_if(fail)
+    assert list(m) == [0, 1, 2, 3, 4]
+
+    with pytest.raises(RuntimeError):
+        m.remove_if(lambda k, v: m.pop(4) and False)
+    assert list(m) == [0, 1, 2, 3]
+    with pytest.raises(TypeError):
+        m.remove_if()
+
+    m = sortedmap.configure(index=True)((n, n) for n in range(5))
+    assert m.remove_if(lambda k, v: k < 2) == 2
+    assert 1 not in m
+    assert m[2] == 2
+
+
+def test_map_values():
+    m = sortedmap((n, n) for n in range(10))
+    it = iter(m)
+    next(it)
+    assert m.map_values(lambda v: -v, lo=5) is None
+    assert list(m.values()) == [0, 1, 2, 3, 4, -5, -6, -7, -8, -9]
+    assert m.map_values(str, 2, 4) is None
+    assert list(m.values())[:5] == [0, 1, '2', '3', 4]
+    # the keys did not change so iterators keep going
+    assert list(it) == list(range(1, 10))
+
+    def fail(v):
+        if v == -7:
+            raise ValueError(v)
+        return 0
+
+    with pytest.raises(ValueError):
+        m.map_values(fail)
+    assert m[9] == -9
+    with pytest.raises(RuntimeError):
+        m.map_values(lambda v: m.pop(9, v))
+    with pytest.raises(TypeError):
+        m.map_values()
+    with pytest.raises(TypeError):
+        m.map_values(str, mul=2)
+
+
+@pytest.mark.parametrize('values,mul,add', [
+    ([1, -2, 3], 3, None),
+    ([1, -2, 3], None, 5),
+    ([1, -2, 3], -2, 7),
+    ([1, -2, 3], 0.5, 1),
+    ([1, -2, 3], 2, 0.25),
+    ([1.5, -2.25], 2, None),
+    ([1.5, -2.25], 0.1, -1),
+    ([sys.maxsize, -sys.maxsize], 2, 1),
+    ([sys.maxsize], None, 1),
+    ([10 ** 30, 5], 3, 2.5),
+    ([True, False], 2, None),
+    (['a', 'b'], 3, None),
+    ([[1], [2]], None, [3]),
+])
+def test_map_values_scalar(values, mul, add):
+    def expected(v):
+        if mul is not None:
+            v = v * mul
+        if add is not None:
+            v = v + add
+        return v
+
+    m = sortedmap(enumerate(values))
+    m.map_values(mul=mul, add=add)
+    result = list(m.values())
+    assert result == [expected(v) for v in values]
+    assert list(map(type, result)) == [type(expected(v)) for v in values]
+
+    m = sortedmap(enumerate(values))
+    m.map_values(lo=1, mul=mul, add=add)
+    assert list(m.values()) == values[:1] + [expected(v) for v in values[1:]]
+
+
+def test_map_values_scalar_errors():
+    m = sortedmap({1: 1, 2: 'a', 3: 3})
+    with pytest.raises(TypeError):
+        m.map_values(add=1)
+    assert list(m.values()) == [1, 'a', 3]
+    m = sortedmap({1: 1.5})
+    with pytest.raises(OverflowError):
+        m.map_values(mul=10 ** 400)
@@ -0,0 +1,118 @@
+import pytest
+
+from sortedmap import sortedmultimap
+
+
+@pytest.fixture
+def m():
+    return sortedmultimap([('b', 1), ('a', 2), ('b', 3), ('c', 4), ('b', 5)])
+
+
+def test_construct():
+    assert list(sortedmultimap().items()) == []
+    assert (
+        list(sortedmultimap({'b': 1, 'a': 2}, c=3).items()) ==
+        [('a', 2), ('b', 1), ('c', 3)]
+    )
+
+
+def test_insertion_order_within_key(m):
+    assert list(m) == ['a', 'b', 'b', 'b', 'c']
+    assert list(m.values()) == [2, 1, 3, 5, 4]
+    assert m.items() == [('a', 2), ('b', 1), ('b', 3), ('b', 5), ('c', 4)]
+    assert len(m) == 5
+
+
+def test_add(m):
+    m.add('b', 0)
+    m.add('0', 6)
+    assert m['b'] == [1, 3, 5, 0]
+    assert list(m)[0] == '0'
+
+
+def test_getitem(m):
+    assert m['a'] == [2]
+    assert m['b'] == [1, 3, 5]
+    assert 'b' in m
+    assert 'd' not in m
+    with pytest.raises(KeyError):
+        m['d']
+
+
+def test_count_and_equal_range(m):
+    assert m.count('b') == 3
+    assert m.count('a') == 1
+    assert m.count('d') == 0
+    assert m.equal_range('b') == [('b', 1), ('b', 3), ('b', 5)]
+    assert m.equal_range('d') == []
+
+
+def test_delitem(m):
+    del m['b']
+    assert m.items() == [('a', 2), ('c', 4)]
+    with pytest.raises(KeyError):
+        del m['b']
+
+
+def test_setitem_raises(m):
+    with pytest.raises(TypeError):
+        m['a'] = 1
+    assert m['a'] == [2]
+
+
+def test_popitem(m):
+    assert m.popitem() == ('a', 2)
+    assert m.popitem(first=False) == ('c', 4)
+    assert m.popitem(first=False) == ('b', 5)
+    m.clear()
+    with pytest.raises(KeyError):
+        m.popitem()
+
+
+def test_update(m):
+    m.update([('a', 0)], c=1)
+    m.update(sortedmultimap(b=0))
+    assert m['a'] == [2, 0]
+    assert m['b'] == [1, 3, 5, 0]
+    assert m['c'] == [4, 1]
+    with pytest.raises(ValueError):
+        m.update([(1, 2, 3)])
+
+
+def test_copy_and_eq(m):
+    c = m.copy()
+    assert c == m
+    c.add('a', 2)
+    assert c != m
+    assert sortedmultimap([(1, 2), (1, 3)]) != sortedmultimap(
+        [(1, 3), (1, 2)],
+    )
+
+
+def test_keyfunc_and_reverse():
+    m = sortedmultimap[len]([('ab', 1), ('c', 2), ('de', 3)])
+    assert m.keyfunc is len
+    assert m.items() == [('c', 2), ('ab', 1), ('de', 3)]
+    assert m.count('xy') == 2
+
+    m = sortedmultimap.configure(reverse=True)([(1, 'a'), (2, 'b'), (1, 'c')])
+    assert m.reverse
+    assert m.items() == [(2, 'b'), (1, 'a'), (1, 'c')]
+    assert repr(m) == (
+        "sortedmap.sortedmultimap.configure(reverse=True)"
+        "([(2, 'b'), (1, 'a'), (1, 'c')])"
+    )
+    with pytest.raises(TypeError):
+        sortedmultimap.configure(maxsize=2)
+
+
+def test_iterator_invalidation(m):
+    it = iter(m.items())
+    next(it)
+    m.add('z', 0)
+    with pytest.raises(RuntimeError):
+        next(it)
+    it = iter(m)
+    m.clear()
+    with pytest.raises(RuntimeError):
+        next(it)
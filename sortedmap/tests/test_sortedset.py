@@ -0,0 +1,176 @@
+import sys
+
+import pytest
+
+from sortedmap import sortedmap, sortedset
+
+
+@pytest.fixture
+def s():
+    return sortedset([5, 1, 3, 9, 7])
+
+
+def test_construct(s):
+    assert list(sortedset()) == []
+    assert list(s) == [1, 3, 5, 7, 9]
+    assert list(sortedset('hello')) == ['e', 'h', 'l', 'o']
+    assert len(s) == 5
+    assert s
+    assert not sortedset()
+
+
+def test_add_discard_remove(s):
+    s.add(4)
+    s.add(4)
+    assert list(s) == [1, 3, 4, 5, 7, 9]
+    s.discard(4)
+    s.discard(4)
+    s.remove(1)
+    assert list(s) == [3, 5, 7, 9]
+    with pytest.raises(KeyError):
+        s.remove(1)
+    assert 3 in s
+    assert 1 not in s
+
+
+def test_pop(s):
+    assert s.pop() == 1
+    assert s.pop(first=False) == 9
+    assert list(s) == [3, 5, 7]
+    s.clear()
+    with pytest.raises(KeyError):
+        s.pop()
+
+
+def test_neighbors(s):
+    assert s.floor(4) == 3
+    assert s.floor(5) == 5
+    assert s.ceiling(4) == 5
+    assert s.lower(5) == 3
+    assert s.higher(5) == 7
+    assert s.first() == 1
+    assert s.last() == 9
+    assert s.lower(1, None) is None
+    with pytest.raises(KeyError):
+        s.higher(9)
+
+
+def test_range(s):
+    assert s.range() == [1, 3, 5, 7, 9]
+    assert s.range(3, 7) == [3, 5]
+    assert s.range(2) == [3, 5, 7, 9]
+    assert s.range(hi=5) == [1, 3]
+    assert s.range(7, 3) == []
+    assert s.range(4, 4) == []
+
+
+def test_algebra(s):
+    other = sortedset([1, 2, 3, 10])
+    assert list(s | other) == [1, 2, 3, 5, 7, 9, 10]
+    assert list(s & other) == [1, 3]
+    assert list(s - other) == [5, 7, 9]
+    assert list(s ^ other) == [2, 5, 7, 9, 10]
+    assert list(s.union([0, 11])) == [0, 1, 3, 5, 7, 9, 11]
+    assert list(s.intersection(range(4))) == [1, 3]
+    assert list(s.difference(range(4))) == [5, 7, 9]
+    assert list(s.symmetric_difference(range(3))) == [0, 2, 3, 5, 7, 9]
+    assert s.isdisjoint([2, 4])
+    assert not s.isdisjoint([2, 3])
+    assert sortedset([1, 3]).issubset(s)
+    assert s.issuperset([9])
+    with pytest.raises(TypeError):
+        s | [1]
+
+
+def test_algebra_keeps_ordering():
+    a = sortedset.configure(reverse=True)([1, 2, 3])
+    b = sortedset([2, 3, 4])
+    assert list(a | b) == [4, 3, 2, 1]
+    assert list(b | a) == [1, 2, 3, 4]
+    assert (a | b).reverse
+
+
+def test_compare(s):
+    assert s == sortedset([9, 7, 5, 3, 1])
+    assert s != sortedset([1])
+    assert sortedset([1, 3]) < s
+    assert sortedset([1, 3]) <= s
+    assert s <= s
+    assert not s < s
+    assert s > sortedset([9])
+    assert not sortedset([2]) <= s
+    assert s != {1, 3, 5, 7, 9}
+
+
+def test_keyfunc():
+    s = sortedset[len](['abc', 'a', 'xy', 'z'])
+    assert list(s) == ['a', 'xy', 'abc']
+    assert s.keyfunc is len
+    assert 'q' in s
+    assert repr(s) == (
+        "sortedmap.sortedset[<built-in function len>](['a', 'xy', 'abc'])"
+    )
+
+
+def test_iterator_invalidation(s):
+    it = iter(s)
+    assert next(it) == 1
+    assert it.next_n(2) == [3, 5]
+    s.add(4)
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+def test_update_and_copy(s):
+    c = s.copy()
+    c.update([2, 4])
+    c.update(c)
+    assert list(c) == [1, 2, 3, 4, 5, 7, 9]
+    assert list(s) == [1, 3, 5, 7, 9]
+
+
+def test_update_interleaved():
+    evens = sortedset(range(0, 20, 2))
+    evens.update(sortedset(range(1, 30, 3)))
+    assert list(evens) == sorted(set(range(0, 20, 2)) | set(range(1, 30, 3)))
+
+    r = sortedset.configure(reverse=True)
+    s = r([1, 5, 9])
+    s.update(r([0, 5, 10]))
+    assert list(s) == [10, 9, 5, 1, 0]
+
+
+def test_update_error_bumps_revision():
+    class poison(object):
+        def __lt__(self, other):
+            raise ValueError('poison')
+
+        __gt__ = __lt__
+
+    # the tuples only compare their poison when the ints are equal
+    s = sortedset([(1, poison())])
+    it = iter(s)
+    with pytest.raises(ValueError):
+        s.update(sortedset([(0, poison()), (1, poison())]))
+    assert len(s) == 2
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+
+def test_memory_usage():
+    s = sortedset(range(1000, 1100))
+    usage = s.memory_usage()
+    assert set(usage) == {'object', 'nodes', 'slack', 'total'}
+    assert usage['total'] == usage['object'] + usage['nodes'] + usage['slack']
+    assert usage['total'] == s.__sizeof__()
+    # each node holds the links and at least the key pointer
+    assert usage['nodes'] >= 100 * 4 * tuple.__itemsize__
+    # the nodes hold no values
+    m = sortedmap.fromkeys(s)
+    assert sys.getsizeof(s) < sys.getsizeof(m)
+
+    deep = s.memory_usage(deep=True)
+    assert set(deep) == set(usage) | {'keys'}
+    assert deep['keys'] == sum(sys.getsizeof(k) for k in s)
+    assert deep['total'] == usage['total'] + deep['keys']